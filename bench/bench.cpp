@@ -0,0 +1,477 @@
+// Microbenchmarks of the wrapper against the equivalent raw sqlite3 C API calls. Every wrapper
+// benchmark has a Raw counterpart doing the same work, so any difference is overhead added by
+// sqlitepp.
+#include "sqlitepp.hpp"
+#include <benchmark/benchmark.h>
+using namespace std;
+
+namespace
+{
+constexpr int table_rows = 1000;
+constexpr int blob_bytes = 64 * 1024;
+
+// An in-memory database with a table of table_rows rows of every column type the loaders handle.
+sqlite::database make_database()
+{
+    sqlite::database db(":memory:");
+    db.execute("create table t(id integer primary key, i integer, d real, s text, n integer, b blob)").step();
+    db.atomic([&]() {
+        auto stmt = db.prepare("insert into t(i, d, s, n, b) values (?, ?, ?, ?, ?)");
+        vector<uint8_t> bytes(blob_bytes, 0xab);
+        for (int i = 0; i < table_rows; i++)
+        {
+            stmt.reset();
+            // Bound statically, so the text must outlive step().
+            auto text = "row number " + to_string(i);
+            stmt.bind_multiple(i, i * 0.5, text, i, bytes);
+            if (i % 2 == 0)
+                stmt.bind(3, nullptr);
+            stmt.step();
+        }
+    });
+    return db;
+}
+
+void check(int rc, int expected = SQLITE_OK)
+{
+    if (rc != expected)
+        throw runtime_error(sqlite3_errstr(rc));
+}
+
+// prepare vs cached prepare
+
+void Raw_Prepare(benchmark::State& state)
+{
+    auto db = make_database();
+    for (auto _ : state)
+    {
+        sqlite3_stmt* stmt;
+        check(sqlite3_prepare_v2(db.handle(), "select s from t where id = ?", -1, &stmt, nullptr));
+        benchmark::DoNotOptimize(stmt);
+        sqlite3_finalize(stmt);
+    }
+}
+BENCHMARK(Raw_Prepare);
+
+void Prepare(benchmark::State& state)
+{
+    auto db = make_database();
+    for (auto _ : state)
+    {
+        auto stmt = db.prepare("select s from t where id = ?");
+        benchmark::DoNotOptimize(stmt.handle());
+    }
+}
+BENCHMARK(Prepare);
+
+void Raw_PrepareReuse(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select s from t where id = ?", -1, &stmt, nullptr));
+    for (auto _ : state)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        benchmark::DoNotOptimize(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_PrepareReuse);
+
+void PrepareCached(benchmark::State& state)
+{
+    auto db = make_database();
+    for (auto _ : state)
+    {
+        auto stmt = db.prepare_cached("select s from t where id = ?");
+        benchmark::DoNotOptimize(stmt.handle());
+    }
+}
+BENCHMARK(PrepareCached);
+
+// bind_multiple per type
+
+template <typename T>
+T bind_value()
+{
+    if constexpr (is_same_v<T, string>)
+        return string(32, 'x');
+    else if constexpr (is_same_v<T, string_view>)
+        return "a string view of some length";
+    else if constexpr (is_same_v<T, vector<uint8_t>>)
+        return vector<uint8_t>(256, 0xab);
+    else
+        return T(42);
+}
+
+template <typename T>
+void raw_bind(sqlite3_stmt* stmt, int index, const T& value)
+{
+    if constexpr (is_same_v<T, int32_t>)
+        sqlite3_bind_int(stmt, index, value);
+    else if constexpr (is_same_v<T, int64_t>)
+        sqlite3_bind_int64(stmt, index, value);
+    else if constexpr (is_same_v<T, double>)
+        sqlite3_bind_double(stmt, index, value);
+    else if constexpr (is_same_v<T, vector<uint8_t>>)
+        sqlite3_bind_blob(stmt, index, value.data(), value.size(), SQLITE_STATIC);
+    else
+        sqlite3_bind_text(stmt, index, value.data(), value.size(), SQLITE_STATIC);
+}
+
+template <typename T>
+void Raw_Bind(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select ?, ?, ?", -1, &stmt, nullptr));
+    T value = bind_value<T>();
+    for (auto _ : state)
+    {
+        sqlite3_reset(stmt);
+        raw_bind(stmt, 1, value);
+        raw_bind(stmt, 2, value);
+        raw_bind(stmt, 3, value);
+    }
+    sqlite3_finalize(stmt);
+}
+
+template <typename T>
+void BindMultiple(benchmark::State& state)
+{
+    auto db = make_database();
+    auto stmt = db.prepare("select ?, ?, ?");
+    T value = bind_value<T>();
+    for (auto _ : state)
+    {
+        stmt.reset();
+        stmt.bind_multiple(value, value, value);
+    }
+}
+
+BENCHMARK_TEMPLATE(Raw_Bind, int32_t);
+BENCHMARK_TEMPLATE(BindMultiple, int32_t);
+BENCHMARK_TEMPLATE(Raw_Bind, int64_t);
+BENCHMARK_TEMPLATE(BindMultiple, int64_t);
+BENCHMARK_TEMPLATE(Raw_Bind, double);
+BENCHMARK_TEMPLATE(BindMultiple, double);
+BENCHMARK_TEMPLATE(Raw_Bind, string);
+BENCHMARK_TEMPLATE(BindMultiple, string);
+BENCHMARK_TEMPLATE(Raw_Bind, string_view);
+BENCHMARK_TEMPLATE(BindMultiple, string_view);
+BENCHMARK_TEMPLATE(Raw_Bind, vector<uint8_t>);
+BENCHMARK_TEMPLATE(BindMultiple, vector<uint8_t>);
+
+// get_all per loader type, reading a single row
+
+void Raw_GetText(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select s, s, s from t where id = 1", -1, &stmt, nullptr));
+    check(sqlite3_step(stmt), SQLITE_ROW);
+    for (auto _ : state)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, i));
+            benchmark::DoNotOptimize(string_view(text, sqlite3_column_bytes(stmt, i)));
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_GetText);
+
+template <typename T>
+void GetAll(benchmark::State& state)
+{
+    auto db = make_database();
+    const char* sql = is_arithmetic_v<T> ? "select i, i, i from t where id = 1"
+                                         : (is_same_v<T, optional<int>> ? "select n, n, n from t where id = 2"
+                                                                        : "select s, s, s from t where id = 1");
+    auto stmt = db.prepare(sql);
+    stmt.step();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(stmt.get_all<T, T, T>());
+}
+BENCHMARK_TEMPLATE(GetAll, string);
+BENCHMARK_TEMPLATE(GetAll, string_view);
+
+void Raw_GetNullableInt(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select n, n, n from t where id = 2", -1, &stmt, nullptr));
+    check(sqlite3_step(stmt), SQLITE_ROW);
+    for (auto _ : state)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            optional<int> value;
+            if (sqlite3_column_type(stmt, i) != SQLITE_NULL)
+                value = sqlite3_column_int(stmt, i);
+            benchmark::DoNotOptimize(value);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_GetNullableInt);
+BENCHMARK_TEMPLATE(GetAll, optional<int>);
+
+void Raw_GetInt(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select i, i, i from t where id = 1", -1, &stmt, nullptr));
+    check(sqlite3_step(stmt), SQLITE_ROW);
+    for (auto _ : state)
+    {
+        for (int i = 0; i < 3; i++)
+            benchmark::DoNotOptimize(sqlite3_column_int(stmt, i));
+    }
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_GetInt);
+BENCHMARK_TEMPLATE(GetAll, int);
+
+// row iteration over the whole table
+
+void Raw_Iterate(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select i, s from t", -1, &stmt, nullptr));
+    for (auto _ : state)
+    {
+        sqlite3_reset(stmt);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            benchmark::DoNotOptimize(sqlite3_column_int(stmt, 0));
+            auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+            benchmark::DoNotOptimize(string_view(text, sqlite3_column_bytes(stmt, 1)));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * table_rows);
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_Iterate);
+
+void IterateStep(benchmark::State& state)
+{
+    auto db = make_database();
+    auto stmt = db.prepare("select i, s from t");
+    for (auto _ : state)
+    {
+        stmt.reset();
+        while (stmt.step())
+            benchmark::DoNotOptimize(stmt.get_all<int, string_view>());
+    }
+    state.SetItemsProcessed(state.iterations() * table_rows);
+}
+BENCHMARK(IterateStep);
+
+void IterateRows(benchmark::State& state)
+{
+    auto db = make_database();
+    auto stmt = db.prepare("select i, s from t");
+    for (auto _ : state)
+    {
+        stmt.reset();
+        for (auto [i, s] : stmt.rows<int, string_view>())
+        {
+            benchmark::DoNotOptimize(i);
+            benchmark::DoNotOptimize(s);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * table_rows);
+}
+BENCHMARK(IterateRows);
+
+// bulk insert of range(0) rows, inside and outside a transaction
+
+void Raw_InsertTransaction(benchmark::State& state)
+{
+    auto db = make_database();
+    db.execute("create table bulk(a integer, b text)").step();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "insert into bulk values (?, ?)", -1, &stmt, nullptr));
+    for (auto _ : state)
+    {
+        check(sqlite3_exec(db.handle(), "begin", nullptr, nullptr, nullptr));
+        for (int64_t i = 0; i < state.range(0); i++)
+        {
+            sqlite3_reset(stmt);
+            sqlite3_bind_int64(stmt, 1, i);
+            sqlite3_bind_text(stmt, 2, "value", 5, SQLITE_STATIC);
+            check(sqlite3_step(stmt), SQLITE_DONE);
+        }
+        check(sqlite3_exec(db.handle(), "commit", nullptr, nullptr, nullptr));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_InsertTransaction)->Arg(1000);
+
+void InsertAtomic(benchmark::State& state)
+{
+    auto db = make_database();
+    db.execute("create table bulk(a integer, b text)").step();
+    for (auto _ : state)
+    {
+        db.atomic([&]() {
+            auto stmt = db.prepare_cached("insert into bulk values (?, ?)");
+            for (int64_t i = 0; i < state.range(0); i++)
+            {
+                stmt.reset();
+                stmt.bind_multiple(i, "value"sv);
+                stmt.step();
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(InsertAtomic)->Arg(1000);
+
+void InsertExecuteMany(benchmark::State& state)
+{
+    auto db = make_database();
+    db.execute("create table bulk(a integer, b text)").step();
+    vector<tuple<int64_t, string_view>> rows;
+    for (int64_t i = 0; i < state.range(0); i++)
+        rows.emplace_back(i, "value");
+    for (auto _ : state)
+        db.execute_many("insert into bulk values (?, ?)", rows, sqlite::bulk_insert::multi_row_values);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(InsertExecuteMany)->Arg(1000);
+
+// Outside a transaction every insert commits on its own. A file-backed database makes that cost
+// visible; synchronous=off keeps the numbers about the wrapper rather than the disk.
+void Raw_InsertAutocommit(benchmark::State& state)
+{
+    sqlite::database db("bench_autocommit.db");
+    db.execute("pragma synchronous = off").step();
+    db.execute("create table if not exists bulk(a integer, b text)").step();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "insert into bulk values (?, ?)", -1, &stmt, nullptr));
+    for (auto _ : state)
+    {
+        for (int64_t i = 0; i < state.range(0); i++)
+        {
+            sqlite3_reset(stmt);
+            sqlite3_bind_int64(stmt, 1, i);
+            sqlite3_bind_text(stmt, 2, "value", 5, SQLITE_STATIC);
+            check(sqlite3_step(stmt), SQLITE_DONE);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    sqlite3_finalize(stmt);
+    remove("bench_autocommit.db");
+}
+BENCHMARK(Raw_InsertAutocommit)->Arg(100);
+
+void InsertAutocommit(benchmark::State& state)
+{
+    {
+        sqlite::database db("bench_autocommit.db");
+        db.execute("pragma synchronous = off").step();
+        db.execute("create table if not exists bulk(a integer, b text)").step();
+        for (auto _ : state)
+        {
+            for (int64_t i = 0; i < state.range(0); i++)
+                db.execute_cached("insert into bulk values (?, ?)", i, "value"sv).step();
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    remove("bench_autocommit.db");
+}
+BENCHMARK(InsertAutocommit)->Arg(100);
+
+// blob read paths for a blob_bytes blob
+
+void Raw_ColumnBlob(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db.handle(), "select b from t where id = 1", -1, &stmt, nullptr));
+    for (auto _ : state)
+    {
+        sqlite3_reset(stmt);
+        check(sqlite3_step(stmt), SQLITE_ROW);
+        benchmark::DoNotOptimize(sqlite3_column_blob(stmt, 0));
+        benchmark::DoNotOptimize(sqlite3_column_bytes(stmt, 0));
+    }
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+    sqlite3_finalize(stmt);
+}
+BENCHMARK(Raw_ColumnBlob);
+
+void GetBlob(benchmark::State& state)
+{
+    auto db = make_database();
+    auto stmt = db.prepare("select b from t where id = 1");
+    for (auto _ : state)
+    {
+        stmt.reset();
+        stmt.step();
+        benchmark::DoNotOptimize(stmt.get<0, sqlite::blob<uint8_t>>());
+    }
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+}
+BENCHMARK(GetBlob);
+
+void GetVector(benchmark::State& state)
+{
+    auto db = make_database();
+    auto stmt = db.prepare("select b from t where id = 1");
+    for (auto _ : state)
+    {
+        stmt.reset();
+        stmt.step();
+        benchmark::DoNotOptimize(stmt.get<0, vector<uint8_t>>());
+    }
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+}
+BENCHMARK(GetVector);
+
+void Raw_BlobRead(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite3_blob* blob;
+    check(sqlite3_blob_open(db.handle(), "main", "t", "b", 1, 0, &blob));
+    vector<uint8_t> buffer(blob_bytes);
+    for (auto _ : state)
+    {
+        check(sqlite3_blob_read(blob, buffer.data(), blob_bytes, 0));
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+    sqlite3_blob_close(blob);
+}
+BENCHMARK(Raw_BlobRead);
+
+void BlobStreamRead(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite::blob_stream blob(db, "t", "b", 1);
+    vector<uint8_t> buffer(blob_bytes);
+    for (auto _ : state)
+    {
+        blob.read(buffer.data(), blob_bytes, 0);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+}
+BENCHMARK(BlobStreamRead);
+
+void BlobStreamChunks(benchmark::State& state)
+{
+    auto db = make_database();
+    sqlite::blob_stream blob(db, "t", "b", 1);
+    for (auto _ : state)
+        blob.read_chunks(4096, [](const byte* data, int size) { benchmark::DoNotOptimize(data + size); });
+    state.SetBytesProcessed(state.iterations() * blob_bytes);
+}
+BENCHMARK(BlobStreamChunks);
+}  // namespace
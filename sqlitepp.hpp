@@ -1,16 +1,202 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <compare>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
 #include <random>
+#include <ranges>
+#include <semaphore>
+#include <span>
 #include <sqlite3.h>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
+#include <typeinfo>
+#include <unordered_map>
 #include <utility>
+#include <variant>
 #include <vector>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// The Arrow C data and stream interfaces, as specified in
+// https://arrow.apache.org/docs/format/CDataInterface.html and CStreamInterface.html.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+};
+
+struct ArrowArray
+{
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream
+{
+    int (*get_schema)(struct ArrowArrayStream*, struct ArrowSchema* out);
+    int (*get_next)(struct ArrowArrayStream*, struct ArrowArray* out);
+    const char* (*get_last_error)(struct ArrowArrayStream*);
+    void (*release)(struct ArrowArrayStream*);
+    void* private_data;
+};
+
+#endif  // ARROW_C_STREAM_INTERFACE
+
 namespace sqlite
 {
+// Thrown when SQLite reports an error. Carries the primary result code and the extended result
+// code, such as SQLITE_BUSY and SQLITE_BUSY_SNAPSHOT.
+class error : public std::runtime_error
+{
+public:
+    error(int extended_code, const char* message)
+        : std::runtime_error(message)
+        , extended(extended_code)
+    {}
+
+    int code() const noexcept
+    {
+        return this->extended & 0xff;
+    }
+
+    int extended_code() const noexcept
+    {
+        return this->extended;
+    }
+
+private:
+    int extended;
+};
+
+// SQLITE_BUSY: another connection holds a conflicting lock on the database file. Retrying later
+// can succeed.
+class busy_error : public error
+{
+public:
+    using error::error;
+};
+
+// SQLITE_LOCKED: a conflicting lock is held through the same connection or, in shared-cache mode,
+// another connection sharing the cache.
+class locked_error : public error
+{
+public:
+    using error::error;
+};
+
+namespace detail
+{
+// Throws the exception matching code, taking the message and extended code from db when it
+// reports the same error.
+[[noreturn]] inline void throw_error(sqlite3* db, int code)
+{
+    const char* message = sqlite3_errstr(code);
+    if (db && (sqlite3_errcode(db) & 0xff) == (code & 0xff))
+    {
+        code = sqlite3_extended_errcode(db);
+        message = sqlite3_errmsg(db);
+    }
+    switch (code & 0xff)
+    {
+    case SQLITE_BUSY:
+        throw busy_error(code, message);
+    case SQLITE_LOCKED:
+        throw locked_error(code, message);
+    default:
+        throw error(code, message);
+    }
+}
+
+// Blocks until the connection whose shared-cache lock made db fail with
+// SQLITE_LOCKED_SHAREDCACHE has finished its transaction. Returns false, without waiting, when
+// sqlite3_unlock_notify detects that waiting would deadlock. Requires a SQLite built with
+// SQLITE_ENABLE_UNLOCK_NOTIFY.
+inline bool wait_for_unlock(sqlite3* db)
+{
+    struct notification
+    {
+        std::mutex mutex;
+        std::condition_variable unlocked;
+        bool fired = false;
+    } waiter;
+
+    auto notify = [](void** args, int count) {
+        for (int i = 0; i < count; i++)
+        {
+            auto n = static_cast<notification*>(args[i]);
+            std::lock_guard<std::mutex> guard(n->mutex);
+            n->fired = true;
+            n->unlocked.notify_one();
+        }
+    };
+    if (sqlite3_unlock_notify(db, notify, &waiter) != SQLITE_OK)
+        return false;
+    std::unique_lock<std::mutex> lock(waiter.mutex);
+    waiter.unlocked.wait(lock, [&]() { return waiter.fired; });
+    return true;
+}
+}  // namespace detail
+
 template <typename T = std::byte>
 struct blob
 {
@@ -23,6 +209,138 @@ struct blob
     {}
 };
 
+enum class value_type
+{
+    integer = SQLITE_INTEGER,
+    real = SQLITE_FLOAT,
+    text = SQLITE_TEXT,
+    blob = SQLITE_BLOB,
+    null = SQLITE_NULL,
+};
+
+// A dynamically typed column or argument value, for code that does not know its types at compile
+// time. Text and blobs are views into the statement, valid until it is stepped or reset, so a
+// value never allocates.
+class value
+{
+public:
+    constexpr value() noexcept
+        : stored_type(value_type::null)
+        , stored_integer(0)
+    {}
+
+    constexpr value(std::nullptr_t) noexcept
+        : value()
+    {}
+
+    // Any integral type, so that value(5) does not have to choose between std::int64_t and double.
+    template <std::integral T>
+    constexpr value(T integer) noexcept
+        : stored_type(value_type::integer)
+        , stored_integer(static_cast<std::int64_t>(integer))
+    {}
+
+    constexpr value(double real) noexcept
+        : stored_type(value_type::real)
+        , stored_real(real)
+    {}
+
+    constexpr value(const std::string_view text) noexcept
+        : stored_type(value_type::text)
+        , stored_bytes { text.data(), text.size() }
+    {}
+
+    constexpr value(std::span<const std::byte> bytes) noexcept
+        : stored_type(value_type::blob)
+        , stored_bytes { bytes.data(), bytes.size() }
+    {}
+
+    constexpr value_type type() const noexcept
+    {
+        return this->stored_type;
+    }
+
+    constexpr bool is_null() const noexcept
+    {
+        return this->stored_type == value_type::null;
+    }
+
+    // The accessors below require the value to be of the matching type.
+    constexpr std::int64_t integer() const noexcept
+    {
+        return this->stored_integer;
+    }
+
+    constexpr double real() const noexcept
+    {
+        return this->stored_real;
+    }
+
+    std::string_view text() const noexcept
+    {
+        return { static_cast<const char*>(this->stored_bytes.data), this->stored_bytes.size };
+    }
+
+    std::span<const std::byte> bytes() const noexcept
+    {
+        return { static_cast<const std::byte*>(this->stored_bytes.data), this->stored_bytes.size };
+    }
+
+    // Calls f with a std::nullptr_t, std::int64_t, double, std::string_view or
+    // std::span<const std::byte>, depending on the type.
+    template <typename F>
+    decltype(auto) visit(F&& f) const
+    {
+        switch (this->stored_type)
+        {
+        case value_type::integer:
+            return std::forward<F>(f)(this->stored_integer);
+        case value_type::real:
+            return std::forward<F>(f)(this->stored_real);
+        case value_type::text:
+            return std::forward<F>(f)(this->text());
+        case value_type::blob:
+            return std::forward<F>(f)(this->bytes());
+        default:
+            return std::forward<F>(f)(nullptr);
+        }
+    }
+
+    friend bool operator==(const value& a, const value& b) noexcept
+    {
+        if (a.stored_type != b.stored_type)
+            return false;
+        switch (a.stored_type)
+        {
+        case value_type::integer:
+            return a.stored_integer == b.stored_integer;
+        case value_type::real:
+            return a.stored_real == b.stored_real;
+        case value_type::text:
+            return a.text() == b.text();
+        case value_type::blob:
+            return std::ranges::equal(a.bytes(), b.bytes());
+        default:
+            return true;
+        }
+    }
+
+private:
+    struct stored_span
+    {
+        const void* data;
+        std::size_t size;
+    };
+
+    value_type stored_type;
+    union
+    {
+        std::int64_t stored_integer;
+        double stored_real;
+        stored_span stored_bytes;
+    };
+};
+
 template <typename>
 struct loader;
 
@@ -129,214 +447,9006 @@ struct loader<std::vector<T>>
     }
 };
 
-class database;
-
-enum class openflags
+template <>
+struct loader<value>
 {
-    readonly = SQLITE_OPEN_READONLY,
-    readwrite = SQLITE_OPEN_READWRITE,
-    create = SQLITE_OPEN_CREATE,
-    nomutex = SQLITE_OPEN_NOMUTEX,
-    fullmutex = SQLITE_OPEN_FULLMUTEX,
-    sharedcache = SQLITE_OPEN_SHAREDCACHE,
-    privatecach = SQLITE_OPEN_PRIVATECACHE,
-    uri = SQLITE_OPEN_URI
+    static value get(sqlite3_stmt* stmt, int index)
+    {
+        switch (sqlite3_column_type(stmt, index))
+        {
+        case SQLITE_INTEGER:
+            return std::int64_t(sqlite3_column_int64(stmt, index));
+        case SQLITE_FLOAT:
+            return sqlite3_column_double(stmt, index);
+        case SQLITE_TEXT:
+        {
+            // The pointer first and then the size, as sqlite3_column_bytes documents.
+            auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, index));
+            return std::string_view(text, sqlite3_column_bytes(stmt, index));
+        }
+        case SQLITE_BLOB:
+        {
+            auto data = static_cast<const std::byte*>(sqlite3_column_blob(stmt, index));
+            return std::span<const std::byte>(data, sqlite3_column_bytes(stmt, index));
+        }
+        default:
+            return nullptr;
+        }
+    }
 };
 
-constexpr openflags operator|(const openflags& a, const openflags& b) noexcept
-{
-    return static_cast<openflags>(static_cast<unsigned int>(a) | static_cast<unsigned int>(b));
-}
-
-class statement
+template <>
+struct loader<std::pmr::string>
 {
-    friend class database;
-
-    statement(sqlite3* db, const std::string_view sql)
+    static std::pmr::string get(sqlite3_stmt* stmt, int index)
     {
-        if (sqlite3_prepare_v2(db, sql.data(), sql.length(), &this->stmt, nullptr))
-            throw std::exception();
+        auto text = loader<std::string_view>::get(stmt, index);
+        return std::pmr::string(text);
     }
+};
 
-public:
-    constexpr statement() noexcept
-        : stmt(nullptr)
-    {}
-    constexpr statement(const statement&) noexcept = delete;
-    constexpr statement(statement&& other) noexcept
-        : stmt(other.stmt)
+template <typename T>
+struct loader<std::pmr::vector<T>>
+{
+    static std::pmr::vector<T> get(sqlite3_stmt* stmt, int index)
     {
-        other.stmt = nullptr;
+        auto value = loader<blob<T>>::get(stmt, index);
+        return std::pmr::vector<T>(value.data, value.data + value.size);
     }
+};
 
-    ~statement()
+// The counterpart of loader<T> for sqlite3_value arguments of user-defined functions.
+template <typename>
+struct value_loader;
+
+template <>
+struct value_loader<std::int32_t>
+{
+    static std::int32_t get(sqlite3_value* value)
     {
-        sqlite3_finalize(this->stmt);
+        return sqlite3_value_int(value);
     }
+};
 
-    statement& operator=(const statement&) = delete;
-
-    statement& operator=(statement&& other)
+template <>
+struct value_loader<std::int64_t>
+{
+    static std::int64_t get(sqlite3_value* value)
     {
-        sqlite3_finalize(this->stmt);
-        this->stmt = other.stmt;
-        other.stmt = nullptr;
-        return *this;
+        return sqlite3_value_int64(value);
     }
+};
 
-    void reset() const
+template <>
+struct value_loader<double>
+{
+    static double get(sqlite3_value* value)
     {
-        sqlite3_reset(this->stmt);
+        return sqlite3_value_double(value);
     }
+};
 
-    void bind(int index, std::int32_t item) const
+template <>
+struct value_loader<const char*>
+{
+    static const char* get(sqlite3_value* value)
     {
-        sqlite3_bind_int(this->stmt, index + 1, item);
+        return reinterpret_cast<const char*>(sqlite3_value_text(value));
     }
+};
 
-    void bind(int index, std::int64_t item) const
+template <>
+struct value_loader<std::string_view>
+{
+    static std::string_view get(sqlite3_value* value)
     {
-        sqlite3_bind_int64(this->stmt, index + 1, item);
+        auto str_ptr = reinterpret_cast<const char*>(sqlite3_value_text(value));
+        int length = sqlite3_value_bytes(value);
+        return std::string_view(str_ptr, length);
     }
+};
 
-    void bind(int index, double item) const
+template <>
+struct value_loader<std::string>
+{
+    static std::string get(sqlite3_value* value)
     {
-        sqlite3_bind_double(this->stmt, index + 1, item);
+        return std::string(value_loader<std::string_view>::get(value));
     }
+};
 
-    void bind(int index, const std::string_view item) const
+template <>
+struct value_loader<sqlite3_value*>
+{
+    static sqlite3_value* get(sqlite3_value* value)
     {
-        sqlite3_bind_text(this->stmt, index + 1, item.data(), item.length(), nullptr);
+        return value;
     }
+};
 
-    void bind(int index, std::nullptr_t) const
+template <>
+struct value_loader<value>
+{
+    static sqlite::value get(sqlite3_value* value)
     {
-        sqlite3_bind_null(this->stmt, index + 1);
+        switch (sqlite3_value_type(value))
+        {
+        case SQLITE_INTEGER:
+            return std::int64_t(sqlite3_value_int64(value));
+        case SQLITE_FLOAT:
+            return sqlite3_value_double(value);
+        case SQLITE_TEXT:
+        {
+            auto text = reinterpret_cast<const char*>(sqlite3_value_text(value));
+            return std::string_view(text, sqlite3_value_bytes(value));
+        }
+        case SQLITE_BLOB:
+        {
+            auto data = static_cast<const std::byte*>(sqlite3_value_blob(value));
+            return std::span<const std::byte>(data, sqlite3_value_bytes(value));
+        }
+        default:
+            return nullptr;
+        }
     }
+};
 
-    void bind_multiple() const {}
-
-    template <typename... Args, std::size_t... I>
-    void bind_multiple_impl(std::index_sequence<I...>, Args&&... args) const
+template <typename T>
+struct value_loader<std::optional<T>>
+{
+    static std::optional<T> get(sqlite3_value* value)
     {
-        (bind(I, args), ...);
+        if (sqlite3_value_type(value) == SQLITE_NULL)
+            return {};
+        return value_loader<T>::get(value);
     }
+};
 
-    template <typename... Args>
-    void bind_multiple(Args&&... args) const
+template <typename T>
+struct value_loader<blob<T>>
+{
+    static blob<T> get(sqlite3_value* value)
     {
-        bind_multiple_impl(std::index_sequence_for<Args...> {}, std::forward<Args>(args)...);
+        auto data_ptr = reinterpret_cast<const T*>(sqlite3_value_blob(value));
+        int length = sqlite3_value_bytes(value);
+        if constexpr (std::is_same_v<T, void>)
+            return blob<T>(data_ptr, length);
+        else
+        {
+            if (length % sizeof(T))
+                throw std::logic_error("size of blob is not divisible by size of type");
+            return blob<T>(data_ptr, length / sizeof(T));
+        }
     }
+};
 
-    template <int Index, typename T>
-    T get() const
+template <typename T>
+struct value_loader<std::vector<T>>
+{
+    static std::vector<T> get(sqlite3_value* value)
     {
-        return loader<T>::get(this->stmt, Index);
+        auto data = value_loader<blob<T>>::get(value);
+        return std::vector<T>(data.data, data.data + data.size);
     }
+};
 
-    template <typename... Args, std::size_t... I>
-    std::tuple<Args...> get_all_impl(std::tuple<Args...>&&, std::index_sequence<I...>) const
+// Sets the result of a user-defined function from a C++ value. Text and blobs are copied.
+template <typename>
+struct result;
+
+template <>
+struct result<std::int32_t>
+{
+    static void set(sqlite3_context* ctx, std::int32_t value)
     {
-        return std::tuple<Args...>(loader<Args>::get(this->stmt, I)...);
+        sqlite3_result_int(ctx, value);
     }
+};
 
-    template <typename... Args>
-    std::tuple<Args...> get_all() const
+template <>
+struct result<std::int64_t>
+{
+    static void set(sqlite3_context* ctx, std::int64_t value)
     {
-        return get_all_impl(std::tuple<Args...> {}, std::index_sequence_for<Args...> {});
+        sqlite3_result_int64(ctx, value);
     }
+};
 
-    bool step() const
+template <>
+struct result<double>
+{
+    static void set(sqlite3_context* ctx, double value)
     {
-        int result = sqlite3_step(this->stmt);
-        if (result == SQLITE_ROW)
-            return true;
-        else if (result == SQLITE_DONE)
-            return false;
-        else
-            throw std::exception();
+        sqlite3_result_double(ctx, value);
     }
+};
 
-    sqlite3_stmt* handle() const
+template <>
+struct result<std::string_view>
+{
+    static void set(sqlite3_context* ctx, const std::string_view value)
     {
-        return stmt;
+        sqlite3_result_text64(ctx, value.data(), value.size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+    }
+};
+
+template <>
+struct result<std::string> : result<std::string_view>
+{};
+
+template <>
+struct result<const char*>
+{
+    static void set(sqlite3_context* ctx, const char* value)
+    {
+        if (value)
+            sqlite3_result_text(ctx, value, -1, SQLITE_TRANSIENT);
+        else
+            sqlite3_result_null(ctx);
+    }
+};
+
+template <>
+struct result<std::nullptr_t>
+{
+    static void set(sqlite3_context* ctx, std::nullptr_t)
+    {
+        sqlite3_result_null(ctx);
+    }
+};
+
+template <typename T>
+struct result<std::optional<T>>
+{
+    static void set(sqlite3_context* ctx, const std::optional<T>& value)
+    {
+        if (value)
+            result<T>::set(ctx, *value);
+        else
+            sqlite3_result_null(ctx);
+    }
+};
+
+template <typename T>
+struct result<blob<T>>
+{
+    static void set(sqlite3_context* ctx, const blob<T>& value)
+    {
+        sqlite3_uint64 length;
+        if constexpr (std::is_same_v<T, void>)
+            length = value.size;
+        else
+            length = static_cast<sqlite3_uint64>(value.size) * sizeof(T);
+        sqlite3_result_blob64(ctx, value.data, length, SQLITE_TRANSIENT);
+    }
+};
+
+template <typename T>
+struct result<std::vector<T>>
+{
+    static void set(sqlite3_context* ctx, const std::vector<T>& value)
+    {
+        if (value.empty())
+            sqlite3_result_zeroblob(ctx, 0);
+        else
+            sqlite3_result_blob64(ctx, value.data(), value.size() * sizeof(T), SQLITE_TRANSIENT);
+    }
+};
+
+// A monotonic bump allocator for materializing query results. Values decoded into an arena are
+// freed all at once by release() (or when the arena is destroyed) instead of one by one.
+class row_arena
+{
+public:
+    explicit row_arena(std::size_t initial_size = 64 * 1024)
+        : memory(initial_size)
+    {}
+
+    row_arena(const row_arena&) = delete;
+    row_arena& operator=(const row_arena&) = delete;
+
+    std::pmr::memory_resource* resource() noexcept
+    {
+        return &this->memory;
+    }
+
+    void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+    {
+        return this->memory.allocate(size, alignment);
+    }
+
+    // Copies text into the arena, returning a view that stays valid until the arena is released.
+    std::string_view store(const std::string_view text)
+    {
+        if (text.empty())
+            return {};
+        auto copy = static_cast<char*>(this->allocate(text.size() + 1, 1));
+        std::memcpy(copy, text.data(), text.size());
+        copy[text.size()] = '\0';
+        return std::string_view(copy, text.size());
+    }
+
+    void release() noexcept
+    {
+        this->memory.release();
+    }
+
+private:
+    std::pmr::monotonic_buffer_resource memory;
+};
+
+// Decodes a column like loader<T>, but allocates into an arena. Polymorphic-allocator strings
+// and vectors use the arena's resource, and views (std::string_view, blob<T>, const char*) are
+// copied into the arena so they stay valid after the statement is stepped.
+template <typename T>
+struct arena_loader
+{
+    static T get(sqlite3_stmt* stmt, int index, row_arena&)
+    {
+        return loader<T>::get(stmt, index);
+    }
+};
+
+template <>
+struct arena_loader<std::pmr::string>
+{
+    static std::pmr::string get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        auto text = loader<std::string_view>::get(stmt, index);
+        return std::pmr::string(text, arena.resource());
+    }
+};
+
+template <typename T>
+struct arena_loader<std::pmr::vector<T>>
+{
+    static std::pmr::vector<T> get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        auto value = loader<blob<T>>::get(stmt, index);
+        return std::pmr::vector<T>(value.data, value.data + value.size, arena.resource());
+    }
+};
+
+template <>
+struct arena_loader<std::string_view>
+{
+    static std::string_view get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        return arena.store(loader<std::string_view>::get(stmt, index));
+    }
+};
+
+template <>
+struct arena_loader<const char*>
+{
+    static const char* get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        if (sqlite3_column_type(stmt, index) == SQLITE_NULL)
+            return nullptr;
+        auto text = arena.store(loader<std::string_view>::get(stmt, index));
+        return text.empty() ? "" : text.data();
+    }
+};
+
+template <typename T>
+struct arena_loader<blob<T>>
+{
+    static blob<T> get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        auto value = loader<blob<T>>::get(stmt, index);
+        std::size_t length;
+        if constexpr (std::is_same_v<T, void>)
+            length = value.size;
+        else
+            length = value.size * sizeof(T);
+        if (length == 0)
+            return value;
+
+        if constexpr (std::is_same_v<T, void>)
+        {
+            auto copy = arena.allocate(length);
+            std::memcpy(copy, value.data, length);
+            return blob<T>(copy, value.size);
+        }
+        else
+        {
+            auto copy = arena.allocate(length, alignof(T));
+            std::memcpy(copy, value.data, length);
+            return blob<T>(static_cast<const T*>(copy), value.size);
+        }
+    }
+};
+
+template <typename T>
+struct arena_loader<std::optional<T>>
+{
+    static std::optional<T> get(sqlite3_stmt* stmt, int index, row_arena& arena)
+    {
+        if (sqlite3_column_type(stmt, index) == SQLITE_NULL)
+            return {};
+        return arena_loader<T>::get(stmt, index, arena);
+    }
+};
+
+// Decodes a column into an existing value, reusing the capacity of strings and vectors so that a
+// scan filling the same object for every row does not allocate once it has grown. Other types
+// are assigned from loader<T>.
+template <typename T>
+struct fill_loader
+{
+    static void fill(T& out, sqlite3_stmt* stmt, int index)
+    {
+        out = loader<T>::get(stmt, index);
+    }
+};
+
+template <typename C, typename A>
+struct fill_loader<std::basic_string<char, C, A>>
+{
+    static void fill(std::basic_string<char, C, A>& out, sqlite3_stmt* stmt, int index)
+    {
+        auto text = loader<std::string_view>::get(stmt, index);
+        if (text.data())
+            out.assign(text.data(), text.size());
+        else
+            out.clear();
+    }
+};
+
+template <typename T, typename A>
+struct fill_loader<std::vector<T, A>>
+{
+    static void fill(std::vector<T, A>& out, sqlite3_stmt* stmt, int index)
+    {
+        auto value = loader<blob<T>>::get(stmt, index);
+        out.assign(value.data, value.data + value.size);
+    }
+};
+
+template <typename T>
+struct fill_loader<std::optional<T>>
+{
+    static void fill(std::optional<T>& out, sqlite3_stmt* stmt, int index)
+    {
+        if (sqlite3_column_type(stmt, index) == SQLITE_NULL)
+            out.reset();
+        else if (out)
+            fill_loader<T>::fill(*out, stmt, index);
+        else
+            out = loader<T>::get(stmt, index);
+    }
+};
+
+// Maps a struct's members to result columns, in column order, for get_as, fill and rows_as.
+// Aggregates are mapped without it, in declaration order; specialize it for other classes or to
+// pick the members:
+//
+//     template <>
+//     struct sqlite::fields<user>
+//     {
+//         static constexpr auto members = std::make_tuple(&user::id, &user::name);
+//     };
+template <typename T>
+struct fields;
+
+namespace detail
+{
+inline constexpr std::size_t max_mapped_fields = 16;
+
+template <std::size_t N, typename T>
+constexpr auto tie_aggregate(T& value)
+{
+    static_assert(std::is_aggregate_v<T> && N > 0 && N <= max_mapped_fields,
+                  "map the type with sqlite::fields, or use an aggregate of at most 16 members");
+    if constexpr (N == 1)
+    {
+        auto& [f0] = value;
+        return std::tie(f0);
+    }
+    else if constexpr (N == 2)
+    {
+        auto& [f0, f1] = value;
+        return std::tie(f0, f1);
+    }
+    else if constexpr (N == 3)
+    {
+        auto& [f0, f1, f2] = value;
+        return std::tie(f0, f1, f2);
+    }
+    else if constexpr (N == 4)
+    {
+        auto& [f0, f1, f2, f3] = value;
+        return std::tie(f0, f1, f2, f3);
+    }
+    else if constexpr (N == 5)
+    {
+        auto& [f0, f1, f2, f3, f4] = value;
+        return std::tie(f0, f1, f2, f3, f4);
+    }
+    else if constexpr (N == 6)
+    {
+        auto& [f0, f1, f2, f3, f4, f5] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5);
+    }
+    else if constexpr (N == 7)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6);
+    }
+    else if constexpr (N == 8)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7);
+    }
+    else if constexpr (N == 9)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8);
+    }
+    else if constexpr (N == 10)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9);
+    }
+    else if constexpr (N == 11)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10);
+    }
+    else if constexpr (N == 12)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11);
+    }
+    else if constexpr (N == 13)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12);
+    }
+    else if constexpr (N == 14)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13);
+    }
+    else if constexpr (N == 15)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14);
+    }
+    else if constexpr (N == 16)
+    {
+        auto& [f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15] = value;
+        return std::tie(f0, f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12, f13, f14, f15);
+    }
+}
+}  // namespace detail
+
+namespace detail
+{
+// Converts to anything, to probe how many initializers an aggregate takes.
+struct any_field
+{
+    template <typename T>
+    operator T() const;
+};
+
+template <typename T, std::size_t... I>
+constexpr bool brace_constructible(std::index_sequence<I...>)
+{
+    return requires { T { (void(I), any_field {})... }; };
+}
+
+// Counts down from the maximum, since a member without a default constructor rejects fewer
+// initializers than members.
+template <typename T, std::size_t N = max_mapped_fields>
+constexpr std::size_t aggregate_arity()
+{
+    if constexpr (N == 0 || brace_constructible<T>(std::make_index_sequence<N> {}))
+        return N;
+    else
+        return aggregate_arity<T, N - 1>();
+}
+
+template <typename T>
+concept has_fields = requires { fields<std::remove_const_t<T>>::members; };
+
+// A tuple of references to the mapped members of value.
+template <typename T>
+constexpr auto tie_fields(T& value)
+{
+    if constexpr (has_fields<T>)
+        return std::apply([&](auto... members) { return std::tie(value.*members...); },
+                          fields<std::remove_const_t<T>>::members);
+    else
+        return tie_aggregate<aggregate_arity<std::remove_const_t<T>>()>(value);
+}
+
+template <typename Tuple>
+struct decayed_tuple;
+
+template <typename... Ts>
+struct decayed_tuple<std::tuple<Ts...>>
+{
+    using type = std::tuple<std::remove_cvref_t<Ts>...>;
+};
+
+// The decoded type of each mapped member.
+template <typename T>
+using field_types = typename decayed_tuple<decltype(tie_fields(std::declval<T&>()))>::type;
+
+template <typename T>
+void fill_row(sqlite3_stmt* stmt, T& value)
+{
+    std::apply(
+        [&](auto&... members) {
+            int index = 0;
+            (fill_loader<std::remove_cvref_t<decltype(members)>>::fill(members, stmt, index++), ...);
+        },
+        tie_fields(value));
+}
+
+template <typename T, std::size_t... I>
+T decode_aggregate(sqlite3_stmt* stmt, std::index_sequence<I...>)
+{
+    return T { loader<std::tuple_element_t<I, field_types<T>>>::get(stmt, I)... };
+}
+
+template <typename T>
+T decode_row(sqlite3_stmt* stmt)
+{
+    if constexpr (has_fields<T>)
+    {
+        T value {};
+        fill_row(stmt, value);
+        return value;
+    }
+    else
+        return decode_aggregate<T>(stmt, std::make_index_sequence<std::tuple_size_v<field_types<T>>> {});
+}
+}  // namespace detail
+
+// Contiguous per-column buffers filled by statement::fetch_columns, laid out like Arrow arrays so
+// they can be handed to vectorized code as they are. Cells are decoded with loader<T>.
+template <typename T>
+struct column_buffer;
+
+// Fixed-width values.
+template <typename T>
+    requires std::is_arithmetic_v<T>
+struct column_buffer<T>
+{
+    std::vector<T> values;
+
+    void append(sqlite3_stmt* stmt, int index)
+    {
+        this->values.push_back(loader<T>::get(stmt, index));
+    }
+
+    void append_null()
+    {
+        this->values.push_back(T {});
+    }
+
+    std::size_t size() const noexcept
+    {
+        return this->values.size();
+    }
+
+    void clear() noexcept
+    {
+        this->values.clear();
+    }
+
+    T operator[](std::size_t i) const noexcept
+    {
+        return this->values[i];
+    }
+};
+
+// Variable-length values stored back to back in data, with value i spanning
+// [offsets[i], offsets[i + 1]).
+template <typename Element>
+struct variable_column_buffer
+{
+    std::vector<std::int64_t> offsets { 0 };
+    std::vector<Element> data;
+
+    void append_null()
+    {
+        this->offsets.push_back(this->offsets.back());
+    }
+
+    std::size_t size() const noexcept
+    {
+        return this->offsets.size() - 1;
+    }
+
+    void clear() noexcept
+    {
+        this->offsets.resize(1);
+        this->data.clear();
+    }
+
+protected:
+    void append_bytes(const void* bytes, std::size_t length)
+    {
+        auto begin = static_cast<const Element*>(bytes);
+        this->data.insert(this->data.end(), begin, begin + length);
+        this->offsets.push_back(static_cast<std::int64_t>(this->data.size()));
+    }
+};
+
+template <typename T>
+    requires std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view> || std::is_same_v<T, const char*>
+struct column_buffer<T> : variable_column_buffer<char>
+{
+    void append(sqlite3_stmt* stmt, int index)
+    {
+        auto text = loader<std::string_view>::get(stmt, index);
+        this->append_bytes(text.data(), text.size());
+    }
+
+    std::string_view operator[](std::size_t i) const noexcept
+    {
+        return std::string_view(this->data.data() + this->offsets[i], this->offsets[i + 1] - this->offsets[i]);
+    }
+};
+
+template <typename T>
+struct column_buffer<blob<T>> : variable_column_buffer<std::byte>
+{
+    void append(sqlite3_stmt* stmt, int index)
+    {
+        auto value = loader<blob<T>>::get(stmt, index);
+        if constexpr (std::is_same_v<T, void>)
+            this->append_bytes(value.data, value.size);
+        else
+            this->append_bytes(value.data, value.size * sizeof(T));
+    }
+
+    blob<T> operator[](std::size_t i) const noexcept
+    {
+        auto length = this->offsets[i + 1] - this->offsets[i];
+        auto begin = this->data.data() + this->offsets[i];
+        if constexpr (std::is_same_v<T, void>)
+            return blob<T>(begin, length);
+        else
+            return blob<T>(reinterpret_cast<const T*>(begin), length / sizeof(T));
+    }
+};
+
+template <typename T>
+struct column_buffer<std::vector<T>> : column_buffer<blob<T>>
+{};
+
+// Nullable values, with an Arrow-style validity bitmap (least significant bit first) next to the
+// buffer of the underlying type. Null cells still take up a slot in the values.
+template <typename T>
+struct column_buffer<std::optional<T>>
+{
+    column_buffer<T> values;
+    std::vector<std::uint8_t> validity;
+    std::size_t null_count = 0;
+
+    void append(sqlite3_stmt* stmt, int index)
+    {
+        auto i = this->values.size();
+        if (i % 8 == 0)
+            this->validity.push_back(0);
+
+        if (sqlite3_column_type(stmt, index) == SQLITE_NULL)
+        {
+            this->values.append_null();
+            this->null_count++;
+        }
+        else
+        {
+            this->values.append(stmt, index);
+            this->validity.back() |= static_cast<std::uint8_t>(1 << (i % 8));
+        }
+    }
+
+    std::size_t size() const noexcept
+    {
+        return this->values.size();
+    }
+
+    void clear() noexcept
+    {
+        this->values.clear();
+        this->validity.clear();
+        this->null_count = 0;
+    }
+
+    bool valid(std::size_t i) const noexcept
+    {
+        return this->validity[i / 8] & (1 << (i % 8));
+    }
+};
+
+// A batch of rows in struct-of-arrays form, one column_buffer per column.
+template <typename... Ts>
+class column_batch
+{
+public:
+    std::size_t size() const noexcept
+    {
+        return this->rows;
+    }
+
+    template <std::size_t I>
+    const auto& column() const noexcept
+    {
+        return std::get<I>(this->columns);
+    }
+
+    template <std::size_t I>
+    auto& column() noexcept
+    {
+        return std::get<I>(this->columns);
+    }
+
+    // Empties the batch but keeps the capacity of its buffers for the next fetch.
+    void clear() noexcept
+    {
+        std::apply([](auto&... column) { (column.clear(), ...); }, this->columns);
+        this->rows = 0;
+    }
+
+    template <std::size_t... I>
+    void append(sqlite3_stmt* stmt, std::index_sequence<I...>)
+    {
+        (std::get<I>(this->columns).append(stmt, I), ...);
+        this->rows++;
+    }
+
+private:
+    std::tuple<column_buffer<Ts>...> columns;
+    std::size_t rows = 0;
+};
+
+namespace detail
+{
+// The parenthesized row of a single-row "INSERT ... VALUES (...)" statement, as offsets into the
+// SQL text. end is one past the closing parenthesis.
+struct values_row
+{
+    std::size_t begin;
+    std::size_t end;
+    int parameters;
+};
+
+inline bool is_word_char(char c) noexcept
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+inline bool iequals(const std::string_view a, const std::string_view b) noexcept
+{
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); i++)
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+            return false;
+    return true;
+}
+
+// Finds the VALUES row of an INSERT or REPLACE statement that can be repeated to insert several
+// rows at once. This is only possible if the statement has exactly one row and every parameter is
+// an anonymous "?" placeholder inside that row.
+inline std::optional<values_row> find_values_row(const std::string_view sql)
+{
+    values_row row { 0, 0, 0 };
+    bool seen_command = false;
+    bool expect_row = false;
+    bool in_row = false;
+    int depth = 0;
+
+    for (std::size_t i = 0; i < sql.size();)
+    {
+        char c = sql[i];
+        if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            i++;
+            continue;
+        }
+        if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-')
+        {
+            i = std::min(sql.find('\n', i), sql.size());
+            continue;
+        }
+        if (c == '/' && i + 1 < sql.size() && sql[i + 1] == '*')
+        {
+            auto close = sql.find("*/", i + 2);
+            if (close == std::string_view::npos)
+                return {};
+            i = close + 2;
+            continue;
+        }
+
+        if (expect_row && c != '(')
+            return {};
+        if (row.end && c == ',')
+            return {};
+
+        if (c == '\'' || c == '"' || c == '`' || c == '[')
+        {
+            auto close = sql.find(c == '[' ? ']' : c, i + 1);
+            if (close == std::string_view::npos)
+                return {};
+            i = close + 1;
+        }
+        else if (c == '?' || c == ':' || c == '@' || c == '$')
+        {
+            bool anonymous = c == '?' && !(i + 1 < sql.size() && std::isdigit(static_cast<unsigned char>(sql[i + 1])));
+            if (!anonymous || !in_row)
+                return {};
+            row.parameters++;
+            i++;
+        }
+        else if (is_word_char(c))
+        {
+            auto begin = i;
+            while (i < sql.size() && is_word_char(sql[i]))
+                i++;
+            auto word = sql.substr(begin, i - begin);
+            if (!seen_command && !iequals(word, "insert") && !iequals(word, "replace"))
+                return {};
+            seen_command = true;
+            if (depth == 0 && !row.end && iequals(word, "values"))
+                expect_row = true;
+        }
+        else
+        {
+            if (c == '(')
+            {
+                if (expect_row)
+                {
+                    expect_row = false;
+                    in_row = true;
+                    row.begin = i;
+                }
+                depth++;
+            }
+            else if (c == ')' && --depth == 0 && in_row)
+            {
+                in_row = false;
+                row.end = i + 1;
+            }
+            i++;
+        }
+    }
+
+    if (!row.end)
+        return {};
+    return row;
+}
+
+inline bool step(sqlite3_stmt* stmt)
+{
+    int result = sqlite3_step(stmt);
+    if (result == SQLITE_ROW)
+        return true;
+    else if (result == SQLITE_DONE)
+        return false;
+    else
+        throw_error(sqlite3_db_handle(stmt), result);
+}
+
+// Bounded lock-free multi-producer multi-consumer queue (Dmitry Vyukov's design). The capacity is
+// rounded up to a power of two.
+template <typename T>
+class mpmc_queue
+{
+public:
+    explicit mpmc_queue(std::size_t capacity)
+        : cells(std::make_unique<cell[]>(std::bit_ceil(std::max<std::size_t>(capacity, 2))))
+        , mask(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1)
+    {
+        for (std::size_t i = 0; i <= this->mask; i++)
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T value)
+    {
+        auto position = this->enqueue_position.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& c = this->cells[position & this->mask];
+            auto sequence = c.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+            if (diff == 0)
+            {
+                if (this->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    c.value = std::move(value);
+                    c.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                position = this->enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T& value)
+    {
+        auto position = this->dequeue_position.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& c = this->cells[position & this->mask];
+            auto sequence = c.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+            if (diff == 0)
+            {
+                if (this->dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(c.value);
+                    c.sequence.store(position + this->mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                position = this->dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    std::size_t mask;
+    alignas(64) std::atomic<std::size_t> enqueue_position = 0;
+    alignas(64) std::atomic<std::size_t> dequeue_position = 0;
+};
+
+inline std::string repeat_values_row(const std::string_view sql, const values_row& row, std::size_t count)
+{
+    auto values = sql.substr(row.begin, row.end - row.begin);
+    std::string result;
+    result.reserve(sql.size() + (values.size() + 1) * (count - 1));
+    result.append(sql.substr(0, row.end));
+    for (std::size_t i = 1; i < count; i++)
+    {
+        result += ',';
+        result.append(values);
+    }
+    result.append(sql.substr(row.end));
+    return result;
+}
+}  // namespace detail
+
+// A string literal usable as a non-type template parameter.
+template <std::size_t N>
+struct fixed_string
+{
+    char value[N];
+
+    constexpr fixed_string(const char (&str)[N]) noexcept
+    {
+        std::copy_n(str, N, this->value);
+    }
+
+    constexpr std::string_view view() const noexcept
+    {
+        return std::string_view(this->value, N - 1);
+    }
+};
+
+namespace detail
+{
+// Counts the "?" placeholders in a statement, skipping string literals, quoted identifiers and
+// comments. Returns -1 if the statement uses numbered or named parameters. Scans by hand because
+// string_view::find is not usable on template parameter objects in constant expressions on GCC.
+constexpr int count_placeholders(const std::string_view sql) noexcept
+{
+    int count = 0;
+    for (std::size_t i = 0; i < sql.size(); i++)
+    {
+        char c = sql[i];
+        if (c == '\'' || c == '"' || c == '`' || c == '[')
+        {
+            char close = c == '[' ? ']' : c;
+            for (i++; i < sql.size() && sql[i] != close; i++)
+                ;
+        }
+        else if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-')
+        {
+            for (; i < sql.size() && sql[i] != '\n'; i++)
+                ;
+        }
+        else if (c == '/' && i + 1 < sql.size() && sql[i + 1] == '*')
+        {
+            for (i += 2; i + 1 < sql.size() && !(sql[i] == '*' && sql[i + 1] == '/'); i++)
+                ;
+            i++;
+        }
+        else if (c == '?')
+        {
+            if (i + 1 < sql.size() && sql[i + 1] >= '0' && sql[i + 1] <= '9')
+                return -1;
+            count++;
+        }
+        else if (c == ':' || c == '@' || c == '$')
+            return -1;
+    }
+    return count;
+}
+
+inline std::size_t next_query_slot() noexcept
+{
+    static std::atomic<std::size_t> next = 0;
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+// std::string parameters are taken as std::string_view so binding never needs a temporary copy.
+template <typename T>
+using query_param_t = std::conditional_t<std::is_same_v<T, std::string>, std::string_view, T>;
+
+template <typename T>
+struct is_view_column : std::false_type
+{};
+
+template <>
+struct is_view_column<const char*> : std::true_type
+{};
+
+template <>
+struct is_view_column<std::string_view> : std::true_type
+{};
+
+template <typename T>
+struct is_view_column<blob<T>> : std::true_type
+{};
+
+template <typename T>
+struct is_view_column<std::optional<T>> : is_view_column<T>
+{};
+
+template <typename T>
+concept owning_column = !is_view_column<T>::value;
+}  // namespace detail
+
+class database;
+
+namespace detail
+{
+inline bool read_tables(const database& db, const std::string_view sql, std::vector<std::string>& tables);
+}  // namespace detail
+
+template <typename Arena, typename... Ts>
+class basic_row_range;
+
+// Rows decoded straight from the statement, and rows decoded through arena_loader into a row_arena.
+template <typename... Ts>
+using row_range = basic_row_range<void, Ts...>;
+
+template <typename... Ts>
+using arena_row_range = basic_row_range<row_arena, Ts...>;
+
+template <typename T>
+class struct_range;
+
+template <fixed_string Sql, typename Columns = std::tuple<>, typename... Params>
+class query;
+
+// Lifetime policies for bound text and blobs. With bind_static the buffer must stay alive and
+// unchanged until the parameter is rebound or the statement is finalized; with bind_transient
+// SQLite makes its own copy before bind returns.
+struct bind_static_t
+{
+    static sqlite3_destructor_type destructor() noexcept
+    {
+        return SQLITE_STATIC;
+    }
+};
+
+struct bind_transient_t
+{
+    static sqlite3_destructor_type destructor() noexcept
+    {
+        return SQLITE_TRANSIENT;
+    }
+};
+
+inline constexpr bind_static_t bind_static {};
+inline constexpr bind_transient_t bind_transient {};
+
+template <typename T>
+concept bind_lifetime = std::same_as<T, bind_static_t> || std::same_as<T, bind_transient_t>;
+
+// A blob of the given number of zero bytes, for example to be filled in later with a
+// blob_stream.
+struct zeroblob
+{
+    std::uint64_t size;
+};
+
+// A pointer passed through sqlite3_bind_pointer. type must be a string with static storage
+// duration; destroy, if set, is called on ptr once SQLite no longer needs it.
+template <typename T>
+struct pointer
+{
+    T* ptr;
+    const char* type;
+    void (*destroy)(void*) = nullptr;
+};
+
+enum class bulk_insert
+{
+    // Binds and steps the statement once per row.
+    per_row,
+    // Rewrites "INSERT ... VALUES (?, ?)" into chunks of multi-row VALUES, sized to stay under
+    // SQLITE_LIMIT_VARIABLE_NUMBER. Falls back to per_row if the statement cannot be rewritten.
+    multi_row_values
+};
+
+// How a top-level transaction started by database::atomic takes its locks. immediate and
+// exclusive take the write lock up front, so a writer waits for it through the busy handler
+// instead of failing with SQLITE_BUSY when a deferred transaction tries to upgrade.
+enum class transaction_mode
+{
+    deferred,
+    immediate,
+    exclusive
+};
+
+enum class openflags
+{
+    readonly = SQLITE_OPEN_READONLY,
+    readwrite = SQLITE_OPEN_READWRITE,
+    create = SQLITE_OPEN_CREATE,
+    nomutex = SQLITE_OPEN_NOMUTEX,
+    fullmutex = SQLITE_OPEN_FULLMUTEX,
+    sharedcache = SQLITE_OPEN_SHAREDCACHE,
+    privatecach = SQLITE_OPEN_PRIVATECACHE,
+    uri = SQLITE_OPEN_URI
+};
+
+constexpr openflags operator|(const openflags& a, const openflags& b) noexcept
+{
+    return static_cast<openflags>(static_cast<unsigned int>(a) | static_cast<unsigned int>(b));
+}
+
+enum class journal_mode
+{
+    delete_,
+    truncate,
+    persist,
+    memory,
+    wal,
+    off
+};
+
+enum class synchronous_mode
+{
+    off = 0,
+    normal = 1,
+    full = 2,
+    extra = 3
+};
+
+enum class temp_store_mode
+{
+    default_ = 0,
+    file = 1,
+    memory = 2
+};
+
+enum class locking_mode
+{
+    normal,
+    exclusive
+};
+
+struct mmap_options
+{
+    // Ask the kernel to read the whole file ahead with MADV_WILLNEED, so the first queries don't
+    // fault pages in one at a time.
+    bool prefetch = false;
+    // Ask for transparent huge pages with MADV_HUGEPAGE. This is only honoured by kernels and file
+    // systems that support huge pages for file mappings and is silently ignored elsewhere.
+    bool huge_pages = false;
+};
+
+// A connection's lookaside: slots preallocated for the small objects it creates and frees all
+// the time, such as expression nodes and row buffers. The defaults are SQLite's; with hundreds of
+// connections, fewer slots trade allocator calls for memory.
+struct lookaside_options
+{
+    int slot_size = 1200;
+    int slots = 100;
+};
+
+namespace detail
+{
+// The address ranges at which SQLite mapped a database file. SQLite does not expose its mapping,
+// so on Linux it is found by file name in /proc/self/maps.
+class mapped_regions
+{
+public:
+    void locate(const char* filename, const mmap_options& options)
+    {
+        this->regions.clear();
+#ifdef __linux__
+        if (!filename || !*filename)
+            return;
+        std::error_code error;
+        auto path = std::filesystem::canonical(filename, error);
+        if (error)
+            return;
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        while (std::getline(maps, line))
+        {
+            auto slash = line.find('/');
+            if (slash == std::string::npos || line.compare(slash, std::string::npos, path.native()) != 0)
+                continue;
+            std::uintptr_t begin, end;
+            if (std::sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR, &begin, &end) != 2)
+                continue;
+            auto data = reinterpret_cast<void*>(begin);
+            if (options.huge_pages)
+                ::madvise(data, end - begin, MADV_HUGEPAGE);
+            if (options.prefetch)
+                ::madvise(data, end - begin, MADV_WILLNEED);
+            this->regions.emplace_back(begin, end);
+        }
+#else
+        (void)filename;
+        (void)options;
+#endif
+    }
+
+    bool contains(const void* data, std::size_t size) const noexcept
+    {
+        auto begin = reinterpret_cast<std::uintptr_t>(data);
+        for (auto [first, last] : this->regions)
+        {
+            if (begin >= first && begin + size <= last)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    std::vector<std::pair<std::uintptr_t, std::uintptr_t>> regions;
+};
+}  // namespace detail
+
+// How a connection retries when the database is locked by another connection. Delays grow
+// exponentially from initial_delay up to max_delay and are randomized so that connections that
+// collided don't retry in lockstep.
+struct busy_backoff
+{
+    std::chrono::microseconds initial_delay = std::chrono::microseconds(100);
+    std::chrono::microseconds max_delay = std::chrono::milliseconds(50);
+    double multiplier = 2;
+    // The randomized fraction of each delay: 0 sleeps exactly the delay, 1 sleeps a uniformly
+    // random time between zero and the delay.
+    double jitter = 1;
+    // Once this much time has passed the statement fails with busy_error.
+    std::chrono::milliseconds timeout = std::chrono::seconds(5);
+};
+
+namespace detail
+{
+class busy_handler
+{
+public:
+    explicit busy_handler(const busy_backoff& policy)
+        : policy(policy)
+        , random(std::random_device()())
+    {}
+
+    static int callback(void* context, int attempts) noexcept
+    {
+        return static_cast<busy_handler*>(context)->retry(attempts);
+    }
+
+private:
+    int retry(int attempts) noexcept
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (attempts == 0)
+            this->first_attempt = now;
+        auto remaining = this->first_attempt + this->policy.timeout - now;
+        if (remaining <= remaining.zero())
+            return 0;
+
+        double delay = static_cast<double>(this->policy.initial_delay.count()) *
+                       std::pow(this->policy.multiplier, std::min(attempts, 64));
+        delay = std::min(delay, static_cast<double>(this->policy.max_delay.count()));
+        delay *= 1 - this->policy.jitter * std::uniform_real_distribution<double>(0, 1)(this->random);
+        auto sleep = std::chrono::microseconds(static_cast<std::int64_t>(delay));
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(sleep, remaining));
+        return 1;
+    }
+
+    busy_backoff policy;
+    std::minstd_rand random;
+    std::chrono::steady_clock::time_point first_attempt;
+};
+}  // namespace detail
+
+// Tuning applied when a database is opened. Settings left unset keep SQLite's defaults. Pragmas
+// without persistent effect apply to the connection only, so every connection needs them.
+struct database_options
+{
+    openflags flags = openflags::readwrite | openflags::create;
+    std::optional<journal_mode> journal;
+    std::optional<synchronous_mode> synchronous;
+    // Like the pragma: positive values are pages, negative values are KiB.
+    std::optional<std::int64_t> cache_size;
+    std::optional<std::int64_t> mmap_size;
+    std::optional<temp_store_mode> temp_store;
+    // Only takes effect before the database has content, or on the next VACUUM outside WAL mode.
+    std::optional<int> page_size;
+    std::optional<std::chrono::milliseconds> busy_timeout;
+    // Replaces busy_timeout, since a connection has a single busy handler.
+    std::optional<busy_backoff> backoff;
+    std::optional<int> wal_autocheckpoint;
+    std::optional<locking_mode> locking;
+    // Pairs of an integer SQLITE_DBCONFIG_* option and its value, such as
+    // {SQLITE_DBCONFIG_ENABLE_FKEY, 1}.
+    std::vector<std::pair<int, int>> db_config;
+    // Pairs of a SQLITE_LIMIT_* category and its new value.
+    std::vector<std::pair<int, int>> limits;
+    // Memory-maps the whole file with database::map_file after the other settings are applied.
+    std::optional<mmap_options> map_file;
+    // Applied before the other settings, while the lookaside is still unused.
+    std::optional<lookaside_options> lookaside;
+    // The registered VFS to open the database with, such as a vfs after install(); the default
+    // VFS if empty.
+    std::string vfs;
+
+    const char* vfs_name() const noexcept
+    {
+        return this->vfs.empty() ? nullptr : this->vfs.c_str();
+    }
+
+    // For loading large amounts of data into a database that can be rebuilt if the process dies:
+    // no fsyncs, an in-memory rollback journal and a large cache held exclusively.
+    static database_options bulk_load()
+    {
+        database_options options;
+        options.journal = journal_mode::memory;
+        options.synchronous = synchronous_mode::off;
+        options.cache_size = -256 * 1024;
+        options.temp_store = temp_store_mode::memory;
+        options.locking = locking_mode::exclusive;
+        return options;
+    }
+
+    // For a service with many concurrent readers and a single writer: WAL, which is durable with
+    // synchronous=normal, memory-mapped reads and a busy timeout instead of immediate SQLITE_BUSY.
+    static database_options read_heavy_server()
+    {
+        database_options options;
+        options.journal = journal_mode::wal;
+        options.synchronous = synchronous_mode::normal;
+        options.cache_size = -64 * 1024;
+        options.mmap_size = std::int64_t(256) << 20;
+        options.temp_store = temp_store_mode::memory;
+        options.busy_timeout = std::chrono::seconds(5);
+        options.wal_autocheckpoint = 1000;
+        options.db_config = { { SQLITE_DBCONFIG_ENABLE_FKEY, 1 } };
+        return options;
+    }
+
+    // For devices with little RAM: a small page cache, no memory mapping, temporary tables on
+    // disk and a cap on the size of any single value.
+    static database_options low_memory_embedded()
+    {
+        database_options options;
+        options.journal = journal_mode::wal;
+        options.synchronous = synchronous_mode::normal;
+        options.cache_size = -512;
+        options.mmap_size = 0;
+        options.temp_store = temp_store_mode::file;
+        options.page_size = 4096;
+        options.wal_autocheckpoint = 250;
+        options.limits = { { SQLITE_LIMIT_LENGTH, 16 << 20 } };
+        return options;
+    }
+
+    // Looks a preset up by name: "bulk_load", "read_heavy_server" or "low_memory_embedded".
+    static database_options preset(const std::string_view name)
+    {
+        if (name == "bulk_load")
+            return bulk_load();
+        if (name == "read_heavy_server")
+            return read_heavy_server();
+        if (name == "low_memory_embedded")
+            return low_memory_embedded();
+        throw std::invalid_argument("unknown database_options preset");
+    }
+};
+
+struct cache_stats
+{
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t size;
+    std::size_t capacity;
+};
+
+// LRU cache of prepared statements keyed by their SQL text. A cached statement is leased out
+// exclusively; when the lease ends it is reset, its bindings are cleared and it goes back to the
+// front of the LRU list. Statements that are leased out are never evicted.
+class statement_cache
+{
+public:
+    struct entry
+    {
+        std::string sql;
+        sqlite3_stmt* stmt;
+        statement_cache* owner;
+        bool leased;
+    };
+
+    explicit statement_cache(std::size_t capacity) noexcept
+        : capacity(capacity)
+    {}
+
+    statement_cache(const statement_cache&) = delete;
+    statement_cache& operator=(const statement_cache&) = delete;
+
+    ~statement_cache()
+    {
+        for (auto& e : this->entries)
+            sqlite3_finalize(e.stmt);
+    }
+
+    // Returns nullptr if the statement cannot be served from the cache, either because caching is
+    // disabled or because the cached statement for this SQL is already leased out.
+    entry* acquire(sqlite3* db, const std::string_view sql)
+    {
+        if (auto it = this->index.find(sql); it != this->index.end())
+        {
+            auto& e = *it->second;
+            if (e.leased)
+            {
+                this->misses++;
+                return nullptr;
+            }
+
+            this->hits++;
+            this->entries.splice(this->entries.begin(), this->entries, it->second);
+            e.leased = true;
+            return &e;
+        }
+
+        this->misses++;
+        if (this->capacity == 0)
+            return nullptr;
+
+        sqlite3_stmt* stmt;
+        if (int error = sqlite3_prepare_v2(db, sql.data(), sql.length(), &stmt, nullptr))
+            detail::throw_error(db, error);
+
+        auto& e = this->entries.emplace_front(entry { std::string(sql), stmt, this, true });
+        this->index.emplace(e.sql, this->entries.begin());
+        this->evict();
+        return &e;
+    }
+
+    void release(entry* e) noexcept
+    {
+        sqlite3_reset(e->stmt);
+        sqlite3_clear_bindings(e->stmt);
+        e->leased = false;
+        this->evict();
+    }
+
+    void set_capacity(std::size_t capacity)
+    {
+        this->capacity = capacity;
+        this->evict();
+    }
+
+    void clear() noexcept
+    {
+        auto saved_capacity = this->capacity;
+        this->capacity = 0;
+        this->evict();
+        this->capacity = saved_capacity;
+    }
+
+    cache_stats stats() const noexcept
+    {
+        return { this->hits, this->misses, this->entries.size(), this->capacity };
+    }
+
+private:
+    void evict() noexcept
+    {
+        auto it = this->entries.end();
+        while (this->entries.size() > this->capacity && it != this->entries.begin())
+        {
+            auto& e = *--it;
+            if (e.leased)
+                continue;
+
+            this->index.erase(e.sql);
+            sqlite3_finalize(e.stmt);
+            it = this->entries.erase(it);
+        }
+    }
+
+    std::list<entry> entries;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+    std::size_t capacity;
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+};
+
+// Counters from sqlite3_stmt_status describing the work done by a statement.
+struct statement_status
+{
+    std::uint64_t fullscan_steps = 0;
+    std::uint64_t sorts = 0;
+    std::uint64_t autoindexes = 0;
+    std::uint64_t vm_steps = 0;
+    std::uint64_t reprepares = 0;
+    std::uint64_t runs = 0;
+
+    static statement_status of(sqlite3_stmt* stmt, bool reset) noexcept
+    {
+        auto counter = [&](int op) { return static_cast<std::uint64_t>(sqlite3_stmt_status(stmt, op, reset)); };
+        return { counter(SQLITE_STMTSTATUS_FULLSCAN_STEP), counter(SQLITE_STMTSTATUS_SORT),
+                 counter(SQLITE_STMTSTATUS_AUTOINDEX),     counter(SQLITE_STMTSTATUS_VM_STEP),
+                 counter(SQLITE_STMTSTATUS_REPREPARE),     counter(SQLITE_STMTSTATUS_RUN) };
+    }
+
+    statement_status& operator+=(const statement_status& other) noexcept
+    {
+        this->fullscan_steps += other.fullscan_steps;
+        this->sorts += other.sorts;
+        this->autoindexes += other.autoindexes;
+        this->vm_steps += other.vm_steps;
+        this->reprepares += other.reprepares;
+        this->runs += other.runs;
+        return *this;
+    }
+};
+
+class statement
+{
+    friend class database;
+
+    statement(sqlite3* db, const std::string_view sql)
+    {
+        if (int error = sqlite3_prepare_v2(db, sql.data(), sql.length(), &this->stmt, nullptr))
+            detail::throw_error(db, error);
+    }
+
+    explicit statement(statement_cache::entry* lease) noexcept
+        : stmt(lease->stmt)
+        , lease(lease)
+    {}
+
+public:
+    constexpr statement() noexcept
+        : stmt(nullptr)
+    {}
+    constexpr statement(const statement&) noexcept = delete;
+    constexpr statement(statement&& other) noexcept
+        : stmt(other.stmt)
+        , lease(other.lease)
+    {
+        other.stmt = nullptr;
+        other.lease = nullptr;
+    }
+
+    ~statement()
+    {
+        this->close();
+    }
+
+    statement& operator=(const statement&) = delete;
+
+    statement& operator=(statement&& other)
+    {
+        this->close();
+        this->stmt = other.stmt;
+        this->lease = other.lease;
+        other.stmt = nullptr;
+        other.lease = nullptr;
+        return *this;
+    }
+
+    // Whether this statement is leased from a database's statement cache, in which case it is
+    // returned to the cache instead of being finalized.
+    bool cached() const noexcept
+    {
+        return this->lease != nullptr;
+    }
+
+    void reset() const
+    {
+        sqlite3_reset(this->stmt);
+    }
+
+    // The sqlite3_stmt_status counters of this statement. Note that a database with profiling
+    // enabled resets them every time the statement finishes running.
+    statement_status status(bool reset = false) const noexcept
+    {
+        return statement_status::of(this->stmt, reset);
+    }
+
+    void bind(int index, std::int32_t item) const
+    {
+        sqlite3_bind_int(this->stmt, index + 1, item);
+    }
+
+    void bind(int index, std::int64_t item) const
+    {
+        sqlite3_bind_int64(this->stmt, index + 1, item);
+    }
+
+    void bind(int index, double item) const
+    {
+        sqlite3_bind_double(this->stmt, index + 1, item);
+    }
+
+    void bind(int index, const std::string_view item) const
+    {
+        sqlite3_bind_text(this->stmt, index + 1, item.data(), item.length(), nullptr);
+    }
+
+    template <bind_lifetime Lifetime>
+    void bind(int index, const std::string_view item, Lifetime) const
+    {
+        sqlite3_bind_text(this->stmt, index + 1, item.data(), item.length(), Lifetime::destructor());
+    }
+
+    void bind(int index, std::nullptr_t) const
+    {
+        sqlite3_bind_null(this->stmt, index + 1);
+    }
+
+    template <bind_lifetime Lifetime = bind_static_t>
+    void bind(int index, const sqlite::value& item, Lifetime = {}) const
+    {
+        switch (item.type())
+        {
+        case value_type::integer:
+            sqlite3_bind_int64(this->stmt, index + 1, item.integer());
+            break;
+        case value_type::real:
+            sqlite3_bind_double(this->stmt, index + 1, item.real());
+            break;
+        case value_type::text:
+            // An empty view may have a null data pointer, which sqlite3_bind_text64 would bind as NULL.
+            if (item.text().empty())
+                sqlite3_bind_text64(this->stmt, index + 1, "", 0, SQLITE_STATIC, SQLITE_UTF8);
+            else
+                sqlite3_bind_text64(this->stmt, index + 1, item.text().data(), item.text().size(),
+                                    Lifetime::destructor(), SQLITE_UTF8);
+            break;
+        case value_type::blob:
+            if (item.bytes().empty())
+                sqlite3_bind_zeroblob64(this->stmt, index + 1, 0);
+            else
+                sqlite3_bind_blob64(this->stmt, index + 1, item.bytes().data(), item.bytes().size(),
+                                    Lifetime::destructor());
+            break;
+        default:
+            sqlite3_bind_null(this->stmt, index + 1);
+        }
+    }
+
+    template <typename T, bind_lifetime Lifetime = bind_static_t>
+    void bind(int index, const blob<T>& item, Lifetime = {}) const
+    {
+        sqlite3_uint64 length;
+        if constexpr (std::is_same_v<T, void>)
+            length = item.size;
+        else
+            length = static_cast<sqlite3_uint64>(item.size) * sizeof(T);
+        // A blob read back from x'' has a null data pointer, which sqlite3_bind_blob64 binds as NULL.
+        if (length == 0)
+            sqlite3_bind_zeroblob64(this->stmt, index + 1, 0);
+        else
+            sqlite3_bind_blob64(this->stmt, index + 1, item.data, length, Lifetime::destructor());
+    }
+
+    // Binds any contiguous range of trivially copyable elements, such as std::vector<float> or
+    // std::span<const std::byte>, as a blob.
+    template <std::ranges::contiguous_range R, bind_lifetime Lifetime = bind_static_t>
+        requires std::ranges::sized_range<R> && (!std::is_convertible_v<const R&, std::string_view>)
+        && std::is_trivially_copyable_v<std::ranges::range_value_t<R>>
+    void bind(int index, const R& item, Lifetime = {}) const
+    {
+        auto length = static_cast<sqlite3_uint64>(std::ranges::size(item)) * sizeof(std::ranges::range_value_t<R>);
+        if (length == 0)
+            sqlite3_bind_zeroblob64(this->stmt, index + 1, 0);
+        else
+            sqlite3_bind_blob64(this->stmt, index + 1, std::ranges::data(item), length, Lifetime::destructor());
+    }
+
+    void bind(int index, zeroblob item) const
+    {
+        sqlite3_bind_zeroblob64(this->stmt, index + 1, item.size);
+    }
+
+    template <typename T>
+    void bind(int index, const pointer<T>& item) const
+    {
+        sqlite3_bind_pointer(this->stmt, index + 1, const_cast<std::remove_const_t<T>*>(item.ptr), item.type, item.destroy);
+    }
+
+    void bind_multiple() const {}
+
+    template <typename... Args, std::size_t... I>
+    void bind_multiple_impl(std::index_sequence<I...>, Args&&... args) const
+    {
+        (bind(I, args), ...);
+    }
+
+    template <typename... Args>
+    void bind_multiple(Args&&... args) const
+    {
+        bind_multiple_impl(std::index_sequence_for<Args...> {}, std::forward<Args>(args)...);
+    }
+
+    template <int Index, typename T>
+    T get() const
+    {
+        return loader<T>::get(this->stmt, Index);
+    }
+
+    int column_count() const noexcept
+    {
+        return sqlite3_column_count(this->stmt);
+    }
+
+    const char* column_name(int index) const noexcept
+    {
+        return sqlite3_column_name(this->stmt, index);
+    }
+
+    // The declared type of the table column the result column comes from, or null for an
+    // expression.
+    const char* column_decltype(int index) const noexcept
+    {
+        return sqlite3_column_decltype(this->stmt, index);
+    }
+
+    // The storage class of the column in the current row.
+    value_type column_type(int index) const noexcept
+    {
+        return value_type(sqlite3_column_type(this->stmt, index));
+    }
+
+    // Decodes the current row's first row.size() columns, or all of them if there are fewer.
+    // Returns the number of columns decoded. Text and blobs are views into the statement.
+    std::size_t get_row(std::span<sqlite::value> row) const
+    {
+        auto count = std::min<std::size_t>(row.size(), sqlite3_column_count(this->stmt));
+        for (std::size_t i = 0; i < count; i++)
+            row[i] = loader<sqlite::value>::get(this->stmt, static_cast<int>(i));
+        return count;
+    }
+
+    template <typename... Args, std::size_t... I>
+    std::tuple<Args...> get_all_impl(std::tuple<Args...>&&, std::index_sequence<I...>) const
+    {
+        return std::tuple<Args...>(loader<Args>::get(this->stmt, I)...);
+    }
+
+    template <typename... Args>
+    std::tuple<Args...> get_all() const
+    {
+        return get_all_impl(std::tuple<Args...> {}, std::index_sequence_for<Args...> {});
+    }
+
+    // Like get_all, but decodes through arena_loader so that strings, vectors and views are
+    // allocated in the arena.
+    template <typename... Args>
+    std::tuple<Args...> get_all(row_arena& arena) const
+    {
+        return get_all_impl<Args...>(arena, std::index_sequence_for<Args...> {});
+    }
+
+    template <typename... Args, std::size_t... I>
+    std::tuple<Args...> get_all_impl(row_arena& arena, std::index_sequence<I...>) const
+    {
+        return std::tuple<Args...>(arena_loader<Args>::get(this->stmt, I, arena)...);
+    }
+
+    // Decodes the current row into a T, one column per member. Aggregates are initialized in
+    // place from loader<T>::get; types mapped with sqlite::fields are default constructed and
+    // filled.
+    template <typename T>
+    T get_as() const
+    {
+        return detail::decode_row<T>(this->stmt);
+    }
+
+    // Decodes the current row into an existing T through fill_loader, so strings and vectors
+    // reuse their capacity.
+    template <typename T>
+    void fill(T& value) const
+    {
+        detail::fill_row(this->stmt, value);
+    }
+
+    bool step() const
+    {
+        return detail::step(this->stmt);
+    }
+
+    // Like step, but when a shared-cache lock held by another connection makes the statement fail
+    // with SQLITE_LOCKED_SHAREDCACHE, waits with sqlite3_unlock_notify for that connection's
+    // transaction to end and runs the statement again from the start.
+    bool blocking_step() const
+    {
+        for (;;)
+        {
+            int result = sqlite3_step(this->stmt);
+            if (result == SQLITE_ROW)
+                return true;
+            if (result == SQLITE_DONE)
+                return false;
+            sqlite3* db = sqlite3_db_handle(this->stmt);
+            if (sqlite3_extended_errcode(db) != SQLITE_LOCKED_SHAREDCACHE || !detail::wait_for_unlock(db))
+                detail::throw_error(db, result);
+            sqlite3_reset(this->stmt);
+        }
+    }
+
+    // Steps the statement up to max_rows times, appending each row to the column buffers of
+    // batch after clearing it. Returns the number of rows fetched; fewer than max_rows means the
+    // statement is done.
+    template <typename... Ts>
+    std::size_t fetch_columns(column_batch<Ts...>& batch, std::size_t max_rows) const
+    {
+        batch.clear();
+        while (batch.size() < max_rows && this->step())
+            batch.append(this->stmt, std::index_sequence_for<Ts...> {});
+        return batch.size();
+    }
+
+    template <typename... Ts>
+    column_batch<Ts...> fetch_columns(std::size_t max_rows) const
+    {
+        column_batch<Ts...> batch;
+        this->fetch_columns(batch, max_rows);
+        return batch;
+    }
+
+    // Returns an input range that steps the statement lazily and yields a row_view per row. The
+    // range refers to this statement, which must outlive it.
+    template <typename... Ts>
+    row_range<Ts...> rows() const&
+    {
+        return row_range<Ts...>(this->stmt);
+    }
+
+    // Same as above, but the returned range takes ownership of the statement.
+    template <typename... Ts>
+    row_range<Ts...> rows() &&
+    {
+        return row_range<Ts...>(std::move(*this));
+    }
+
+    // Row ranges whose row_views decode through arena_loader into the given arena.
+    template <typename... Ts>
+    arena_row_range<Ts...> rows(row_arena& arena) const&
+    {
+        return arena_row_range<Ts...>(this->stmt, &arena);
+    }
+
+    template <typename... Ts>
+    arena_row_range<Ts...> rows(row_arena& arena) &&
+    {
+        return arena_row_range<Ts...>(std::move(*this), &arena);
+    }
+
+    // Returns an input range that steps the statement lazily and yields each row decoded as T.
+    template <typename T>
+    struct_range<T> rows_as() const&
+    {
+        return struct_range<T>(this->stmt);
+    }
+
+    template <typename T>
+    struct_range<T> rows_as() &&
+    {
+        return struct_range<T>(std::move(*this));
+    }
+
+    sqlite3_stmt* handle() const
+    {
+        return stmt;
+    }
+
+private:
+    void close() noexcept
+    {
+        if (this->lease)
+            this->lease->owner->release(this->lease);
+        else
+            sqlite3_finalize(this->stmt);
+    }
+
+    sqlite3_stmt* stmt;
+    statement_cache::entry* lease = nullptr;
+};
+
+// A lightweight view of the current row of a statement. Columns are read directly from
+// sqlite3_column_* when they are accessed, so string_view and blob columns are never copied. A
+// row_view is only valid until the statement is stepped again. An arena_row_view decodes columns
+// with arena_loader instead, and the values it returns outlive the row. The arena is part of the
+// type so that the plain row_view pays nothing for it on every column.
+template <typename Arena, typename... Ts>
+class basic_row_view
+{
+public:
+    explicit constexpr basic_row_view(sqlite3_stmt* stmt, Arena* arena = nullptr) noexcept
+        : stmt(stmt)
+        , arena(arena)
+    {}
+
+    template <std::size_t I>
+    std::tuple_element_t<I, std::tuple<Ts...>> get() const
+    {
+        using T = std::tuple_element_t<I, std::tuple<Ts...>>;
+        if constexpr (std::is_void_v<Arena>)
+            return loader<T>::get(this->stmt, I);
+        else
+            return arena_loader<T>::get(this->stmt, I, *this->arena);
+    }
+
+    std::tuple<Ts...> tuple() const
+    {
+        return this->tuple_impl(std::index_sequence_for<Ts...> {});
+    }
+
+    sqlite3_stmt* handle() const
+    {
+        return stmt;
+    }
+
+private:
+    template <std::size_t... I>
+    std::tuple<Ts...> tuple_impl(std::index_sequence<I...>) const
+    {
+        return std::tuple<Ts...>(this->get<I>()...);
+    }
+
+    sqlite3_stmt* stmt;
+    Arena* arena;
+};
+
+template <typename... Ts>
+using row_view = basic_row_view<void, Ts...>;
+
+template <typename... Ts>
+using arena_row_view = basic_row_view<row_arena, Ts...>;
+
+template <typename Arena, typename... Ts>
+class basic_row_range : public std::ranges::view_interface<basic_row_range<Arena, Ts...>>
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_concept = std::input_iterator_tag;
+        using iterator_category = std::input_iterator_tag;
+        using value_type = basic_row_view<Arena, Ts...>;
+        using difference_type = std::ptrdiff_t;
+        using reference = basic_row_view<Arena, Ts...>;
+
+        constexpr iterator() noexcept
+            : stmt(nullptr)
+            , arena(nullptr)
+        {}
+
+        explicit constexpr iterator(sqlite3_stmt* stmt, Arena* arena = nullptr) noexcept
+            : stmt(stmt)
+            , arena(arena)
+        {}
+
+        reference operator*() const noexcept
+        {
+            return basic_row_view<Arena, Ts...>(this->stmt, this->arena);
+        }
+
+        iterator& operator++()
+        {
+            if (!detail::step(this->stmt))
+                this->stmt = nullptr;
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            ++*this;
+        }
+
+        friend bool operator==(const iterator& it, std::default_sentinel_t) noexcept
+        {
+            return it.stmt == nullptr;
+        }
+
+    private:
+        sqlite3_stmt* stmt;
+        Arena* arena;
+    };
+
+    explicit basic_row_range(sqlite3_stmt* stmt, Arena* arena = nullptr) noexcept
+        : stmt(stmt)
+        , arena(arena)
+    {}
+
+    explicit basic_row_range(statement&& owned, Arena* arena = nullptr) noexcept
+        : owned(std::move(owned))
+        , stmt(this->owned.handle())
+        , arena(arena)
+    {}
+
+    // Steps the statement to its first row, so a range can only be iterated once.
+    iterator begin()
+    {
+        return ++iterator(this->stmt, this->arena);
+    }
+
+    std::default_sentinel_t end() const noexcept
+    {
+        return {};
+    }
+
+private:
+    statement owned;
+    sqlite3_stmt* stmt;
+    Arena* arena;
+};
+
+// An input range over the rows of a statement decoded as T. Every row is filled into the same T,
+// which the iterator returns by reference, so a scan reuses the capacity of its strings and
+// vectors instead of allocating per row; copy the value to keep it. Types that can't be assigned,
+// such as those holding a blob, are decoded afresh for each row.
+template <typename T>
+class struct_range : public std::ranges::view_interface<struct_range<T>>
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_concept = std::input_iterator_tag;
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = const T&;
+
+        constexpr iterator() noexcept
+            : range(nullptr)
+        {}
+
+        explicit constexpr iterator(struct_range* range) noexcept
+            : range(range)
+        {}
+
+        reference operator*() const noexcept
+        {
+            return *this->range->current;
+        }
+
+        iterator& operator++()
+        {
+            if (!this->range->advance())
+                this->range = nullptr;
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            ++*this;
+        }
+
+        friend bool operator==(const iterator& it, std::default_sentinel_t) noexcept
+        {
+            return it.range == nullptr;
+        }
+
+    private:
+        struct_range* range;
+    };
+
+    explicit struct_range(sqlite3_stmt* stmt) noexcept
+        : stmt(stmt)
+    {}
+
+    explicit struct_range(statement&& owned) noexcept
+        : owned(std::move(owned))
+        , stmt(this->owned.handle())
+    {}
+
+    // Steps the statement to its first row, so a range can only be iterated once.
+    iterator begin()
+    {
+        return ++iterator(this);
+    }
+
+    std::default_sentinel_t end() const noexcept
+    {
+        return {};
+    }
+
+private:
+    static constexpr bool reusable = std::default_initializable<T> && std::is_copy_assignable_v<T>;
+
+    bool advance()
+    {
+        if (!detail::step(this->stmt))
+            return false;
+        if constexpr (reusable)
+        {
+            if (!this->current)
+                this->current.emplace();
+            detail::fill_row(this->stmt, *this->current);
+        }
+        else
+        {
+            this->current.reset();
+            this->current.emplace(detail::decode_row<T>(this->stmt));
+        }
+        return true;
+    }
+
+    statement owned;
+    sqlite3_stmt* stmt;
+    std::optional<T> current;
+};
+
+namespace detail
+{
+enum class arrow_type
+{
+    null,
+    boolean,
+    int8,
+    uint8,
+    int16,
+    uint16,
+    int32,
+    uint32,
+    int64,
+    uint64,
+    float32,
+    float64,
+    utf8,
+    large_utf8,
+    binary,
+    large_binary
+};
+
+inline std::optional<arrow_type> parse_arrow_format(const char* format) noexcept
+{
+    if (!format[0] || format[1])
+        return {};
+    switch (format[0])
+    {
+    case 'n':
+        return arrow_type::null;
+    case 'b':
+        return arrow_type::boolean;
+    case 'c':
+        return arrow_type::int8;
+    case 'C':
+        return arrow_type::uint8;
+    case 's':
+        return arrow_type::int16;
+    case 'S':
+        return arrow_type::uint16;
+    case 'i':
+        return arrow_type::int32;
+    case 'I':
+        return arrow_type::uint32;
+    case 'l':
+        return arrow_type::int64;
+    case 'L':
+        return arrow_type::uint64;
+    case 'f':
+        return arrow_type::float32;
+    case 'g':
+        return arrow_type::float64;
+    case 'u':
+        return arrow_type::utf8;
+    case 'U':
+        return arrow_type::large_utf8;
+    case 'z':
+        return arrow_type::binary;
+    case 'Z':
+        return arrow_type::large_binary;
+    default:
+        return {};
+    }
+}
+
+inline bool arrow_bit(const void* bitmap, std::int64_t i) noexcept
+{
+    return static_cast<const std::uint8_t*>(bitmap)[i / 8] & (1 << (i % 8));
+}
+
+template <typename Offset>
+std::pair<const char*, std::size_t> arrow_slice(const ArrowArray& column, std::int64_t i) noexcept
+{
+    auto offsets = static_cast<const Offset*>(column.buffers[1]);
+    auto data = static_cast<const char*>(column.buffers[2]);
+    return { data + offsets[i], static_cast<std::size_t>(offsets[i + 1] - offsets[i]) };
+}
+
+// Binds one cell of an Arrow array to a statement parameter. Text and blobs are bound without a
+// copy, so the array must stay alive until the statement has been stepped.
+inline void bind_arrow_cell(const statement& stmt, int index, const ArrowArray& column, arrow_type type, std::int64_t row)
+{
+    auto i = column.offset + row;
+    if (type == arrow_type::null || (column.null_count != 0 && column.buffers[0] && !arrow_bit(column.buffers[0], i)))
+        return stmt.bind(index, nullptr);
+
+    auto values = column.buffers[1];
+    switch (type)
+    {
+    case arrow_type::null:
+        break;
+    case arrow_type::boolean:
+        return stmt.bind(index, static_cast<std::int32_t>(arrow_bit(values, i)));
+    case arrow_type::int8:
+        return stmt.bind(index, static_cast<std::int32_t>(static_cast<const std::int8_t*>(values)[i]));
+    case arrow_type::uint8:
+        return stmt.bind(index, static_cast<std::int32_t>(static_cast<const std::uint8_t*>(values)[i]));
+    case arrow_type::int16:
+        return stmt.bind(index, static_cast<std::int32_t>(static_cast<const std::int16_t*>(values)[i]));
+    case arrow_type::uint16:
+        return stmt.bind(index, static_cast<std::int32_t>(static_cast<const std::uint16_t*>(values)[i]));
+    case arrow_type::int32:
+        return stmt.bind(index, static_cast<const std::int32_t*>(values)[i]);
+    case arrow_type::uint32:
+        return stmt.bind(index, static_cast<std::int64_t>(static_cast<const std::uint32_t*>(values)[i]));
+    case arrow_type::int64:
+        return stmt.bind(index, static_cast<const std::int64_t*>(values)[i]);
+    case arrow_type::uint64:
+    {
+        auto value = static_cast<const std::uint64_t*>(values)[i];
+        if (value > static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+            return stmt.bind(index, static_cast<double>(value));
+        return stmt.bind(index, static_cast<std::int64_t>(value));
+    }
+    case arrow_type::float32:
+        return stmt.bind(index, static_cast<double>(static_cast<const float*>(values)[i]));
+    case arrow_type::float64:
+        return stmt.bind(index, static_cast<const double*>(values)[i]);
+    case arrow_type::utf8:
+    case arrow_type::large_utf8:
+    {
+        auto [data, length] = type == arrow_type::utf8 ? arrow_slice<std::int32_t>(column, i) : arrow_slice<std::int64_t>(column, i);
+        return stmt.bind(index, std::string_view(data, length));
+    }
+    case arrow_type::binary:
+    case arrow_type::large_binary:
+    {
+        auto [data, length] = type == arrow_type::binary ? arrow_slice<std::int32_t>(column, i) : arrow_slice<std::int64_t>(column, i);
+        return stmt.bind(index, blob<void>(data, static_cast<int>(length)));
+    }
+    }
+}
+
+inline std::string quote_identifier(const std::string_view name)
+{
+    std::string quoted = "\"";
+    for (char c : name)
+    {
+        if (c == '"')
+            quoted += '"';
+        quoted += c;
+    }
+    quoted += '"';
+    return quoted;
+}
+}  // namespace detail
+
+enum class function_flags
+{
+    none = 0,
+    // The function always gives the same result for the same arguments, which lets the planner
+    // factor calls out of loops and use the function in indexes.
+    deterministic = SQLITE_DETERMINISTIC,
+    direct_only = SQLITE_DIRECTONLY,
+    innocuous = SQLITE_INNOCUOUS
+};
+
+constexpr function_flags operator|(const function_flags& a, const function_flags& b) noexcept
+{
+    return static_cast<function_flags>(static_cast<int>(a) | static_cast<int>(b));
+}
+
+namespace detail
+{
+template <typename T>
+struct function_traits : function_traits<decltype(&T::operator())>
+{};
+
+template <typename R, typename... Args>
+struct function_traits<R (*)(Args...)>
+{
+    using result_type = R;
+    using args = std::tuple<std::decay_t<Args>...>;
+};
+
+template <typename R, typename... Args>
+struct function_traits<R (*)(Args...) noexcept> : function_traits<R (*)(Args...)>
+{};
+
+template <typename C, typename R, typename... Args>
+struct function_traits<R (C::*)(Args...)> : function_traits<R (*)(Args...)>
+{};
+
+template <typename C, typename R, typename... Args>
+struct function_traits<R (C::*)(Args...) const> : function_traits<R (*)(Args...)>
+{};
+
+template <typename C, typename R, typename... Args>
+struct function_traits<R (C::*)(Args...) noexcept> : function_traits<R (*)(Args...)>
+{};
+
+template <typename C, typename R, typename... Args>
+struct function_traits<R (C::*)(Args...) const noexcept> : function_traits<R (*)(Args...)>
+{};
+
+// Calls func with the arguments decoded with value_loader<Args> and sets its return value as
+// the result of the function.
+template <typename Args, typename F, std::size_t... I>
+void call_with_values(sqlite3_context* ctx, F&& func, sqlite3_value** argv, std::index_sequence<I...>)
+{
+    using R = decltype(func(value_loader<std::tuple_element_t<I, Args>>::get(argv[I])...));
+    if constexpr (std::is_void_v<R>)
+        func(value_loader<std::tuple_element_t<I, Args>>::get(argv[I])...);
+    else
+        result<std::decay_t<R>>::set(ctx, func(value_loader<std::tuple_element_t<I, Args>>::get(argv[I])...));
+}
+
+template <typename F>
+void report_errors(sqlite3_context* ctx, F&& func) noexcept
+{
+    try
+    {
+        func();
+    }
+    catch (const std::exception& e)
+    {
+        sqlite3_result_error(ctx, e.what(), -1);
+    }
+    catch (...)
+    {
+        sqlite3_result_error(ctx, "unknown exception in user-defined function", -1);
+    }
+}
+
+template <typename F>
+struct scalar_function
+{
+    using args = typename function_traits<F>::args;
+    static constexpr int arity = std::tuple_size_v<args>;
+
+    static void call(sqlite3_context* ctx, int, sqlite3_value** argv)
+    {
+        report_errors(ctx, [&]() {
+            auto& func = *static_cast<F*>(sqlite3_user_data(ctx));
+            call_with_values<args>(ctx, func, argv, std::make_index_sequence<arity> {});
+        });
+    }
+
+    static void destroy(void* func)
+    {
+        delete static_cast<F*>(func);
+    }
+};
+
+// Aggregate and window function trampolines. Each group gets its own A, created on the first
+// step and destroyed by finalize; A must be default constructible.
+template <typename A>
+struct aggregate_function
+{
+    using args = typename function_traits<decltype(&A::step)>::args;
+    static constexpr int arity = std::tuple_size_v<args>;
+
+    static A* state(sqlite3_context* ctx, bool create)
+    {
+        auto slot = static_cast<A**>(sqlite3_aggregate_context(ctx, create ? sizeof(A*) : 0));
+        if (!slot)
+            return nullptr;
+        if (!*slot && create)
+            *slot = new A();
+        return *slot;
+    }
+
+    static void step(sqlite3_context* ctx, int, sqlite3_value** argv)
+    {
+        report_errors(ctx, [&]() {
+            auto aggregate = state(ctx, true);
+            if (!aggregate)
+                return sqlite3_result_error_nomem(ctx);
+            call_with_values<args>(ctx, [&](auto&&... values) { aggregate->step(std::forward<decltype(values)>(values)...); }, argv,
+                                   std::make_index_sequence<arity> {});
+        });
+    }
+
+    static void inverse(sqlite3_context* ctx, int, sqlite3_value** argv)
+    {
+        report_errors(ctx, [&]() {
+            auto aggregate = state(ctx, true);
+            if (!aggregate)
+                return sqlite3_result_error_nomem(ctx);
+            call_with_values<args>(ctx, [&](auto&&... values) { aggregate->inverse(std::forward<decltype(values)>(values)...); }, argv,
+                                   std::make_index_sequence<arity> {});
+        });
+    }
+
+    static void value(sqlite3_context* ctx)
+    {
+        report_errors(ctx, [&]() {
+            auto aggregate = state(ctx, true);
+            if (!aggregate)
+                return sqlite3_result_error_nomem(ctx);
+            result<std::decay_t<decltype(aggregate->value())>>::set(ctx, aggregate->value());
+        });
+    }
+
+    static void finalize(sqlite3_context* ctx)
+    {
+        std::unique_ptr<A> aggregate(state(ctx, false));
+        report_errors(ctx, [&]() {
+            if (!aggregate)
+                aggregate = std::make_unique<A>();
+            result<std::decay_t<decltype(aggregate->finalize())>>::set(ctx, aggregate->finalize());
+        });
+    }
+};
+}  // namespace detail
+
+namespace detail
+{
+template <typename>
+struct vtab_module;
+
+template <typename T>
+struct is_optional : std::false_type
+{};
+
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type
+{};
+
+template <typename M>
+constexpr const char* vtab_column_type()
+{
+    if constexpr (is_optional<M>::value)
+        return vtab_column_type<typename M::value_type>();
+    else if constexpr (std::is_integral_v<M>)
+        return "INTEGER";
+    else if constexpr (std::is_floating_point_v<M>)
+        return "REAL";
+    else
+    {
+        static_assert(std::is_convertible_v<const M&, std::string_view>, "unsupported virtual table column type");
+        return "TEXT";
+    }
+}
+
+template <typename M>
+void vtab_column_result(sqlite3_context* ctx, const M& value)
+{
+    if constexpr (is_optional<M>::value)
+    {
+        if (value)
+            vtab_column_result(ctx, *value);
+        else
+            sqlite3_result_null(ctx);
+    }
+    else if constexpr (std::is_integral_v<M>)
+        sqlite3_result_int64(ctx, static_cast<std::int64_t>(value));
+    else if constexpr (std::is_floating_point_v<M>)
+        sqlite3_result_double(ctx, static_cast<double>(value));
+    else if constexpr (std::is_same_v<std::decay_t<M>, const char*>)
+        result<const char*>::set(ctx, value);
+    else
+        result<std::string_view>::set(ctx, std::string_view(value));
+}
+
+// Whether a constraint value can be compared natively against a column of type M. Mismatched
+// types (say text against an INTEGER column) are left to SQLite, which rechecks every row.
+template <typename M>
+bool vtab_comparable(sqlite3_value* value)
+{
+    int type = sqlite3_value_type(value);
+    if constexpr (is_optional<M>::value)
+        return vtab_comparable<typename M::value_type>(value);
+    else if constexpr (std::is_arithmetic_v<M>)
+        return type == SQLITE_INTEGER || type == SQLITE_FLOAT;
+    else
+        return type == SQLITE_TEXT;
+}
+
+// Compares a column value against a constraint value. NULL columns are unordered.
+template <typename M>
+std::partial_ordering vtab_compare(const M& column, sqlite3_value* value)
+{
+    if constexpr (is_optional<M>::value)
+    {
+        if (!column)
+            return std::partial_ordering::unordered;
+        return vtab_compare(*column, value);
+    }
+    else if constexpr (std::is_integral_v<M>)
+    {
+        if (sqlite3_value_type(value) == SQLITE_INTEGER)
+            return static_cast<std::int64_t>(column) <=> sqlite3_value_int64(value);
+        return static_cast<double>(column) <=> sqlite3_value_double(value);
+    }
+    else if constexpr (std::is_floating_point_v<M>)
+        return static_cast<double>(column) <=> sqlite3_value_double(value);
+    else
+    {
+        if constexpr (std::is_same_v<std::decay_t<M>, const char*>)
+        {
+            if (!column)
+                return std::partial_ordering::unordered;
+        }
+        auto text = reinterpret_cast<const char*>(sqlite3_value_text(value));
+        return std::string_view(column) <=> std::string_view(text, sqlite3_value_bytes(value));
+    }
+}
+}  // namespace detail
+
+// Exposes a contiguous array of records, such as a std::vector or a memory-mapped file, as an
+// eponymous virtual table. Columns are declared with column(); equality and range constraints are
+// evaluated inside the scan, and on columns declared sorted (and on the rowid, which is the
+// record's index) they are resolved with a binary search instead.
+template <typename Record>
+class virtual_table
+{
+public:
+    virtual_table() = default;
+
+    explicit virtual_table(std::span<const Record> records) noexcept
+        : data(records)
+    {}
+
+    // Adds a column backed by a data member. Set sorted when the records are ordered by this
+    // column (NULLs first), which enables binary search and lets SQLite skip sorting on it.
+    // Columns must be declared before the table is registered.
+    template <typename M>
+    virtual_table& column(std::string name, M Record::*member, bool sorted = false)
+    {
+        this->columns.push_back(column_def {
+            std::move(name),
+            detail::vtab_column_type<M>(),
+            sorted,
+            [member](sqlite3_context* ctx, const Record& record) { detail::vtab_column_result(ctx, record.*member); },
+            &detail::vtab_comparable<M>,
+            [member](const Record& record, sqlite3_value* value) { return detail::vtab_compare(record.*member, value); }});
+        return *this;
+    }
+
+    // Points the table at a new set of records. Must not be called while a query over the table
+    // is running.
+    void reset(std::span<const Record> records) noexcept
+    {
+        this->data = records;
+    }
+
+    std::span<const Record> records() const noexcept
+    {
+        return this->data;
+    }
+
+private:
+    friend struct detail::vtab_module<Record>;
+
+    struct column_def
+    {
+        std::string name;
+        const char* type;
+        bool sorted;
+        std::function<void(sqlite3_context*, const Record&)> result;
+        bool (*comparable)(sqlite3_value*);
+        std::function<std::partial_ordering(const Record&, sqlite3_value*)> compare;
+    };
+
+    std::vector<column_def> columns;
+    std::span<const Record> data;
+};
+
+namespace detail
+{
+template <typename Record>
+struct vtab_module
+{
+    using table_type = virtual_table<Record>;
+
+    struct vtab : sqlite3_vtab
+    {
+        table_type* table;
+    };
+
+    struct value_deleter
+    {
+        void operator()(sqlite3_value* value) const noexcept
+        {
+            sqlite3_value_free(value);
+        }
+    };
+
+    struct filter
+    {
+        int column;
+        unsigned char op;
+        std::unique_ptr<sqlite3_value, value_deleter> value;
+    };
+
+    struct cursor : sqlite3_vtab_cursor
+    {
+        std::size_t row = 0;
+        std::size_t end = 0;
+        std::vector<filter> filters;
+    };
+
+    static table_type& table_of(sqlite3_vtab_cursor* cur)
+    {
+        return *static_cast<vtab*>(cur->pVtab)->table;
+    }
+
+    static int connect(sqlite3* db, void* aux, int, const char* const*, sqlite3_vtab** out, char** error)
+    {
+        auto& table = *static_cast<table_type*>(aux);
+        std::string schema = "CREATE TABLE x(";
+        for (std::size_t i = 0; i < table.columns.size(); i++)
+        {
+            if (i)
+                schema += ", ";
+            schema += quote_identifier(table.columns[i].name);
+            schema += ' ';
+            schema += table.columns[i].type;
+        }
+        schema += ')';
+        int rc = sqlite3_declare_vtab(db, schema.c_str());
+        if (rc != SQLITE_OK)
+        {
+            *error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            return rc;
+        }
+        auto result = new (std::nothrow) vtab {};
+        if (!result)
+            return SQLITE_NOMEM;
+        result->table = &table;
+        *out = result;
+        return SQLITE_OK;
+    }
+
+    static int disconnect(sqlite3_vtab* base)
+    {
+        delete static_cast<vtab*>(base);
+        return SQLITE_OK;
+    }
+
+    static bool range_op(unsigned char op)
+    {
+        return op == SQLITE_INDEX_CONSTRAINT_GT || op == SQLITE_INDEX_CONSTRAINT_GE || op == SQLITE_INDEX_CONSTRAINT_LT ||
+               op == SQLITE_INDEX_CONSTRAINT_LE;
+    }
+
+    // Every usable equality or range constraint is passed to filter, encoded in idxStr as
+    // "column,op;" pairs. Constraints are never omitted: SQLite rechecks the rows we return, which
+    // keeps SQL's type and collation rules intact when a constraint can't be evaluated natively.
+    static int best_index(sqlite3_vtab* base, sqlite3_index_info* info)
+    {
+        auto& table = *static_cast<vtab*>(base)->table;
+        double rows = std::max<double>(static_cast<double>(table.data.size()), 1);
+        double scanned = rows;
+        double matched = rows;
+        bool unique = false;
+        std::string plan;
+        int argc = 0;
+        for (int i = 0; i < info->nConstraint; i++)
+        {
+            const auto& constraint = info->aConstraint[i];
+            bool eq = constraint.op == SQLITE_INDEX_CONSTRAINT_EQ;
+            if (!constraint.usable || (!eq && !range_op(constraint.op)))
+                continue;
+            int column = constraint.iColumn;
+            bool sorted = column < 0 || table.columns[column].sorted;
+            if (column >= 0 && std::string_view(table.columns[column].type) == "TEXT" &&
+                !iequals(sqlite3_vtab_collation(info, i), "BINARY"))
+                continue;
+
+            info->aConstraintUsage[i].argvIndex = ++argc;
+            plan += std::to_string(column) + ',' + std::to_string(constraint.op) + ';';
+            if (eq && column < 0)
+            {
+                scanned = matched = 1;
+                unique = true;
+            }
+            else if (eq && sorted)
+                scanned = matched = std::max(1.0, std::min(scanned, rows / 100));
+            else if (sorted)
+                scanned = matched = std::max(1.0, scanned / 4);
+            else
+                matched = std::max(1.0, matched / (eq ? 10 : 4));
+        }
+
+        if (info->nOrderBy == 1 && !info->aOrderBy[0].desc &&
+            (info->aOrderBy[0].iColumn < 0 || table.columns[info->aOrderBy[0].iColumn].sorted))
+            info->orderByConsumed = 1;
+
+        if (!plan.empty())
+        {
+            info->idxStr = sqlite3_mprintf("%s", plan.c_str());
+            if (!info->idxStr)
+                return SQLITE_NOMEM;
+            info->needToFreeIdxStr = 1;
+        }
+        info->estimatedCost = scanned + (scanned < rows ? std::log2(rows) : 0);
+        info->estimatedRows = static_cast<sqlite3_int64>(matched);
+        if (unique)
+            info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+        return SQLITE_OK;
+    }
+
+    static int open(sqlite3_vtab*, sqlite3_vtab_cursor** out)
+    {
+        auto result = new (std::nothrow) cursor {};
+        if (!result)
+            return SQLITE_NOMEM;
+        *out = result;
+        return SQLITE_OK;
+    }
+
+    static int close(sqlite3_vtab_cursor* cur)
+    {
+        delete static_cast<cursor*>(cur);
+        return SQLITE_OK;
+    }
+
+    static bool satisfies(std::partial_ordering order, unsigned char op)
+    {
+        switch (op)
+        {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+            return order == 0;
+        case SQLITE_INDEX_CONSTRAINT_GT:
+            return order > 0;
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            return order >= 0;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+            return order < 0;
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            return order <= 0;
+        default:
+            return true;
+        }
+    }
+
+    // Narrows [row, end) to the rows satisfying one constraint on a sorted column. NULLs sort
+    // first, so unordered rows count as less than any value.
+    template <typename Compare>
+    static void narrow(cursor& cur, unsigned char op, Compare&& compare)
+    {
+        auto first = [&](auto&& pred) {
+            std::size_t lo = cur.row, hi = cur.end;
+            while (lo < hi)
+            {
+                std::size_t mid = lo + (hi - lo) / 2;
+                if (pred(compare(mid)))
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            return lo;
+        };
+        auto greater = [](std::partial_ordering order) { return order > 0; };
+        auto not_less = [](std::partial_ordering order) { return order >= 0; };
+        switch (op)
+        {
+        case SQLITE_INDEX_CONSTRAINT_EQ: {
+            std::size_t begin = first(not_less);
+            cur.end = first(greater);
+            cur.row = begin;
+            break;
+        }
+        case SQLITE_INDEX_CONSTRAINT_GT:
+            cur.row = first(greater);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            cur.row = first(not_less);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+            cur.end = first(not_less);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            cur.end = first(greater);
+            break;
+        }
+        cur.row = std::min(cur.row, cur.end);
+    }
+
+    static bool matches(cursor& cur)
+    {
+        const auto& table = table_of(&cur);
+        const Record& record = table.data[cur.row];
+        for (const auto& f : cur.filters)
+        {
+            if (!satisfies(table.columns[f.column].compare(record, f.value.get()), f.op))
+                return false;
+        }
+        return true;
+    }
+
+    static void skip_rejected(cursor& cur)
+    {
+        while (cur.row < cur.end && !cur.filters.empty() && !matches(cur))
+            cur.row++;
+    }
+
+    static int filter_rows(sqlite3_vtab_cursor* base, int, const char* plan, int argc, sqlite3_value** argv)
+    {
+        auto& cur = *static_cast<cursor*>(base);
+        const auto& table = table_of(base);
+        cur.row = 0;
+        cur.end = table.data.size();
+        cur.filters.clear();
+        for (int i = 0; i < argc && plan; i++)
+        {
+            char* next;
+            int column = static_cast<int>(std::strtol(plan, &next, 10));
+            auto op = static_cast<unsigned char>(std::strtol(next + 1, &next, 10));
+            plan = next + 1;
+
+            sqlite3_value* value = argv[i];
+            int type = sqlite3_value_type(value);
+            if (type == SQLITE_NULL)
+            {
+                cur.row = cur.end;
+                return SQLITE_OK;
+            }
+            if (column < 0)
+            {
+                if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+                    continue;
+                narrow(cur, op, [&](std::size_t row) {
+                    if (type == SQLITE_INTEGER)
+                        return std::partial_ordering(static_cast<std::int64_t>(row) <=> sqlite3_value_int64(value));
+                    return static_cast<double>(row) <=> sqlite3_value_double(value);
+                });
+                continue;
+            }
+
+            const auto& def = table.columns[column];
+            if (!def.comparable(value))
+                continue;
+            if (def.sorted)
+                narrow(cur, op, [&](std::size_t row) { return def.compare(table.data[row], value); });
+            else
+            {
+                std::unique_ptr<sqlite3_value, value_deleter> copy(sqlite3_value_dup(value));
+                if (!copy)
+                    return SQLITE_NOMEM;
+                cur.filters.push_back(filter {column, op, std::move(copy)});
+            }
+        }
+        skip_rejected(cur);
+        return SQLITE_OK;
+    }
+
+    static int next(sqlite3_vtab_cursor* base)
+    {
+        auto& cur = *static_cast<cursor*>(base);
+        cur.row++;
+        skip_rejected(cur);
+        return SQLITE_OK;
+    }
+
+    static int eof(sqlite3_vtab_cursor* base)
+    {
+        auto& cur = *static_cast<cursor*>(base);
+        return cur.row >= cur.end;
+    }
+
+    static int column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int index)
+    {
+        auto& cur = *static_cast<cursor*>(base);
+        const auto& table = table_of(base);
+        try
+        {
+            table.columns[index].result(ctx, table.data[cur.row]);
+        }
+        catch (const std::exception& e)
+        {
+            sqlite3_result_error(ctx, e.what(), -1);
+        }
+        return SQLITE_OK;
+    }
+
+    static int rowid(sqlite3_vtab_cursor* base, sqlite3_int64* out)
+    {
+        *out = static_cast<sqlite3_int64>(static_cast<cursor*>(base)->row);
+        return SQLITE_OK;
+    }
+
+    static void destroy(void* table)
+    {
+        delete static_cast<table_type*>(table);
+    }
+
+    // Leaving xCreate unset makes the module eponymous-only: it is queried by its own name and
+    // never needs a CREATE VIRTUAL TABLE.
+    static const sqlite3_module* module()
+    {
+        static const sqlite3_module instance = []() {
+            sqlite3_module m {};
+            m.xConnect = &connect;
+            m.xBestIndex = &best_index;
+            m.xDisconnect = &disconnect;
+            m.xDestroy = &disconnect;
+            m.xOpen = &open;
+            m.xClose = &close;
+            m.xFilter = &filter_rows;
+            m.xNext = &next;
+            m.xEof = &eof;
+            m.xColumn = &column;
+            m.xRowid = &rowid;
+            return m;
+        }();
+        return &instance;
+    }
+};
+}  // namespace detail
+
+// A database image produced by sqlite3_serialize, in memory owned by SQLite's allocator so it can
+// be handed to database::deserialize without another copy.
+class serialized
+{
+public:
+    serialized() = default;
+
+    // Copies bytes into a buffer allocated by SQLite. Returns an empty image if out of memory.
+    static serialized copy_of(std::span<const std::byte> bytes)
+    {
+        serialized image;
+        image.bytes.reset(static_cast<std::byte*>(sqlite3_malloc64(bytes.size())));
+        if (image.bytes)
+        {
+            std::memcpy(image.bytes.get(), bytes.data(), bytes.size());
+            image.length = bytes.size();
+        }
+        return image;
+    }
+
+    const std::byte* data() const noexcept
+    {
+        return this->bytes.get();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return this->length;
+    }
+
+    bool empty() const noexcept
+    {
+        return this->length == 0;
+    }
+
+    operator std::span<const std::byte>() const noexcept
+    {
+        return { this->bytes.get(), this->length };
+    }
+
+private:
+    friend class database;
+
+    struct deleter
+    {
+        void operator()(std::byte* data) const noexcept
+        {
+            sqlite3_free(data);
+        }
+    };
+
+    std::unique_ptr<std::byte, deleter> bytes;
+    std::size_t length = 0;
+};
+
+namespace detail
+{
+// Multiplexes SQLite's per-connection update, commit, rollback, WAL and, when compiled in,
+// preupdate hooks, each of which holds a single callback, between any number of listeners. A C
+// hook is installed while it has at least one listener. Listeners must not be added or removed
+// from inside a hook.
+class hook_dispatcher
+{
+public:
+    using update_listener = std::function<void(int, std::string_view, std::string_view, std::int64_t)>;
+    using commit_listener = std::function<bool()>;
+    using rollback_listener = std::function<void()>;
+    using wal_listener = std::function<void(std::string_view, int)>;
+    // Receives the sqlite3_trace_v2 event and its P and X arguments.
+    using trace_listener = std::function<void(unsigned int, void*, void*)>;
+    // Receives the sqlite3_set_authorizer action code and its four string arguments.
+    using authorizer = std::function<int(int, const char*, const char*, const char*, const char*)>;
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    using preupdate_listener =
+        std::function<void(sqlite3*, int, std::string_view, std::string_view, std::int64_t, std::int64_t)>;
+#endif
+
+    explicit hook_dispatcher(sqlite3* db) noexcept
+        : db(db)
+    {}
+
+    hook_dispatcher(const hook_dispatcher&) = delete;
+    hook_dispatcher& operator=(const hook_dispatcher&) = delete;
+
+    ~hook_dispatcher()
+    {
+        sqlite3_update_hook(this->db, nullptr, nullptr);
+        sqlite3_commit_hook(this->db, nullptr, nullptr);
+        sqlite3_rollback_hook(this->db, nullptr, nullptr);
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+        if (!this->preupdates.empty())
+            sqlite3_preupdate_hook(this->db, nullptr, nullptr);
+#endif
+        if (!this->traces.empty())
+            sqlite3_trace_v2(this->db, 0, nullptr, nullptr);
+        if (this->authorize)
+            sqlite3_set_authorizer(this->db, nullptr, nullptr);
+        if (!this->wal.empty())
+            sqlite3_wal_autocheckpoint(this->db, this->autocheckpoint);
+    }
+
+    std::size_t add(update_listener listener)
+    {
+        if (this->updates.empty())
+            sqlite3_update_hook(this->db, &hook_dispatcher::on_update, this);
+        return this->updates.emplace_back(slot<update_listener> { ++this->last_id, std::move(listener) }).id;
+    }
+
+    std::size_t add(commit_listener listener)
+    {
+        if (this->commits.empty())
+            sqlite3_commit_hook(this->db, &hook_dispatcher::on_commit, this);
+        return this->commits.emplace_back(slot<commit_listener> { ++this->last_id, std::move(listener) }).id;
+    }
+
+    std::size_t add(rollback_listener listener)
+    {
+        if (this->rollbacks.empty())
+            sqlite3_rollback_hook(this->db, &hook_dispatcher::on_rollback, this);
+        return this->rollbacks.emplace_back(slot<rollback_listener> { ++this->last_id, std::move(listener) }).id;
+    }
+
+    // Installing the WAL hook replaces autocheckpoint, which SQLite implements as a WAL hook, so
+    // the dispatcher runs the same checkpoint itself; autocheckpoint frames is the current
+    // wal_autocheckpoint setting.
+    std::size_t add(wal_listener listener, int autocheckpoint)
+    {
+        if (this->wal.empty())
+        {
+            this->autocheckpoint = autocheckpoint;
+            sqlite3_wal_hook(this->db, &hook_dispatcher::on_wal, this);
+        }
+        return this->wal.emplace_back(slot<wal_listener> { ++this->last_id, std::move(listener) }).id;
+    }
+
+    // events is a mask of SQLITE_TRACE_* codes; the trace callback is installed for the union of
+    // every listener's events.
+    std::size_t add(trace_listener listener, unsigned int events)
+    {
+        auto id = this->traces.emplace_back(slot<traced> { ++this->last_id, { events, std::move(listener) } }).id;
+        this->install_trace();
+        return id;
+    }
+
+    // Replaces the connection's authorizer; an empty one removes it. There is only ever one.
+    void set_authorizer(authorizer listener)
+    {
+        this->authorize = std::move(listener);
+        this->install_authorizer();
+    }
+
+    // Reinstalls the authorizer, after something replaced it for a moment.
+    void install_authorizer() noexcept
+    {
+        if (this->authorize)
+            sqlite3_set_authorizer(this->db, &hook_dispatcher::on_authorize, this);
+        else
+            sqlite3_set_authorizer(this->db, nullptr, nullptr);
+    }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    std::size_t add(preupdate_listener listener)
+    {
+        if (this->sessions)
+            throw std::logic_error("preupdate listeners can't be installed while a session is recording");
+        if (this->preupdates.empty())
+            sqlite3_preupdate_hook(this->db, &hook_dispatcher::on_preupdate, this);
+        return this->preupdates.emplace_back(slot<preupdate_listener> { ++this->last_id, std::move(listener) }).id;
+    }
+#endif
+
+    void remove(std::size_t id)
+    {
+        if (erase(this->updates, id) && this->updates.empty())
+            sqlite3_update_hook(this->db, nullptr, nullptr);
+        if (erase(this->commits, id) && this->commits.empty())
+            sqlite3_commit_hook(this->db, nullptr, nullptr);
+        if (erase(this->rollbacks, id) && this->rollbacks.empty())
+            sqlite3_rollback_hook(this->db, nullptr, nullptr);
+        if (erase(this->wal, id) && this->wal.empty())
+            sqlite3_wal_autocheckpoint(this->db, this->autocheckpoint);
+        if (erase(this->traces, id))
+            this->install_trace();
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+        if (erase(this->preupdates, id) && this->preupdates.empty() && !this->sessions)
+            sqlite3_preupdate_hook(this->db, nullptr, nullptr);
+#endif
+    }
+
+    bool hooks_wal() const noexcept
+    {
+        return !this->wal.empty();
+    }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    bool hooks_preupdate() const noexcept
+    {
+        return !this->preupdates.empty();
+    }
+#endif
+
+    int autocheckpoint = 0;
+    authorizer authorize;
+    // The live sessions on the connection, which own its preupdate hook while there are any.
+    std::size_t sessions = 0;
+
+private:
+    template <typename L>
+    struct slot
+    {
+        std::size_t id;
+        L listener;
+    };
+
+    struct traced
+    {
+        unsigned int events;
+        trace_listener listener;
+    };
+
+    template <typename L>
+    static bool erase(std::vector<slot<L>>& slots, std::size_t id)
+    {
+        return std::erase_if(slots, [id](const slot<L>& s) { return s.id == id; }) != 0;
+    }
+
+    void install_trace() noexcept
+    {
+        unsigned int events = 0;
+        for (auto& s : this->traces)
+            events |= s.listener.events;
+        if (events)
+            sqlite3_trace_v2(this->db, events, &hook_dispatcher::on_trace, this);
+        else
+            sqlite3_trace_v2(this->db, 0, nullptr, nullptr);
+    }
+
+    static int on_trace(unsigned int event, void* context, void* p, void* x) noexcept
+    {
+        for (auto& s : static_cast<hook_dispatcher*>(context)->traces)
+        {
+            if (!(s.listener.events & event))
+                continue;
+            try
+            {
+                s.listener.listener(event, p, x);
+            }
+            catch (...)
+            {
+            }
+        }
+        return 0;
+    }
+
+    static void on_update(void* context, int op, const char* schema, const char* table, sqlite3_int64 rowid) noexcept
+    {
+        for (auto& s : static_cast<hook_dispatcher*>(context)->updates)
+        {
+            try
+            {
+                s.listener(op, schema, table, rowid);
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    // Any listener can veto the commit, which turns it into a rollback. A listener that throws
+    // vetoes it too.
+    static int on_commit(void* context) noexcept
+    {
+        bool veto = false;
+        for (auto& s : static_cast<hook_dispatcher*>(context)->commits)
+        {
+            try
+            {
+                veto = s.listener() || veto;
+            }
+            catch (...)
+            {
+                veto = true;
+            }
+        }
+        return veto;
+    }
+
+    static void on_rollback(void* context) noexcept
+    {
+        for (auto& s : static_cast<hook_dispatcher*>(context)->rollbacks)
+        {
+            try
+            {
+                s.listener();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    static int on_wal(void* context, sqlite3* db, const char* schema, int frames) noexcept
+    {
+        auto self = static_cast<hook_dispatcher*>(context);
+        for (auto& s : self->wal)
+        {
+            try
+            {
+                s.listener(schema, frames);
+            }
+            catch (...)
+            {
+            }
+        }
+        if (self->autocheckpoint > 0 && frames >= self->autocheckpoint)
+            sqlite3_wal_checkpoint(db, schema);
+        return SQLITE_OK;
+    }
+
+    // An authorizer that throws denies the action.
+    static int on_authorize(void* context, int action, const char* a, const char* b, const char* c,
+                            const char* d) noexcept
+    {
+        try
+        {
+            return static_cast<hook_dispatcher*>(context)->authorize(action, a, b, c, d);
+        }
+        catch (...)
+        {
+            return SQLITE_DENY;
+        }
+    }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    static void on_preupdate(void* context, sqlite3* db, int op, const char* schema, const char* table,
+                             sqlite3_int64 rowid, sqlite3_int64 new_rowid) noexcept
+    {
+        for (auto& s : static_cast<hook_dispatcher*>(context)->preupdates)
+        {
+            try
+            {
+                s.listener(db, op, schema, table, rowid, new_rowid);
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+#endif
+
+    sqlite3* db;
+    std::size_t last_id = 0;
+    std::vector<slot<update_listener>> updates;
+    std::vector<slot<commit_listener>> commits;
+    std::vector<slot<rollback_listener>> rollbacks;
+    std::vector<slot<wal_listener>> wal;
+    std::vector<slot<traced>> traces;
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    std::vector<slot<preupdate_listener>> preupdates;
+#endif
+};
+}  // namespace detail
+
+enum class change_kind
+{
+    insert = SQLITE_INSERT,
+    update = SQLITE_UPDATE,
+    delete_ = SQLITE_DELETE,
+};
+
+// A column value captured by the preupdate hook.
+using change_value = std::variant<std::nullptr_t, std::int64_t, double, std::string, std::vector<std::byte>>;
+
+struct changed_table
+{
+    std::string schema;
+    std::string name;
+};
+
+struct row_change
+{
+    change_kind kind;
+    // Index into change_batch::tables.
+    std::uint32_t table;
+    std::int64_t rowid;
+    // The rowid after an update; only differs from rowid when captured by the preupdate hook. Both
+    // are undefined for WITHOUT ROWID tables, which only the preupdate hook reports.
+    std::int64_t new_rowid;
+    // The row before and after the change when values are captured, and empty otherwise. An
+    // incremental blob write is reported as an update with only old_values.
+    std::vector<change_value> old_values;
+    std::vector<change_value> new_values;
+};
+
+// The rows changed by one committed transaction, in the order they were changed.
+struct change_batch
+{
+    // Increases by one for every batch the connection publishes, so a subscriber can tell how
+    // many it missed.
+    std::uint64_t sequence = 0;
+    std::vector<changed_table> tables;
+    std::vector<row_change> changes;
+
+    const changed_table& table_of(const row_change& change) const
+    {
+        return this->tables[change.table];
+    }
+};
+
+struct change_feed_options
+{
+    // The number of batches a subscriber can fall behind by; newer batches are dropped for it
+    // after that, and counted in change_subscription::dropped.
+    std::size_t capacity = 1024;
+    // Captures the old and new column values through sqlite3_preupdate_hook, which requires
+    // SQLite and this header to be compiled with SQLITE_ENABLE_PREUPDATE_HOOK.
+    bool capture_values = false;
+};
+
+namespace detail
+{
+// One subscriber's queue. The connection's thread is the only producer; any number of threads
+// can consume.
+struct change_channel
+{
+    explicit change_channel(std::size_t capacity)
+        : queue(capacity)
+    {}
+
+    mpmc_queue<std::shared_ptr<const change_batch>> queue;
+    // Counts the batches in queue, plus one once closed.
+    std::counting_semaphore<> ready { 0 };
+    std::atomic<std::uint64_t> dropped = 0;
+    std::atomic<bool> unsubscribed = false;
+    std::atomic<bool> closed = false;
+};
+
+inline change_value capture_value(sqlite3_value* value)
+{
+    switch (sqlite3_value_type(value))
+    {
+    case SQLITE_INTEGER:
+        return std::int64_t(sqlite3_value_int64(value));
+    case SQLITE_FLOAT:
+        return sqlite3_value_double(value);
+    case SQLITE_TEXT:
+    {
+        auto text = reinterpret_cast<const char*>(sqlite3_value_text(value));
+        return std::string(text, sqlite3_value_bytes(value));
+    }
+    case SQLITE_BLOB:
+    {
+        auto data = static_cast<const std::byte*>(sqlite3_value_blob(value));
+        return std::vector<std::byte>(data, data + sqlite3_value_bytes(value));
+    }
+    default:
+        return nullptr;
+    }
+}
+
+// Buffers the rows a connection changes until their transaction commits, then publishes them as
+// one batch to every subscriber. A batch is published at the end of the statement that
+// committed, once no write transaction is open, so a commit that is vetoed, fails or is retried after
+// SQLITE_BUSY publishes nothing. Rollbacks to a savepoint of database::atomic drop the rows
+// changed since the savepoint; rows of a statement that fails inside an explicit transaction, or
+// that a ROLLBACK TO issued as SQL undid, are still reported.
+class change_feed
+{
+public:
+    change_feed() = default;
+
+    change_feed(const change_feed&) = delete;
+    change_feed& operator=(const change_feed&) = delete;
+
+    ~change_feed()
+    {
+        for (auto& channel : this->channels)
+        {
+            channel->closed.store(true, std::memory_order_release);
+            channel->ready.release();
+        }
+    }
+
+    std::shared_ptr<change_channel> subscribe(const change_feed_options& options)
+    {
+        auto channel = std::make_shared<change_channel>(options.capacity);
+        std::erase_if(this->channels, [](const auto& c) { return c->unsubscribed.load(std::memory_order_acquire); });
+        this->channels.push_back(channel);
+        return channel;
+    }
+
+    void changed(int op, const std::string_view schema, const std::string_view table, std::int64_t rowid,
+                 std::int64_t new_rowid)
+    {
+        this->pending.changes.push_back({ change_kind(op), this->intern(schema, table), rowid, new_rowid, {}, {} });
+    }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    void preupdate(sqlite3* db, int op, const std::string_view schema, const std::string_view table,
+                   std::int64_t rowid, std::int64_t new_rowid)
+    {
+        int columns = sqlite3_preupdate_count(db);
+        bool blob_write = op == SQLITE_DELETE && sqlite3_preupdate_blobwrite(db) >= 0;
+        this->changed(blob_write ? SQLITE_UPDATE : op, schema, table, rowid, blob_write ? rowid : new_rowid);
+        auto& change = this->pending.changes.back();
+        sqlite3_value* value = nullptr;
+        if (op != SQLITE_INSERT)
+        {
+            change.old_values.reserve(columns);
+            for (int i = 0; i < columns; i++)
+                change.old_values.push_back(
+                    sqlite3_preupdate_old(db, i, &value) == SQLITE_OK ? capture_value(value) : nullptr);
+        }
+        if (op != SQLITE_DELETE)
+        {
+            change.new_values.reserve(columns);
+            for (int i = 0; i < columns; i++)
+                change.new_values.push_back(
+                    sqlite3_preupdate_new(db, i, &value) == SQLITE_OK ? capture_value(value) : nullptr);
+        }
+    }
+#endif
+
+    // Called at the end of every statement; a commit is durable by then. Other statements can
+    // still hold a read transaction open.
+    void statement_finished(sqlite3* db)
+    {
+        if (!this->pending.changes.empty() && sqlite3_txn_state(db, nullptr) != SQLITE_TXN_WRITE)
+            this->publish(this->pending);
+    }
+
+    void rolled_back() noexcept
+    {
+        clear(this->pending);
+    }
+
+    // The position to drop changes back to if the savepoint opened now is rolled back.
+    std::size_t mark() const noexcept
+    {
+        return this->pending.changes.size();
+    }
+
+    void rolled_back_to(std::size_t mark) noexcept
+    {
+        if (mark < this->pending.changes.size())
+            this->pending.changes.erase(this->pending.changes.begin() + mark, this->pending.changes.end());
+    }
+
+    bool capturing_values() const noexcept
+    {
+        return this->values_hook != 0;
+    }
+
+    std::array<std::size_t, 3> hooks {};
+    std::size_t values_hook = 0;
+
+private:
+    static void clear(change_batch& batch) noexcept
+    {
+        batch.tables.clear();
+        batch.changes.clear();
+    }
+
+    std::uint32_t intern(const std::string_view schema, const std::string_view table)
+    {
+        auto& tables = this->pending.tables;
+        if (this->last_table < tables.size() && tables[this->last_table].name == table &&
+            tables[this->last_table].schema == schema)
+            return this->last_table;
+        auto it = std::find_if(tables.begin(), tables.end(),
+                               [&](const changed_table& t) { return t.name == table && t.schema == schema; });
+        if (it == tables.end())
+            it = tables.insert(tables.end(), changed_table { std::string(schema), std::string(table) });
+        return this->last_table = static_cast<std::uint32_t>(it - tables.begin());
+    }
+
+    void publish(change_batch& batch)
+    {
+        if (batch.changes.empty())
+            return;
+        std::erase_if(this->channels, [](const auto& c) { return c->unsubscribed.load(std::memory_order_acquire); });
+        auto capacity = batch.changes.size();
+        auto published = std::make_shared<change_batch>(std::move(batch));
+        published->sequence = ++this->sequence;
+        clear(batch);
+        batch.changes.reserve(capacity);
+        this->last_table = 0;
+        std::shared_ptr<const change_batch> shared = std::move(published);
+        for (auto& channel : this->channels)
+        {
+            if (channel->queue.try_push(shared))
+                channel->ready.release();
+            else
+                channel->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    change_batch pending;
+    std::uint32_t last_table = 0;
+    std::uint64_t sequence = 0;
+    std::vector<std::shared_ptr<change_channel>> channels;
+};
+}  // namespace detail
+
+// A subscriber's end of database::subscribe_changes. Batches are shared between subscribers and
+// immutable. The pop functions can be called from any number of threads, each batch going to one
+// of them; subscribe again for another independent consumer. A subscription can outlive its
+// database: once the database is closed, pop returns the remaining batches and then null.
+class change_subscription
+{
+public:
+    change_subscription() = default;
+    change_subscription(change_subscription&&) noexcept = default;
+    change_subscription& operator=(change_subscription&& other) noexcept
+    {
+        this->unsubscribe();
+        this->channel = std::move(other.channel);
+        return *this;
+    }
+
+    ~change_subscription()
+    {
+        this->unsubscribe();
+    }
+
+    std::shared_ptr<const change_batch> try_pop()
+    {
+        if (!this->channel->ready.try_acquire())
+            return nullptr;
+        return this->take();
+    }
+
+    // Waits for the next batch. Returns null once the database is closed and every batch taken.
+    std::shared_ptr<const change_batch> pop()
+    {
+        this->channel->ready.acquire();
+        return this->take();
+    }
+
+    template <typename Rep, typename Period>
+    std::shared_ptr<const change_batch> pop_for(const std::chrono::duration<Rep, Period>& timeout)
+    {
+        if (!this->channel->ready.try_acquire_for(timeout))
+            return nullptr;
+        return this->take();
+    }
+
+    // The number of batches dropped because this subscriber fell more than its capacity behind.
+    std::uint64_t dropped() const noexcept
+    {
+        return this->channel->dropped.load(std::memory_order_relaxed);
+    }
+
+    bool closed() const noexcept
+    {
+        return this->channel->closed.load(std::memory_order_acquire);
+    }
+
+private:
+    friend class database;
+
+    explicit change_subscription(std::shared_ptr<detail::change_channel> channel) noexcept
+        : channel(std::move(channel))
+    {}
+
+    void unsubscribe() noexcept
+    {
+        if (this->channel)
+            this->channel->unsubscribed.store(true, std::memory_order_release);
+    }
+
+    std::shared_ptr<const change_batch> take()
+    {
+        std::shared_ptr<const change_batch> batch;
+        if (this->channel->queue.try_pop(batch))
+            return batch;
+        // The token was the one released on close; pass it on to the next waiting consumer.
+        this->channel->ready.release();
+        return nullptr;
+    }
+
+    std::shared_ptr<detail::change_channel> channel;
+};
+
+#if defined(SQLITE_ENABLE_SESSION)
+// A changeset or patchset produced by the session extension, in memory owned by SQLite's
+// allocator. Received bytes can be applied directly with database::apply_changeset; copy_of is
+// only needed to invert or concatenate them.
+class changeset
+{
+public:
+    changeset() = default;
+
+    // Copies bytes into a buffer allocated by SQLite. Returns an empty changeset if out of memory.
+    static changeset copy_of(std::span<const std::byte> bytes)
+    {
+        changeset result;
+        result.bytes.reset(static_cast<std::byte*>(sqlite3_malloc64(bytes.size())));
+        if (result.bytes)
+        {
+            std::memcpy(result.bytes.get(), bytes.data(), bytes.size());
+            result.length = bytes.size();
+        }
+        return result;
+    }
+
+    // The changeset that undoes this one. Patchsets can't be inverted.
+    changeset inverted() const
+    {
+        changeset result;
+        int size = 0;
+        void* data = nullptr;
+        if (int error = sqlite3changeset_invert(static_cast<int>(this->length), this->bytes.get(), &size, &data))
+            throw sqlite::error(error, sqlite3_errstr(error));
+        result.adopt(data, size);
+        return result;
+    }
+
+    // Combines two changesets into one with the same effect as applying first, then second.
+    static changeset concat(std::span<const std::byte> first, std::span<const std::byte> second)
+    {
+        changeset result;
+        int size = 0;
+        void* data = nullptr;
+        if (int error = sqlite3changeset_concat(static_cast<int>(first.size()), const_cast<std::byte*>(first.data()),
+                                                static_cast<int>(second.size()), const_cast<std::byte*>(second.data()),
+                                                &size, &data))
+            throw sqlite::error(error, sqlite3_errstr(error));
+        result.adopt(data, size);
+        return result;
+    }
+
+    const std::byte* data() const noexcept
+    {
+        return this->bytes.get();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return this->length;
+    }
+
+    bool empty() const noexcept
+    {
+        return this->length == 0;
+    }
+
+    operator std::span<const std::byte>() const noexcept
+    {
+        return { this->bytes.get(), this->length };
+    }
+
+private:
+    friend class session;
+
+    struct deleter
+    {
+        void operator()(std::byte* data) const noexcept
+        {
+            sqlite3_free(data);
+        }
+    };
+
+    void adopt(void* data, int size) noexcept
+    {
+        this->bytes.reset(static_cast<std::byte*>(data));
+        this->length = static_cast<std::size_t>(size);
+    }
+
+    std::unique_ptr<std::byte, deleter> bytes;
+    std::size_t length = 0;
+};
+
+// Records the changes made through a connection to the attached tables, from which it produces a
+// changeset: for every changed row, its primary key and old and new values. A patchset is the
+// more compact form, keeping only the primary key of deleted rows and the new values of updates.
+// Only tables with a declared primary key are recorded. A session installs its own preupdate
+// hook, so it can't be used alongside database::on_preupdate or subscribe_changes capturing
+// values: whichever is used second throws std::logic_error.
+class session
+{
+public:
+    explicit session(database& db, const char* schema = "main");
+
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+
+    session(session&& other) noexcept
+        : sess(std::exchange(other.sess, nullptr))
+        , hooks(std::exchange(other.hooks, nullptr))
+    {}
+
+    session& operator=(session&& other) noexcept
+    {
+        std::swap(this->sess, other.sess);
+        std::swap(this->hooks, other.hooks);
+        return *this;
+    }
+
+    ~session()
+    {
+        if (this->sess)
+        {
+            sqlite3session_delete(this->sess);
+            this->hooks->sessions--;
+        }
+    }
+
+    // Starts recording changes to the table, or to every table if table is null.
+    void attach(const char* table = nullptr)
+    {
+        if (int error = sqlite3session_attach(this->sess, table))
+            throw sqlite::error(error, sqlite3_errstr(error));
+    }
+
+    // Pauses or resumes recording.
+    void enable(bool enabled) noexcept
+    {
+        sqlite3session_enable(this->sess, enabled);
+    }
+
+    // Marks the changes recorded from now on as indirect, as changes made by triggers and foreign
+    // key actions are, so conflict handlers can tell them apart.
+    void set_indirect(bool indirect) noexcept
+    {
+        sqlite3session_indirect(this->sess, indirect);
+    }
+
+    bool empty() const noexcept
+    {
+        return sqlite3session_isempty(this->sess);
+    }
+
+    sqlite::changeset changeset() const
+    {
+        return this->collect(&sqlite3session_changeset);
+    }
+
+    sqlite::changeset patchset() const
+    {
+        return this->collect(&sqlite3session_patchset);
+    }
+
+    // Writes the changeset through the streaming interface, which never holds all of it in memory.
+    void write_changeset(std::ostream& out) const
+    {
+        this->write(&sqlite3session_changeset_strm, out);
+    }
+
+    void write_patchset(std::ostream& out) const
+    {
+        this->write(&sqlite3session_patchset_strm, out);
+    }
+
+    sqlite3_session* handle() const noexcept
+    {
+        return this->sess;
+    }
+
+private:
+    sqlite::changeset collect(int (*produce)(sqlite3_session*, int*, void**)) const
+    {
+        sqlite::changeset result;
+        int size = 0;
+        void* data = nullptr;
+        if (int error = produce(this->sess, &size, &data))
+            throw sqlite::error(error, sqlite3_errstr(error));
+        result.adopt(data, size);
+        return result;
+    }
+
+    void write(int (*produce)(sqlite3_session*, int (*)(void*, const void*, int), void*), std::ostream& out) const
+    {
+        auto output = [](void* context, const void* data, int size) {
+            auto& stream = *static_cast<std::ostream*>(context);
+            stream.write(static_cast<const char*>(data), size);
+            return stream ? SQLITE_OK : SQLITE_IOERR;
+        };
+        if (int error = produce(this->sess, output, &out))
+            throw sqlite::error(error, sqlite3_errstr(error));
+    }
+
+    sqlite3_session* sess = nullptr;
+    // The connection's dispatcher, which refuses preupdate listeners while sessions are recording.
+    detail::hook_dispatcher* hooks = nullptr;
+};
+
+enum class conflict_kind
+{
+    // The row exists but its values differ from the change's old values.
+    data = SQLITE_CHANGESET_DATA,
+    // The row to update or delete does not exist.
+    not_found = SQLITE_CHANGESET_NOTFOUND,
+    // Inserting the row would duplicate a primary key.
+    conflict = SQLITE_CHANGESET_CONFLICT,
+    // The change violates another constraint.
+    constraint = SQLITE_CHANGESET_CONSTRAINT,
+    // Applying the changeset left foreign key violations; reported once, at the end.
+    foreign_key = SQLITE_CHANGESET_FOREIGN_KEY,
+};
+
+enum class conflict_action
+{
+    omit = SQLITE_CHANGESET_OMIT,
+    // Only meaningful for data and conflict; for the other kinds it is the same as omit.
+    replace = SQLITE_CHANGESET_REPLACE,
+    abort = SQLITE_CHANGESET_ABORT,
+};
+
+// The change being applied when a conflict handler is called, valid only during the call.
+class changeset_conflict
+{
+public:
+    changeset_conflict(sqlite3_changeset_iter* iter, conflict_kind kind) noexcept
+        : iter(iter)
+        , conflict(kind)
+    {
+        sqlite3changeset_op(iter, &this->table_name, &this->columns, &this->op, &this->indirect_change);
+    }
+
+    conflict_kind kind() const noexcept
+    {
+        return this->conflict;
+    }
+
+    change_kind operation() const noexcept
+    {
+        return change_kind(this->op);
+    }
+
+    std::string_view table() const noexcept
+    {
+        return this->table_name;
+    }
+
+    int column_count() const noexcept
+    {
+        return this->columns;
+    }
+
+    bool indirect() const noexcept
+    {
+        return this->indirect_change;
+    }
+
+    // The column's value before the change, for updates and deletes.
+    change_value old_value(int column) const
+    {
+        return this->value(&sqlite3changeset_old, column);
+    }
+
+    // The column's value after the change, for inserts and updates; null if an update left it as
+    // it was.
+    change_value new_value(int column) const
+    {
+        return this->value(&sqlite3changeset_new, column);
+    }
+
+    // The value in the target database's conflicting row, for data and conflict.
+    change_value current_value(int column) const
+    {
+        return this->value(&sqlite3changeset_conflict, column);
+    }
+
+private:
+    change_value value(int (*read)(sqlite3_changeset_iter*, int, sqlite3_value**), int column) const
+    {
+        sqlite3_value* value = nullptr;
+        if (read(this->iter, column, &value) != SQLITE_OK || !value)
+            return nullptr;
+        return detail::capture_value(value);
+    }
+
+    sqlite3_changeset_iter* iter;
+    conflict_kind conflict;
+    const char* table_name = nullptr;
+    int columns = 0;
+    int op = 0;
+    int indirect_change = 0;
+};
+
+struct changeset_apply_options
+{
+    // Applies only changes to tables for which this returns true; all tables if empty.
+    std::function<bool(std::string_view)> tables;
+    // Applies the inverse of the changeset.
+    bool invert = false;
+    // Skips the savepoint that otherwise makes applying the changeset atomic.
+    bool no_savepoint = false;
+};
+
+namespace detail
+{
+template <typename F>
+struct changeset_apply_context
+{
+    F& handler;
+    const changeset_apply_options& options;
+    std::exception_ptr error;
+
+    static int filter(void* context, const char* table) noexcept
+    {
+        auto self = static_cast<changeset_apply_context*>(context);
+        try
+        {
+            return self->options.tables(table);
+        }
+        catch (...)
+        {
+            self->error = std::current_exception();
+            return 0;
+        }
+    }
+
+    static int conflict(void* context, int kind, sqlite3_changeset_iter* iter) noexcept
+    {
+        auto self = static_cast<changeset_apply_context*>(context);
+        if (self->error)
+            return SQLITE_CHANGESET_ABORT;
+        try
+        {
+            auto action = self->handler(changeset_conflict(iter, conflict_kind(kind)));
+            if (action == conflict_action::replace && kind != SQLITE_CHANGESET_DATA && kind != SQLITE_CHANGESET_CONFLICT)
+                return SQLITE_CHANGESET_OMIT;
+            return static_cast<int>(action);
+        }
+        catch (...)
+        {
+            self->error = std::current_exception();
+            return SQLITE_CHANGESET_ABORT;
+        }
+    }
+
+    int flags() const noexcept
+    {
+        return (this->options.invert ? SQLITE_CHANGESETAPPLY_INVERT : 0) |
+               (this->options.no_savepoint ? SQLITE_CHANGESETAPPLY_NOSAVEPOINT : 0);
+    }
+};
+}  // namespace detail
+#endif
+
+// Aggregated measurements of every execution of statements sharing the same normalized SQL.
+struct statement_profile
+{
+    std::string sql;
+    std::uint64_t executions = 0;
+    // Wall-clock time from the first step of an execution until it finished or was reset.
+    std::chrono::nanoseconds total_time {};
+    std::chrono::nanoseconds max_time {};
+    // The time reported by SQLite's own profile callback, which has millisecond granularity on
+    // most VFSes.
+    std::chrono::nanoseconds sqlite_time {};
+    statement_status status;
+};
+
+// Page cache counters from sqlite3_db_status.
+struct database_status
+{
+    std::int64_t cache_hits = 0;
+    std::int64_t cache_misses = 0;
+    std::int64_t cache_writes = 0;
+    std::int64_t cache_spills = 0;
+    std::int64_t cache_used = 0;
+};
+
+namespace detail
+{
+inline void append_escaped(std::string& out, const std::string_view text, bool json)
+{
+    for (char c : text)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        default:
+            if (json && static_cast<unsigned char>(c) < 0x20)
+            {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            }
+            else
+                out += c;
+        }
+    }
+}
+
+// Replaces literals with ? and collapses whitespace, so statements that differ only in inlined
+// values are aggregated together. Quoted identifiers are kept as they are.
+inline std::string normalize_sql(const std::string_view sql)
+{
+    std::string out;
+    out.reserve(sql.size());
+    std::size_t i = 0;
+    auto skip_quoted = [&](char close) {
+        for (i++; i < sql.size(); i++)
+        {
+            if (sql[i] == close)
+            {
+                if (close != ']' && i + 1 < sql.size() && sql[i + 1] == close)
+                    i++;
+                else
+                    break;
+            }
+        }
+        i++;
+    };
+    while (i < sql.size())
+    {
+        char c = sql[i];
+        bool after_word = !out.empty() && is_word_char(out.back());
+        if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            while (i < sql.size() && std::isspace(static_cast<unsigned char>(sql[i])))
+                i++;
+            if (!out.empty() && i < sql.size())
+                out += ' ';
+        }
+        else if (c == '\'')
+        {
+            skip_quoted('\'');
+            out += '?';
+        }
+        else if ((c == 'x' || c == 'X') && !after_word && i + 1 < sql.size() && sql[i + 1] == '\'')
+        {
+            i++;
+            skip_quoted('\'');
+            out += '?';
+        }
+        else if (c == '"' || c == '`' || c == '[')
+        {
+            std::size_t begin = i;
+            skip_quoted(c == '[' ? ']' : c);
+            out.append(sql.substr(begin, i - begin));
+        }
+        else if (!after_word &&
+                 (std::isdigit(static_cast<unsigned char>(c)) ||
+                  (c == '.' && i + 1 < sql.size() && std::isdigit(static_cast<unsigned char>(sql[i + 1])))))
+        {
+            while (i < sql.size() && (is_word_char(sql[i]) || sql[i] == '.' ||
+                                      ((sql[i] == '+' || sql[i] == '-') && (sql[i - 1] == 'e' || sql[i - 1] == 'E'))))
+                i++;
+            out += '?';
+        }
+        else
+        {
+            out += c;
+            i++;
+        }
+    }
+    return out;
+}
+
+// Collects statement_profiles from sqlite3_trace_v2 events. SQLITE_TRACE_STMT marks the start of
+// an execution and SQLITE_TRACE_PROFILE its end, at which point the statement's counters are
+// read and reset so each execution contributes only its own work.
+class profiler
+{
+public:
+    static int trace(unsigned int event, void* context, void* p, void* x) noexcept
+    {
+        auto self = static_cast<profiler*>(context);
+        auto stmt = static_cast<sqlite3_stmt*>(p);
+        try
+        {
+            if (event == SQLITE_TRACE_STMT)
+                self->started(stmt);
+            else if (event == SQLITE_TRACE_PROFILE)
+                self->finished(stmt, std::chrono::nanoseconds(*static_cast<sqlite3_int64*>(x)));
+        }
+        catch (...)
+        {
+        }
+        return 0;
+    }
+
+    std::vector<statement_profile> snapshot() const
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        std::vector<statement_profile> result;
+        result.reserve(this->profiles.size());
+        for (const auto& [sql, profile] : this->profiles)
+            result.push_back(profile);
+        return result;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->profiles.clear();
+        this->normalized.clear();
+    }
+
+    // The database's hook_dispatcher id of the trace listener feeding this profiler.
+    std::size_t hook = 0;
+
+private:
+    void started(sqlite3_stmt* stmt)
+    {
+        // Triggers report TRACE_STMT again for the same statement; keep the first start.
+        this->running.try_emplace(stmt, std::chrono::steady_clock::now());
+    }
+
+    void finished(sqlite3_stmt* stmt, std::chrono::nanoseconds sqlite_time)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = sqlite_time;
+        if (auto it = this->running.find(stmt); it != this->running.end())
+        {
+            elapsed = now - it->second;
+            this->running.erase(it);
+        }
+        auto status = statement_status::of(stmt, true);
+
+        auto sql = sqlite3_sql(stmt);
+        std::lock_guard<std::mutex> guard(this->mutex);
+        auto key = this->normalized.find(sql);
+        if (key == this->normalized.end())
+        {
+            // Statements built from literals can each have different SQL; start over rather than
+            // grow without bound.
+            if (this->normalized.size() >= max_normalized)
+                this->normalized.clear();
+            key = this->normalized.emplace(sql, normalize_sql(sql)).first;
+        }
+        auto& profile = this->profiles[key->second];
+        if (profile.sql.empty())
+            profile.sql = key->second;
+        profile.executions++;
+        profile.total_time += elapsed;
+        profile.max_time = std::max(profile.max_time, elapsed);
+        profile.sqlite_time += sqlite_time;
+        profile.status += status;
+    }
+
+    static constexpr std::size_t max_normalized = 1024;
+
+    // Only touched from the connection's own thread.
+    std::unordered_map<sqlite3_stmt*, std::chrono::steady_clock::time_point> running;
+
+    // Guards normalized and profiles, which may be reset or read from another thread.
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::string> normalized;
+    std::unordered_map<std::string, statement_profile> profiles;
+};
+}  // namespace detail
+
+// A point-in-time copy of a database's profile.
+struct profile_snapshot
+{
+    std::vector<statement_profile> statements;
+    database_status status;
+
+    std::string to_json() const
+    {
+        std::string out = "{\"status\":{";
+        out += "\"cache_hits\":" + std::to_string(this->status.cache_hits);
+        out += ",\"cache_misses\":" + std::to_string(this->status.cache_misses);
+        out += ",\"cache_writes\":" + std::to_string(this->status.cache_writes);
+        out += ",\"cache_spills\":" + std::to_string(this->status.cache_spills);
+        out += ",\"cache_used\":" + std::to_string(this->status.cache_used);
+        out += "},\"statements\":[";
+        for (std::size_t i = 0; i < this->statements.size(); i++)
+        {
+            const auto& profile = this->statements[i];
+            out += i ? ",{\"sql\":\"" : "{\"sql\":\"";
+            detail::append_escaped(out, profile.sql, true);
+            out += "\",\"executions\":" + std::to_string(profile.executions);
+            out += ",\"total_ns\":" + std::to_string(profile.total_time.count());
+            out += ",\"max_ns\":" + std::to_string(profile.max_time.count());
+            out += ",\"sqlite_ns\":" + std::to_string(profile.sqlite_time.count());
+            out += ",\"fullscan_steps\":" + std::to_string(profile.status.fullscan_steps);
+            out += ",\"sorts\":" + std::to_string(profile.status.sorts);
+            out += ",\"autoindexes\":" + std::to_string(profile.status.autoindexes);
+            out += ",\"vm_steps\":" + std::to_string(profile.status.vm_steps);
+            out += ",\"reprepares\":" + std::to_string(profile.status.reprepares);
+            out += '}';
+        }
+        out += "]}";
+        return out;
+    }
+
+    // Formats the snapshot in the Prometheus text exposition format, with one series per
+    // statement labelled by its normalized SQL.
+    std::string to_prometheus(const std::string_view prefix = "sqlite") const
+    {
+        std::string out;
+        auto header = [&](const char* name, const char* type) {
+            out.append("# TYPE ").append(prefix).append("_").append(name).append(" ").append(type).append("\n");
+        };
+        auto metric = [&](const char* name, const char* type, std::int64_t value) {
+            header(name, type);
+            out.append(prefix).append("_").append(name).append(" ").append(std::to_string(value)).append("\n");
+        };
+        metric("cache_hits_total", "counter", this->status.cache_hits);
+        metric("cache_misses_total", "counter", this->status.cache_misses);
+        metric("cache_writes_total", "counter", this->status.cache_writes);
+        metric("cache_spills_total", "counter", this->status.cache_spills);
+        metric("cache_used_bytes", "gauge", this->status.cache_used);
+
+        auto series = [&](const char* name, const char* type, auto value) {
+            header(name, type);
+            for (const auto& profile : this->statements)
+            {
+                out.append(prefix).append("_").append(name).append("{sql=\"");
+                detail::append_escaped(out, profile.sql, false);
+                out.append("\"} ").append(std::to_string(value(profile))).append("\n");
+            }
+        };
+        using profile = statement_profile;
+        series("statement_executions_total", "counter", [](const profile& p) { return p.executions; });
+        series("statement_seconds_total", "counter", [](const profile& p) { return std::chrono::duration<double>(p.total_time).count(); });
+        series("statement_max_seconds", "gauge", [](const profile& p) { return std::chrono::duration<double>(p.max_time).count(); });
+        series("statement_fullscan_steps_total", "counter", [](const profile& p) { return p.status.fullscan_steps; });
+        series("statement_sorts_total", "counter", [](const profile& p) { return p.status.sorts; });
+        series("statement_autoindexes_total", "counter", [](const profile& p) { return p.status.autoindexes; });
+        series("statement_vm_steps_total", "counter", [](const profile& p) { return p.status.vm_steps; });
+        series("statement_reprepares_total", "counter", [](const profile& p) { return p.status.reprepares; });
+        return out;
     }
-
-private:
-    sqlite3_stmt* stmt;
 };
 
 class database
 {
 public:
-    database() = delete;
-    database(const std::string_view filename, openflags flags = openflags::readwrite | openflags::create)
+    database() = delete;
+    database(const std::string_view filename, openflags flags = openflags::readwrite | openflags::create,
+             const char* vfs = nullptr)
+        : cache(std::make_unique<statement_cache>(default_cache_capacity))
+    {
+        if (int error = sqlite3_open_v2(filename.data(), &this->db, static_cast<int>(flags), vfs))
+        {
+            // The handle carries the error message, so it is closed only once the exception holds
+            // a copy.
+            try
+            {
+                detail::throw_error(this->db, error);
+            }
+            catch (...)
+            {
+                sqlite3_close(this->db);
+                throw;
+            }
+        }
+    }
+
+    database(const std::string_view filename, const database_options& options)
+        : database(filename, options.flags, options.vfs_name())
+    {
+        this->configure(options);
+    }
+
+    database(const database&) = delete;
+
+    database(database&& other) noexcept
+        : db(other.db)
+        , cache(std::move(other.cache))
+        , savepoints(std::move(other.savepoints))
+        , begin_statements(std::move(other.begin_statements))
+        , commit_statement(std::move(other.commit_statement))
+        , rollback_statement(std::move(other.rollback_statement))
+        , query_statements(std::move(other.query_statements))
+        , savepoint_depth(other.savepoint_depth)
+        , profiler(std::move(other.profiler))
+        , mapped(std::move(other.mapped))
+        , busy(std::move(other.busy))
+        , hooks(std::move(other.hooks))
+        , feed(std::move(other.feed))
+    {
+        other.db = nullptr;
+        other.savepoint_depth = 0;
+    }
+
+    ~database()
+    {
+        this->query_statements.clear();
+        this->savepoints.clear();
+        this->begin_statements = {};
+        this->commit_statement = statement();
+        this->rollback_statement = statement();
+        this->cache.reset();
+        this->hooks.reset();
+        this->feed.reset();
+        sqlite3_close_v2(this->db);
+    }
+
+    database& operator=(const database&) = delete;
+
+    statement prepare(const std::string_view sql) const
+    {
+        return statement(this->db, sql);
+    }
+
+    // Like prepare, but waits with sqlite3_unlock_notify when reading the schema fails with
+    // SQLITE_LOCKED_SHAREDCACHE. See statement::blocking_step.
+    statement blocking_prepare(const std::string_view sql) const
+    {
+        for (;;)
+        {
+            try
+            {
+                return this->prepare(sql);
+            }
+            catch (const locked_error& e)
+            {
+                if (e.extended_code() != SQLITE_LOCKED_SHAREDCACHE || !detail::wait_for_unlock(this->db))
+                    throw;
+            }
+        }
+    }
+
+    // Retries statements that hit SQLITE_BUSY with exponential backoff and jitter. This replaces
+    // any busy timeout, which is itself implemented as a busy handler.
+    void set_busy_backoff(const busy_backoff& policy)
+    {
+        auto handler = std::make_unique<detail::busy_handler>(policy);
+        if (int error = sqlite3_busy_handler(this->db, &detail::busy_handler::callback, handler.get()))
+            detail::throw_error(this->db, error);
+        this->busy = std::move(handler);
+    }
+
+    // Removes the busy handler or busy timeout, so that SQLITE_BUSY is reported immediately.
+    void clear_busy_handler() noexcept
+    {
+        sqlite3_busy_handler(this->db, nullptr, nullptr);
+        this->busy.reset();
+    }
+
+    template <typename... Args>
+    statement execute(const std::string_view sql, Args&&... args) const
+    {
+        statement stmt = this->prepare(sql);
+        stmt.reset();
+        stmt.bind_multiple(std::forward<Args>(args)...);
+        return stmt;
+    }
+
+    // Like prepare, but leases the statement from the connection's statement cache. The statement
+    // is reset and its bindings cleared when it is returned, so it must not outlive the database.
+    statement prepare_cached(const std::string_view sql) const
+    {
+        if (auto lease = this->cache->acquire(this->db, sql))
+            return statement(lease);
+        return this->prepare(sql);
+    }
+
+    template <typename... Args>
+    statement execute_cached(const std::string_view sql, Args&&... args) const
+    {
+        statement stmt = this->prepare_cached(sql);
+        stmt.bind_multiple(std::forward<Args>(args)...);
+        return stmt;
+    }
+
+    void set_statement_cache_capacity(std::size_t capacity)
+    {
+        this->cache->set_capacity(capacity);
+    }
+
+    void clear_statement_cache() noexcept
+    {
+        this->cache->clear();
+    }
+
+    cache_stats statement_cache_stats() const noexcept
+    {
+        return this->cache->stats();
+    }
+
+    // Executes the statement once for every tuple in rows, all inside a single savepoint. rows must
+    // be a forward range when mode is bulk_insert::multi_row_values. Text and blobs are bound
+    // without copying, so a range that yields its tuples by value, such as a transform view, is
+    // always inserted per row, each tuple kept alive until its row is stepped. Returns the number of
+    // rows.
+    template <typename Rows>
+    std::size_t execute_many(const std::string_view sql, const Rows& rows, bulk_insert mode = bulk_insert::per_row)
+    {
+        std::size_t count = 0;
+        this->atomic([&]() {
+            statement stmt = this->prepare_cached(sql);
+            auto it = std::begin(rows);
+            auto end = std::end(rows);
+
+            std::optional<detail::values_row> values;
+            if (mode == bulk_insert::multi_row_values)
+                values = detail::find_values_row(sql);
+
+            // A multi-row chunk binds several rows before stepping, so they must all stay alive.
+            constexpr bool lasting_rows = std::is_lvalue_reference_v<std::ranges::range_reference_t<const Rows>>;
+            int parameters = sqlite3_bind_parameter_count(stmt.handle());
+            if (lasting_rows && values && values->parameters == parameters && parameters > 0)
+            {
+                auto limit = static_cast<std::size_t>(sqlite3_limit(this->db, SQLITE_LIMIT_VARIABLE_NUMBER, -1));
+                auto chunk_rows = std::min(limit / parameters, max_rows_per_insert);
+                if (chunk_rows > 1)
+                {
+                    statement chunk = this->prepare_cached(detail::repeat_values_row(sql, *values, chunk_rows));
+                    auto chunk_begin = it;
+                    std::size_t pending = 0;
+                    for (; it != end; ++it)
+                    {
+                        this->bind_row(chunk, pending * parameters, *it);
+                        if (++pending == chunk_rows)
+                        {
+                            chunk.step();
+                            chunk.reset();
+                            count += pending;
+                            pending = 0;
+                            chunk_begin = std::next(it);
+                        }
+                    }
+                    it = chunk_begin;
+                }
+            }
+
+            for (; it != end; ++it)
+            {
+                auto&& row = *it;
+                this->bind_row(stmt, 0, row);
+                stmt.step();
+                stmt.reset();
+                count++;
+            }
+        });
+        return count;
+    }
+
+    // Registers func as a scalar SQL function. The number and types of the arguments are deduced
+    // from func, decoded with value_loader<T>, and its return value is set with result<T>.
+    template <typename F>
+    void create_function(const std::string_view name, F&& func, function_flags flags = function_flags::none)
+    {
+        using function = detail::scalar_function<std::decay_t<F>>;
+        auto user_data = new std::decay_t<F>(std::forward<F>(func));
+        int error = sqlite3_create_function_v2(this->db, std::string(name).c_str(), function::arity,
+                                               SQLITE_UTF8 | static_cast<int>(flags), user_data, &function::call, nullptr,
+                                               nullptr, &function::destroy);
+        if (error)
+            detail::throw_error(this->db, error);
+    }
+
+    // Registers an aggregate function implemented by A, which must have a step(Args...) member
+    // called for every row of a group and a finalize() member returning the result.
+    template <typename A>
+    void create_aggregate(const std::string_view name, function_flags flags = function_flags::none)
+    {
+        using function = detail::aggregate_function<A>;
+        int error = sqlite3_create_function_v2(this->db, std::string(name).c_str(), function::arity,
+                                               SQLITE_UTF8 | static_cast<int>(flags), nullptr, nullptr, &function::step,
+                                               &function::finalize, nullptr);
+        if (error)
+            detail::throw_error(this->db, error);
+    }
+
+    // Registers an aggregate window function implemented by A, which additionally needs an
+    // inverse(Args...) member that removes a row from the window and a value() member returning
+    // the current result.
+    template <typename A>
+    void create_window_function(const std::string_view name, function_flags flags = function_flags::none)
+    {
+        using function = detail::aggregate_function<A>;
+        int error = sqlite3_create_window_function(this->db, std::string(name).c_str(), function::arity,
+                                                   SQLITE_UTF8 | static_cast<int>(flags), nullptr, &function::step,
+                                                   &function::finalize, &function::value, &function::inverse, nullptr);
+        if (error)
+            detail::throw_error(this->db, error);
+    }
+
+    // Registers table as an eponymous virtual table called name, queried with SELECT ... FROM
+    // name. The connection takes ownership of the table; the returned reference stays valid until
+    // the connection is closed and can be used to reset() the records.
+    template <typename Record>
+    virtual_table<Record>& create_virtual_table(const std::string_view name, virtual_table<Record> table)
+    {
+        auto owned = new virtual_table<Record>(std::move(table));
+        int error = sqlite3_create_module_v2(this->db, std::string(name).c_str(), detail::vtab_module<Record>::module(),
+                                             owned, &detail::vtab_module<Record>::destroy);
+        if (error)
+            detail::throw_error(this->db, error);
+        return *owned;
+    }
+
+    // Inserts every record batch of an Arrow stream into table, whose column names must match the
+    // field names of the stream's struct schema. Takes ownership of the stream and releases it.
+    // Returns the number of rows inserted.
+    std::size_t ingest_arrow(const std::string_view table, ArrowArrayStream* stream)
+    {
+        auto release_stream = [](ArrowArrayStream* s) {
+            if (s->release)
+                s->release(s);
+        };
+        std::unique_ptr<ArrowArrayStream, decltype(release_stream)> stream_guard(stream, release_stream);
+        auto check = [&](int result) {
+            if (result)
+            {
+                auto message = stream->get_last_error(stream);
+                throw std::runtime_error(message ? message : std::strerror(result));
+            }
+        };
+
+        ArrowSchema schema;
+        check(stream->get_schema(stream, &schema));
+        auto release_schema = [](ArrowSchema* s) {
+            if (s->release)
+                s->release(s);
+        };
+        std::unique_ptr<ArrowSchema, decltype(release_schema)> schema_guard(&schema, release_schema);
+
+        if (std::string_view(schema.format) != "+s")
+            throw std::invalid_argument("arrow stream must have a struct schema");
+
+        std::vector<detail::arrow_type> types;
+        std::string sql = "insert into " + detail::quote_identifier(table) + " (";
+        std::string values;
+        for (std::int64_t i = 0; i < schema.n_children; i++)
+        {
+            auto type = detail::parse_arrow_format(schema.children[i]->format);
+            if (!type)
+                throw std::invalid_argument(std::string("unsupported arrow format: ") + schema.children[i]->format);
+            types.push_back(*type);
+            sql += (i ? ", " : "") + detail::quote_identifier(schema.children[i]->name ? schema.children[i]->name : "");
+            values += i ? ", ?" : "?";
+        }
+        sql += ") values (" + values + ")";
+
+        std::size_t count = 0;
+        this->atomic([&]() {
+            statement stmt = this->prepare_cached(sql);
+            for (;;)
+            {
+                ArrowArray batch;
+                check(stream->get_next(stream, &batch));
+                if (!batch.release)
+                    break;
+
+                auto release_batch = [](ArrowArray* a) { a->release(a); };
+                std::unique_ptr<ArrowArray, decltype(release_batch)> batch_guard(&batch, release_batch);
+                if (batch.n_children != static_cast<std::int64_t>(types.size()))
+                    throw std::invalid_argument("arrow batch does not match its schema");
+
+                for (std::int64_t row = 0; row < batch.length; row++)
+                {
+                    for (std::size_t column = 0; column < types.size(); column++)
+                        detail::bind_arrow_cell(stmt, column, *batch.children[column], types[column], batch.offset + row);
+                    stmt.step();
+                    stmt.reset();
+                }
+                count += batch.length;
+            }
+        });
+        return count;
+    }
+
+    // Runs func inside a savepoint, which is released if func returns and rolled back if it
+    // throws. Blocks nest; the savepoint statements for each nesting depth are prepared once.
+    template <typename F>
+    void atomic(F&& func)
+    {
+        auto& sp = this->savepoint(this->savepoint_depth);
+        run_control(sp.begin);
+        this->savepoint_depth++;
+        // A feed subscribed inside func has only seen changes made since the savepoint.
+        std::size_t mark = this->feed ? this->feed->mark() : 0;
+        try
+        {
+            func();
+        }
+        catch (...)
+        {
+            this->savepoint_depth--;
+            this->rollback_savepoint(sp, mark);
+            throw;
+        }
+
+        this->savepoint_depth--;
+        try
+        {
+            run_control(sp.release);
+        }
+        catch (...)
+        {
+            this->rollback_savepoint(sp, mark);
+            throw;
+        }
+    }
+
+    // Like atomic(func), but opens the outermost block with BEGIN DEFERRED, IMMEDIATE or
+    // EXCLUSIVE. Inside an existing transaction this is the same as atomic(func).
+    template <typename F>
+    void atomic(transaction_mode mode, F&& func)
+    {
+        if (!sqlite3_get_autocommit(this->db))
+            return this->atomic(std::forward<F>(func));
+
+        static constexpr const char* begin_sql[] = { "begin deferred", "begin immediate", "begin exclusive" };
+        run_control(this->control_statement(this->begin_statements[static_cast<int>(mode)], begin_sql[static_cast<int>(mode)]));
+        auto& rollback = this->control_statement(this->rollback_statement, "rollback");
+        this->savepoint_depth++;
+        try
+        {
+            func();
+        }
+        catch (...)
+        {
+            this->savepoint_depth--;
+            rollback_quietly(rollback);
+            throw;
+        }
+
+        this->savepoint_depth--;
+        try
+        {
+            run_control(this->control_statement(this->commit_statement, "commit"));
+        }
+        catch (...)
+        {
+            rollback_quietly(rollback);
+            throw;
+        }
+    }
+
+#if defined(SQLITE_ENABLE_SESSION)
+    // Runs func as atomic(func) does and returns the changeset of what it changed in the main
+    // schema, to be applied to replicas with apply_changeset.
+    template <typename F>
+    sqlite::changeset atomic_changeset(F&& func)
+    {
+        sqlite::session recorder(*this);
+        recorder.attach();
+        this->atomic(std::forward<F>(func));
+        return recorder.changeset();
+    }
+
+    template <typename F>
+    sqlite::changeset atomic_changeset(transaction_mode mode, F&& func)
+    {
+        sqlite::session recorder(*this);
+        recorder.attach();
+        this->atomic(mode, std::forward<F>(func));
+        return recorder.changeset();
+    }
+
+    // Applies a changeset or patchset to the main schema. on_conflict(const changeset_conflict&)
+    // returns the conflict_action to take; aborting, or an exception from on_conflict, undoes the
+    // whole changeset and throws.
+    template <typename F>
+        requires std::is_invocable_r_v<conflict_action, F&, const changeset_conflict&>
+    void apply_changeset(std::span<const std::byte> changes, F&& on_conflict, const changeset_apply_options& options = {})
+    {
+        detail::changeset_apply_context<F> context { on_conflict, options, {} };
+        int error = sqlite3changeset_apply_v2(this->db, static_cast<int>(changes.size()),
+                                              const_cast<std::byte*>(changes.data()),
+                                              options.tables ? &decltype(context)::filter : nullptr,
+                                              &decltype(context)::conflict, &context, nullptr, nullptr, context.flags());
+        this->finish_apply(error, context.error);
+    }
+
+    // Applies a changeset read through the streaming interface, such as one written by
+    // session::write_changeset.
+    template <typename F>
+        requires std::is_invocable_r_v<conflict_action, F&, const changeset_conflict&>
+    void apply_changeset(std::istream& in, F&& on_conflict, const changeset_apply_options& options = {})
+    {
+        auto input = [](void* context, void* data, int* size) {
+            auto& stream = *static_cast<std::istream*>(context);
+            stream.read(static_cast<char*>(data), *size);
+            *size = static_cast<int>(stream.gcount());
+            return stream.bad() ? SQLITE_IOERR : SQLITE_OK;
+        };
+        detail::changeset_apply_context<F> context { on_conflict, options, {} };
+        int error = sqlite3changeset_apply_v2_strm(this->db, input, &in,
+                                                   options.tables ? &decltype(context)::filter : nullptr,
+                                                   &decltype(context)::conflict, &context, nullptr, nullptr,
+                                                   context.flags());
+        this->finish_apply(error, context.error);
+    }
+
+    // Applies changes, aborting on the first conflict.
+    void apply_changeset(std::span<const std::byte> changes, const changeset_apply_options& options = {})
+    {
+        this->apply_changeset(changes, [](const changeset_conflict&) { return conflict_action::abort; }, options);
+    }
+#endif
+
+    // Copies the database into a contiguous image, the same bytes a file of it would hold.
+    serialized serialize(const std::string_view schema = "main") const
+    {
+        serialized image;
+        sqlite3_int64 size = 0;
+        image.bytes.reset(reinterpret_cast<std::byte*>(sqlite3_serialize(this->db, std::string(schema).c_str(), &size, 0)));
+        if (!image.bytes && size)
+            detail::throw_error(this->db, SQLITE_NOMEM);
+        image.length = image.bytes ? static_cast<std::size_t>(size) : 0;
+        return image;
+    }
+
+    // The in-memory database's own buffer, returned without copying. Empty when the database is
+    // not stored in one contiguous buffer, as with file databases or the default ":memory:" VFS
+    // before a deserialize. Invalidated by any change to the database.
+    std::span<const std::byte> serialized_view(const std::string_view schema = "main") const noexcept
+    {
+        sqlite3_int64 size = 0;
+        auto data = sqlite3_serialize(this->db, std::string(schema).c_str(), &size, SQLITE_SERIALIZE_NOCOPY);
+        if (!data)
+            return {};
+        return { reinterpret_cast<const std::byte*>(data), static_cast<std::size_t>(size) };
+    }
+
+    // Replaces the schema with the database in image, which the connection takes over without a
+    // copy. The database stays writable and can grow.
+    void deserialize(serialized&& image, const std::string_view schema = "main")
+    {
+        auto size = static_cast<sqlite3_int64>(image.length);
+        image.length = 0;
+        // SQLite frees the buffer itself, even when deserializing fails.
+        int error = sqlite3_deserialize(this->db, std::string(schema).c_str(),
+                                        reinterpret_cast<unsigned char*>(image.bytes.release()), size, size,
+                                        SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+        if (error)
+            detail::throw_error(this->db, error);
+    }
+
+    // Replaces the schema with a read-only database that reads image in place, for example a
+    // snapshot in shared memory. image must outlive the connection.
+    void deserialize_readonly(std::span<const std::byte> image, const std::string_view schema = "main")
+    {
+        auto data = reinterpret_cast<unsigned char*>(const_cast<std::byte*>(image.data()));
+        auto size = static_cast<sqlite3_int64>(image.size());
+        if (int error = sqlite3_deserialize(this->db, std::string(schema).c_str(), data, size, size, SQLITE_DESERIALIZE_READONLY))
+            detail::throw_error(this->db, error);
+    }
+
+    // Opens an in-memory database holding image.
+    static database from_image(serialized&& image)
+    {
+        database result(":memory:");
+        result.deserialize(std::move(image));
+        return result;
+    }
+
+    sqlite3* handle() const
+    {
+        return db;
+    }
+
+    // Applies every setting in options except the open flags. Throws if SQLite rejects a setting,
+    // or if the journal mode can't be changed to the one requested, except that in-memory
+    // databases keep their memory journal.
+    void configure(const database_options& options)
+    {
+        if (options.lookaside)
+            this->set_lookaside(*options.lookaside);
+        for (auto [op, value] : options.db_config)
+        {
+            if (int error = sqlite3_db_config(this->db, op, value, static_cast<int*>(nullptr)))
+                detail::throw_error(this->db, error);
+        }
+        for (auto [category, value] : options.limits)
+            sqlite3_limit(this->db, category, value);
+        if (options.busy_timeout)
+            sqlite3_busy_timeout(this->db, static_cast<int>(options.busy_timeout->count()));
+        if (options.backoff)
+            this->set_busy_backoff(*options.backoff);
+        if (options.page_size)
+            this->pragma("page_size", std::to_string(*options.page_size));
+        if (options.journal)
+        {
+            static constexpr const char* names[] = { "delete", "truncate", "persist", "memory", "wal", "off" };
+            const char* requested = names[static_cast<int>(*options.journal)];
+            auto mode = this->pragma("journal_mode", requested);
+            if (!detail::iequals(mode, requested) && !detail::iequals(mode, "memory"))
+                throw std::invalid_argument("could not change journal_mode to " + std::string(requested));
+        }
+        if (options.synchronous)
+            this->pragma("synchronous", std::to_string(static_cast<int>(*options.synchronous)));
+        if (options.locking)
+            this->pragma("locking_mode", *options.locking == locking_mode::exclusive ? "exclusive" : "normal");
+        if (options.cache_size)
+            this->pragma("cache_size", std::to_string(*options.cache_size));
+        if (options.mmap_size)
+            this->pragma("mmap_size", std::to_string(*options.mmap_size));
+        if (options.temp_store)
+            this->pragma("temp_store", std::to_string(static_cast<int>(*options.temp_store)));
+        if (options.wal_autocheckpoint)
+            this->pragma("wal_autocheckpoint", std::to_string(*options.wal_autocheckpoint));
+        if (options.map_file)
+            this->map_file(*options.map_file);
+    }
+
+    // Resizes the lookaside, allocating its slots with SQLite's allocator; 0 slots disables it.
+    // Fails with SQLITE_BUSY while any lookaside memory is in use, so call it before preparing
+    // statements.
+    void set_lookaside(const lookaside_options& options)
+    {
+        if (int error = sqlite3_db_config(this->db, SQLITE_DBCONFIG_LOOKASIDE, static_cast<void*>(nullptr),
+                                          options.slot_size, options.slots))
+            detail::throw_error(this->db, error);
+    }
+
+    // Sets a pragma and returns the first column of its first result row, if any.
+    std::string pragma(const std::string_view name, const std::string_view value)
+    {
+        return this->run_pragma("pragma " + std::string(name) + " = " + std::string(value));
+    }
+
+    // Reads a pragma's current value.
+    std::string pragma(const std::string_view name)
+    {
+        return this->run_pragma("pragma " + std::string(name));
+    }
+
+    // Memory-maps the whole database file, which suits read-only databases: pages are then read
+    // straight from the page cache of the OS instead of being copied through SQLite's pager.
+    // The mapping is capped at SQLITE_MAX_MMAP_SIZE. Returns the size of the mapping limit.
+    std::int64_t map_file(const mmap_options& options = {}, const std::string_view schema = "main")
+    {
+        auto prefix = detail::quote_identifier(schema) + ".";
+        auto size = std::stoll(this->pragma(prefix + "page_count")) * std::stoll(this->pragma(prefix + "page_size"));
+        this->pragma(prefix + "mmap_size", std::to_string(size));
+        // SQLite maps the file on the next fetch of a page other than page 1 that misses the page
+        // cache, so drop the cached pages and read a row from the first table.
+        sqlite3_db_release_memory(this->db);
+        auto table = this->run_pragma("select name from " + prefix +
+                                      "sqlite_schema where type = 'table' and rootpage > 1 order by rootpage limit 1");
+        if (!table.empty())
+            this->run_pragma("select 1 from " + prefix + detail::quote_identifier(table) + " limit 1");
+        this->mapped.locate(sqlite3_db_filename(this->db, std::string(schema).c_str()), options);
+        return this->mmap_size(schema);
+    }
+
+    // The mmap limit of the database file as reported by SQLITE_FCNTL_MMAP_SIZE.
+    std::int64_t mmap_size(const std::string_view schema = "main") const
+    {
+        sqlite3_int64 size = -1;
+        if (int error = sqlite3_file_control(this->db, std::string(schema).c_str(), SQLITE_FCNTL_MMAP_SIZE, &size))
+            detail::throw_error(this->db, error);
+        return size;
+    }
+
+    // Whether the bytes lie inside a file mapped by map_file, that is, whether a pointer was
+    // handed out straight from the mapped pages. Only detected on Linux; elsewhere this always
+    // returns false. Note that SQLite copies TEXT and BLOB column values out of the page when it
+    // decodes a row, so the views returned by loaders are never mapped: mmap saves the read() into
+    // the pager, not the final copy.
+    bool is_mapped(const void* data, std::size_t size) const noexcept
+    {
+        return this->mapped.contains(data, size);
+    }
+
+    bool is_mapped(const std::string_view text) const noexcept
+    {
+        return this->is_mapped(text.data(), text.size());
+    }
+
+    template <typename T>
+    bool is_mapped(const blob<T>& data) const noexcept
+    {
+        if constexpr (std::is_same_v<T, void>)
+            return this->is_mapped(data.data, data.size);
+        else
+            return this->is_mapped(data.data, data.size * sizeof(T));
+    }
+
+private:
+#if defined(SQLITE_ENABLE_SESSION)
+    void finish_apply(int error, const std::exception_ptr& handler_error)
+    {
+        if (handler_error)
+            std::rethrow_exception(handler_error);
+        if (error)
+            detail::throw_error(this->db, error);
+    }
+#endif
+
+    detail::hook_dispatcher& dispatcher()
+    {
+        if (!this->hooks)
+            this->hooks = std::make_unique<detail::hook_dispatcher>(this->db);
+        return *this->hooks;
+    }
+
+    std::string run_pragma(const std::string& sql)
+    {
+        std::string result;
+        statement stmt = this->prepare(sql);
+        if (stmt.step())
+        {
+            if (auto text = stmt.get<0, const char*>())
+                result = text;
+            while (stmt.step())
+                ;
+        }
+        return result;
+    }
+
+public:
+    using hook_id = std::size_t;
+
+    // Calls listener(op, schema, table, rowid) for every row inserted, updated or deleted through
+    // this connection, where op is SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE. As with
+    // sqlite3_update_hook, WITHOUT ROWID tables are not reported.
+    template <typename F>
+    hook_id on_update(F&& listener)
+    {
+        return this->dispatcher().add(detail::hook_dispatcher::update_listener(std::forward<F>(listener)));
+    }
+
+    // Calls listener just before a transaction commits. Returning true turns the commit into a
+    // rollback.
+    template <typename F>
+    hook_id on_commit(F&& listener)
+    {
+        return this->dispatcher().add(detail::hook_dispatcher::commit_listener(std::forward<F>(listener)));
+    }
+
+    template <typename F>
+    hook_id on_rollback(F&& listener)
+    {
+        return this->dispatcher().add(detail::hook_dispatcher::rollback_listener(std::forward<F>(listener)));
+    }
+
+    // Calls listener(schema, frames) after a transaction has committed to the WAL, when it is
+    // visible to other connections.
+    template <typename F>
+    hook_id on_wal_commit(F&& listener)
+    {
+        auto& hooks = this->dispatcher();
+        int frames = hooks.hooks_wal() ? hooks.autocheckpoint : this->wal_autocheckpoint();
+        return hooks.add(detail::hook_dispatcher::wal_listener(std::forward<F>(listener)), frames);
+    }
+
+    // Calls listener(event, p, x) for the sqlite3_trace_v2 events in the events mask, such as
+    // SQLITE_TRACE_PROFILE at the end of every statement. Listeners share one trace callback with
+    // the profiler.
+    template <typename F>
+    hook_id on_trace(unsigned int events, F&& listener)
+    {
+        return this->dispatcher().add(detail::hook_dispatcher::trace_listener(std::forward<F>(listener)), events);
+    }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    // Calls listener(db, op, schema, table, rowid, new_rowid) before every row is changed through
+    // this connection, including rows of WITHOUT ROWID tables; sqlite3_preupdate_old and
+    // sqlite3_preupdate_new read the row's values. Throws std::logic_error while a session exists.
+    template <typename F>
+    hook_id on_preupdate(F&& listener)
+    {
+        return this->dispatcher().add(detail::hook_dispatcher::preupdate_listener(std::forward<F>(listener)));
+    }
+#endif
+
+    void remove_hook(hook_id id)
+    {
+        if (this->hooks)
+            this->hooks->remove(id);
+    }
+
+    // Installs func(action, arg1, arg2, schema, trigger_or_view) as the connection's authorizer,
+    // returning SQLITE_OK, SQLITE_IGNORE or SQLITE_DENY; one that throws denies. Use this rather
+    // than sqlite3_set_authorizer: query_cache and parallel_scan briefly install their own authorizer
+    // to see which tables a query reads, chaining to this one and restoring it afterwards.
+    template <typename F>
+    void set_authorizer(F&& func)
+    {
+        this->dispatcher().set_authorizer(detail::hook_dispatcher::authorizer(std::forward<F>(func)));
+    }
+
+    void remove_authorizer()
+    {
+        if (this->hooks)
+            this->hooks->set_authorizer(nullptr);
+    }
+
+    // The WAL size in frames at which a commit checkpoints; 0 disables automatic checkpoints. Use
+    // these rather than the pragma while on_wal_commit listeners are installed, since the pragma
+    // replaces the connection's WAL hook.
+    int wal_autocheckpoint()
+    {
+        if (this->hooks && this->hooks->hooks_wal())
+            return this->hooks->autocheckpoint;
+        return std::stoi(this->pragma("wal_autocheckpoint"));
+    }
+
+    void set_wal_autocheckpoint(int frames)
+    {
+        if (this->hooks && this->hooks->hooks_wal())
+            this->hooks->autocheckpoint = frames;
+        else
+            sqlite3_wal_autocheckpoint(this->db, frames);
+    }
+
+    // Publishes the rows changed by each committed transaction on this connection to the returned
+    // subscription, as one change_batch per transaction. Changes are reported through the update
+    // hook, or the preupdate hook when values are captured, so they share its limits: changes made
+    // by other connections are not seen, and sessions can't be used on the same connection while
+    // values are captured, since they need the preupdate hook to themselves. Once one subscriber
+    // captures values, every batch from the connection carries them.
+    change_subscription subscribe_changes(const change_feed_options& options = {})
+    {
+#if !defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+        if (options.capture_values)
+            throw std::invalid_argument("capturing values requires SQLITE_ENABLE_PREUPDATE_HOOK");
+#endif
+        if (!this->feed)
+        {
+            this->feed = std::make_unique<detail::change_feed>();
+            auto feed = this->feed.get();
+            auto db = this->db;
+            this->feed->hooks = {
+                this->on_update([feed](int op, std::string_view schema, std::string_view table, std::int64_t rowid) {
+                    feed->changed(op, schema, table, rowid, rowid);
+                }),
+                this->on_rollback([feed]() { feed->rolled_back(); }),
+                this->on_trace(SQLITE_TRACE_PROFILE, [feed, db](unsigned int, void*, void*) { feed->statement_finished(db); }),
+            };
+        }
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+        if (options.capture_values && !this->feed->capturing_values())
+        {
+            auto feed = this->feed.get();
+            // Installed first, since it throws while a session is recording.
+            this->feed->values_hook = this->on_preupdate(
+                [feed](sqlite3* db, int op, std::string_view schema, std::string_view table, std::int64_t rowid,
+                       std::int64_t new_rowid) { feed->preupdate(db, op, schema, table, rowid, new_rowid); });
+            this->remove_hook(std::exchange(this->feed->hooks[0], 0));
+        }
+#endif
+        return change_subscription(this->feed->subscribe(options));
+    }
+
+    // Starts aggregating per-statement timings and counters. When profiling is disabled no trace
+    // callback is installed, so it costs nothing.
+    void enable_profiling()
+    {
+        if (this->profiler)
+            return;
+        auto profiler = std::make_unique<detail::profiler>();
+        auto p = profiler.get();
+        profiler->hook = this->on_trace(SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, [p](unsigned int event, void* stmt, void* x) {
+            detail::profiler::trace(event, p, stmt, x);
+        });
+        this->profiler = std::move(profiler);
+    }
+
+    void disable_profiling() noexcept
+    {
+        if (this->profiler)
+            this->hooks->remove(this->profiler->hook);
+        this->profiler.reset();
+    }
+
+    bool profiling() const noexcept
+    {
+        return this->profiler != nullptr;
+    }
+
+    // Clears the statement profiles collected so far.
+    void reset_profile()
+    {
+        if (this->profiler)
+            this->profiler->reset();
+    }
+
+    database_status status(bool reset = false) const noexcept
+    {
+        auto counter = [&](int op) {
+            int current = 0, highwater = 0;
+            sqlite3_db_status(this->db, op, &current, &highwater, reset);
+            return static_cast<std::int64_t>(current);
+        };
+        return { counter(SQLITE_DBSTATUS_CACHE_HIT), counter(SQLITE_DBSTATUS_CACHE_MISS), counter(SQLITE_DBSTATUS_CACHE_WRITE),
+                 counter(SQLITE_DBSTATUS_CACHE_SPILL), counter(SQLITE_DBSTATUS_CACHE_USED) };
+    }
+
+    profile_snapshot profile() const
+    {
+        profile_snapshot snapshot;
+        if (this->profiler)
+            snapshot.statements = this->profiler->snapshot();
+        snapshot.status = this->status();
+        return snapshot;
+    }
+
+    static constexpr std::size_t default_cache_capacity = 32;
+    static constexpr std::size_t max_rows_per_insert = 500;
+
+private:
+    template <fixed_string Sql, typename Columns, typename... Params>
+    friend class query;
+    friend class session;
+    friend bool detail::read_tables(const database& db, const std::string_view sql, std::vector<std::string>& tables);
+
+    // The statement of a sqlite::query, prepared the first time the query runs on this connection,
+    // when its column count is checked.
+    statement& query_statement(std::size_t slot, const std::string_view sql, int columns) const
+    {
+        // A deque, so growing it for a new slot doesn't move statements whose references callers hold.
+        while (this->query_statements.size() <= slot)
+            this->query_statements.emplace_back();
+        auto& stmt = this->query_statements[slot];
+        if (!stmt.handle())
+        {
+            auto prepared = this->prepare(sql);
+            if (sqlite3_column_count(prepared.handle()) != columns)
+                throw std::logic_error("number of columns does not match the column types of the query");
+            stmt = std::move(prepared);
+        }
+        return stmt;
+    }
+
+    struct savepoint_statements
+    {
+        statement begin;
+        statement release;
+        statement rollback;
+    };
+
+    savepoint_statements& savepoint(int depth)
+    {
+        while (static_cast<int>(this->savepoints.size()) <= depth)
+        {
+            auto name = "s" + std::to_string(this->savepoints.size());
+            this->savepoints.push_back({ this->prepare("savepoint " + name), this->prepare("release savepoint " + name),
+                                         this->prepare("rollback transaction to savepoint " + name) });
+        }
+        return this->savepoints[depth];
+    }
+
+    statement& control_statement(statement& slot, const char* sql)
+    {
+        if (!slot.handle())
+            slot = this->prepare(sql);
+        return slot;
+    }
+
+    static void run_control(const statement& stmt)
+    {
+        try
+        {
+            stmt.step();
+        }
+        catch (...)
+        {
+            stmt.reset();
+            throw;
+        }
+        stmt.reset();
+    }
+
+    // Rolls back to a savepoint of atomic and drops the changes the feed buffered since then.
+    void rollback_savepoint(const savepoint_statements& sp, std::size_t mark) noexcept
+    {
+        rollback_quietly(sp.rollback, &sp.release);
+        if (this->feed)
+            this->feed->rolled_back_to(mark);
+    }
+
+    // Rolls back after a failure without masking the original exception. The rollback can fail
+    // legitimately, for example when SQLite has already rolled the transaction back itself.
+    static void rollback_quietly(const statement& rollback, const statement* release = nullptr) noexcept
+    {
+        try
+        {
+            run_control(rollback);
+            if (release)
+                run_control(*release);
+        }
+        catch (...)
+        {
+        }
+    }
+
+    template <typename Tuple>
+    static void bind_row(const statement& stmt, std::size_t offset, const Tuple& row)
+    {
+        int index = static_cast<int>(offset);
+        std::apply([&](const auto&... items) { (stmt.bind(index++, items), ...); }, row);
+    }
+
+    sqlite3* db;
+    std::unique_ptr<statement_cache> cache;
+    std::deque<savepoint_statements> savepoints;
+    std::array<statement, 3> begin_statements;
+    statement commit_statement;
+    statement rollback_statement;
+    mutable std::deque<statement> query_statements;
+    int savepoint_depth = 0;
+    std::unique_ptr<detail::profiler> profiler;
+    detail::mapped_regions mapped;
+    std::unique_ptr<detail::busy_handler> busy;
+    std::unique_ptr<detail::hook_dispatcher> hooks;
+    std::unique_ptr<detail::change_feed> feed;
+};
+
+#if defined(SQLITE_ENABLE_SESSION)
+inline session::session(database& db, const char* schema)
+{
+    // sqlite3session_create chains to the connection's previous preupdate hook, taking its context
+    // to be another session, so the dispatcher's hook must not be installed, and it must not be
+    // installed or removed until the last session is deleted.
+    auto& hooks = db.dispatcher();
+    if (hooks.hooks_preupdate())
+        throw std::logic_error("session can't be created while preupdate listeners are installed");
+    if (int error = sqlite3session_create(db.handle(), schema, &this->sess))
+        detail::throw_error(db.handle(), error);
+    hooks.sessions++;
+    this->hooks = &hooks;
+}
+#endif
+
+// A statement whose SQL, parameter types and column types are fixed at compile time. The number of
+// "?" placeholders is checked against Params when the query type is formed, arguments are
+// converted to Params at the call site, and the column count is checked against Columns when the
+// statement is first prepared. Each query type owns one statement per connection, prepared lazily
+// and found by index rather than by hashing the SQL, so running a query again on the same
+// connection resets the rows of the previous run.
+//
+//     using find_foo = sqlite::query<"select id, name from foo where id = ?", std::tuple<std::int64_t, std::string_view>, std::int64_t>;
+//     for (auto [id, name] : find_foo::rows(db, 42))
+template <fixed_string Sql, typename... Columns, typename... Params>
+class query<Sql, std::tuple<Columns...>, Params...>
+{
+    static constexpr int placeholders = detail::count_placeholders(Sql.view());
+    static_assert(placeholders >= 0, "sqlite::query only supports anonymous ? parameters");
+    static_assert(placeholders == sizeof...(Params), "number of ? placeholders does not match the parameter types");
+
+public:
+    static constexpr std::string_view sql = Sql.view();
+
+    // Resets the connection's statement for this query and binds args to it.
+    static const statement& execute(const database& db, detail::query_param_t<Params>... args)
+    {
+        auto& stmt = db.query_statement(slot, sql, static_cast<int>(sizeof...(Columns)));
+        stmt.reset();
+        stmt.bind_multiple(args...);
+        return stmt;
+    }
+
+    static row_range<Columns...> rows(const database& db, detail::query_param_t<Params>... args)
+    {
+        return execute(db, args...).template rows<Columns...>();
+    }
+
+    // Returns the first row, if any. The statement is reset once the row is copied out, ending its
+    // read transaction, unless a column is a view into the row; those stay valid, and keep the
+    // transaction open, until the query runs again.
+    static std::optional<std::tuple<Columns...>> one(const database& db, detail::query_param_t<Params>... args)
+    {
+        auto& stmt = execute(db, args...);
+        if (!stmt.step())
+            return {};
+        std::optional<std::tuple<Columns...>> row(stmt.template get_all<Columns...>());
+        if constexpr ((detail::owning_column<Columns> && ...))
+            stmt.reset();
+        return row;
+    }
+
+    // Steps the statement to completion and returns the number of rows it changed.
+    static std::int64_t run(const database& db, detail::query_param_t<Params>... args)
+    {
+        auto& stmt = execute(db, args...);
+        while (stmt.step())
+            ;
+        return sqlite3_changes64(db.handle());
+    }
+
+private:
+    static inline const std::size_t slot = detail::next_query_slot();
+};
+
+namespace detail
+{
+template <typename T>
+struct arrow_format;
+
+template <>
+struct arrow_format<std::int32_t>
+{
+    static constexpr const char* value = "i";
+};
+
+template <>
+struct arrow_format<std::int64_t>
+{
+    static constexpr const char* value = "l";
+};
+
+template <>
+struct arrow_format<double>
+{
+    static constexpr const char* value = "g";
+};
+
+template <>
+struct arrow_format<std::string>
+{
+    static constexpr const char* value = "U";
+};
+
+template <>
+struct arrow_format<std::string_view>
+{
+    static constexpr const char* value = "U";
+};
+
+template <>
+struct arrow_format<const char*>
+{
+    static constexpr const char* value = "U";
+};
+
+template <typename T>
+struct arrow_format<blob<T>>
+{
+    static constexpr const char* value = "Z";
+};
+
+template <typename T>
+struct arrow_format<std::vector<T>>
+{
+    static constexpr const char* value = "Z";
+};
+
+template <typename T>
+struct arrow_format<std::optional<T>>
+{
+    static constexpr const char* value = arrow_format<T>::value;
+};
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+void arrow_fill(ArrowArray& array, const void** buffers, const column_buffer<T>& column)
+{
+    buffers[1] = column.values.data();
+    array.n_buffers = 2;
+}
+
+template <typename Element>
+void arrow_fill(ArrowArray& array, const void** buffers, const variable_column_buffer<Element>& column)
+{
+    buffers[1] = column.offsets.data();
+    buffers[2] = column.data.data();
+    array.n_buffers = 3;
+}
+
+template <typename T>
+void arrow_fill(ArrowArray& array, const void** buffers, const column_buffer<std::optional<T>>& column)
+{
+    arrow_fill(array, buffers, column.values);
+    buffers[0] = column.validity.data();
+    array.null_count = column.null_count;
+}
+
+// Exports column batches as Arrow arrays without copying them. The batch and the child arrays
+// are shared by the parent array and every child, since consumers may move children out and
+// release them separately.
+template <typename... Ts>
+struct arrow_batch
+{
+    static constexpr std::size_t columns = sizeof...(Ts);
+
+    column_batch<Ts...> batch;
+    std::array<ArrowArray, columns> children;
+    std::array<ArrowArray*, columns> child_pointers;
+    std::array<std::array<const void*, 3>, columns> buffers {};
+    const void* parent_buffers[1] = { nullptr };
+
+    static void release(ArrowArray* array)
+    {
+        for (std::int64_t i = 0; i < array->n_children; i++)
+            if (array->children[i]->release)
+                array->children[i]->release(array->children[i]);
+        release_child(array);
+    }
+
+    static void release_child(ArrowArray* array)
+    {
+        delete static_cast<std::shared_ptr<arrow_batch>*>(array->private_data);
+        array->release = nullptr;
+    }
+
+    static void export_to(std::shared_ptr<arrow_batch> self, ArrowArray* out)
+    {
+        self->export_children(self, std::index_sequence_for<Ts...> {});
+        *out = ArrowArray { static_cast<int64_t>(self->batch.size()), 0, 0, 1, columns, self->parent_buffers,
+                            self->child_pointers.data(), nullptr, &arrow_batch::release, nullptr };
+        out->private_data = new std::shared_ptr<arrow_batch>(std::move(self));
+    }
+
+private:
+    template <std::size_t... I>
+    void export_children(const std::shared_ptr<arrow_batch>& self, std::index_sequence<I...>)
+    {
+        ((this->children[I] = ArrowArray { static_cast<int64_t>(this->batch.size()), 0, 0, 0, 0, this->buffers[I].data(), nullptr, nullptr,
+                                           &arrow_batch::release_child, new std::shared_ptr<arrow_batch>(self) },
+          arrow_fill(this->children[I], this->buffers[I].data(), this->batch.template column<I>()),
+          this->child_pointers[I] = &this->children[I]),
+         ...);
+    }
+};
+
+template <typename T>
+constexpr bool arrow_nullable = false;
+
+template <typename T>
+constexpr bool arrow_nullable<std::optional<T>> = true;
+
+template <typename... Ts>
+struct arrow_schema
+{
+    static constexpr std::size_t columns = sizeof...(Ts);
+
+    std::vector<std::string> names;
+    std::array<ArrowSchema, columns> children;
+    std::array<ArrowSchema*, columns> child_pointers;
+
+    static void release(ArrowSchema* schema)
+    {
+        for (std::int64_t i = 0; i < schema->n_children; i++)
+            if (schema->children[i]->release)
+                schema->children[i]->release(schema->children[i]);
+        release_child(schema);
+    }
+
+    static void release_child(ArrowSchema* schema)
+    {
+        delete static_cast<std::shared_ptr<arrow_schema>*>(schema->private_data);
+        schema->release = nullptr;
+    }
+
+    static void export_to(std::shared_ptr<arrow_schema> self, ArrowSchema* out)
+    {
+        self->export_children(self, std::index_sequence_for<Ts...> {});
+        *out = ArrowSchema { "+s", "", nullptr, 0, columns, self->child_pointers.data(), nullptr, &arrow_schema::release, nullptr };
+        out->private_data = new std::shared_ptr<arrow_schema>(std::move(self));
+    }
+
+private:
+    template <std::size_t... I>
+    void export_children(const std::shared_ptr<arrow_schema>& self, std::index_sequence<I...>)
+    {
+        ((this->children[I] = ArrowSchema { arrow_format<Ts>::value, this->names[I].c_str(), nullptr,
+                                            arrow_nullable<Ts> ? ARROW_FLAG_NULLABLE : 0, 0, nullptr, nullptr,
+                                            &arrow_schema::release_child, new std::shared_ptr<arrow_schema>(self) },
+          this->child_pointers[I] = &this->children[I]),
+         ...);
+    }
+};
+
+template <typename... Ts>
+struct arrow_stream
+{
+    statement stmt;
+    std::size_t batch_rows;
+    std::vector<std::string> names;
+    std::string last_error;
+    bool done = false;
+
+    static arrow_stream& self(ArrowArrayStream* stream) noexcept
+    {
+        return *static_cast<arrow_stream*>(stream->private_data);
+    }
+
+    static int get_schema(ArrowArrayStream* stream, ArrowSchema* out)
+    {
+        try
+        {
+            auto schema = std::make_shared<arrow_schema<Ts...>>();
+            schema->names = self(stream).names;
+            arrow_schema<Ts...>::export_to(std::move(schema), out);
+            return 0;
+        }
+        catch (const std::exception& e)
+        {
+            self(stream).last_error = e.what();
+            return EIO;
+        }
+    }
+
+    static int get_next(ArrowArrayStream* stream, ArrowArray* out)
+    {
+        auto& state = self(stream);
+        try
+        {
+            out->release = nullptr;
+            if (state.done)
+                return 0;
+
+            auto batch = std::make_shared<arrow_batch<Ts...>>();
+            if (state.stmt.fetch_columns(batch->batch, state.batch_rows) < state.batch_rows)
+                state.done = true;
+            if (batch->batch.size())
+                arrow_batch<Ts...>::export_to(std::move(batch), out);
+            return 0;
+        }
+        catch (const std::exception& e)
+        {
+            state.done = true;
+            state.last_error = e.what();
+            return EIO;
+        }
+    }
+
+    static const char* get_last_error(ArrowArrayStream* stream)
+    {
+        auto& state = self(stream);
+        return state.last_error.empty() ? nullptr : state.last_error.c_str();
+    }
+
+    static void release(ArrowArrayStream* stream)
+    {
+        delete &self(stream);
+        stream->release = nullptr;
+    }
+};
+}  // namespace detail
+
+// Exports the rows of a statement as an Arrow C stream of record batches of at most batch_rows
+// rows, filled with statement::fetch_columns. Ts are the column types as for fetch_columns;
+// view types like std::string_view are fine since every batch is copied into column buffers.
+// The stream owns the statement and must be released by the consumer.
+template <typename... Ts>
+ArrowArrayStream export_arrow(statement&& stmt, std::size_t batch_rows = 64 * 1024)
+{
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < sizeof...(Ts); i++)
+    {
+        auto name = sqlite3_column_name(stmt.handle(), i);
+        names.emplace_back(name ? name : "");
+    }
+
+    auto state = new detail::arrow_stream<Ts...> { std::move(stmt), std::max<std::size_t>(batch_rows, 1), std::move(names), {}, false };
+    return ArrowArrayStream { &detail::arrow_stream<Ts...>::get_schema, &detail::arrow_stream<Ts...>::get_next,
+                              &detail::arrow_stream<Ts...>::get_last_error, &detail::arrow_stream<Ts...>::release, state };
+}
+
+struct backup_progress
+{
+    int remaining;
+    int page_count;
+};
+
+struct backup_options
+{
+    // Pages copied per sqlite3_backup_step; -1 copies everything in one step.
+    int pages_per_step = 256;
+    // Sleep between steps, which leaves the source free for writers and caps the I/O rate.
+    std::chrono::milliseconds pause {};
+    // Called after every step. Returning false cancels the backup.
+    std::function<bool(const backup_progress&)> progress;
+};
+
+// An online backup through sqlite3_backup_init/step/finish, copying source into destination
+// page by page. The source stays usable throughout; if it is written to through another
+// connection the backup restarts.
+class backup
+{
+public:
+    backup(database& destination, const database& source, const std::string_view destination_schema = "main",
+           const std::string_view source_schema = "main")
+        : destination(destination.handle())
+        , handle(sqlite3_backup_init(destination.handle(), std::string(destination_schema).c_str(), source.handle(),
+                                     std::string(source_schema).c_str()))
+    {
+        if (!this->handle)
+            detail::throw_error(this->destination, sqlite3_errcode(this->destination));
+    }
+
+    backup(const backup&) = delete;
+    backup& operator=(const backup&) = delete;
+
+    ~backup()
+    {
+        sqlite3_backup_finish(this->handle);
+    }
+
+    // Copies up to pages pages. Returns false when the backup is complete. A source or
+    // destination that is busy or locked is not an error; the step is simply tried again later.
+    bool step(int pages)
+    {
+        int result = sqlite3_backup_step(this->handle, pages);
+        this->blocked = (result & 0xff) == SQLITE_BUSY || (result & 0xff) == SQLITE_LOCKED;
+        switch (result)
+        {
+        case SQLITE_DONE:
+            return false;
+        case SQLITE_OK:
+        case SQLITE_BUSY:
+        case SQLITE_LOCKED:
+            return true;
+        default:
+            detail::throw_error(this->destination, result);
+        }
+    }
+
+    // Runs the backup to completion. Returns false if the progress callback cancelled it.
+    bool run(const backup_options& options = {})
+    {
+        for (;;)
+        {
+            bool more = this->step(options.pages_per_step);
+            if (options.progress && !options.progress(this->progress()))
+                return false;
+            if (!more)
+                break;
+            // Retrying a busy or locked step at once would spin until the other connection is done.
+            if (this->blocked)
+                std::this_thread::sleep_for(std::max(options.pause, blocked_pause));
+            else if (options.pause.count())
+                std::this_thread::sleep_for(options.pause);
+        }
+        this->finish();
+        return true;
+    }
+
+    // Releases the backup, throwing if it failed.
+    void finish()
+    {
+        int result = sqlite3_backup_finish(this->handle);
+        this->handle = nullptr;
+        if (result)
+            detail::throw_error(this->destination, result);
+    }
+
+    backup_progress progress() const noexcept
+    {
+        return { sqlite3_backup_remaining(this->handle), sqlite3_backup_pagecount(this->handle) };
+    }
+
+private:
+    static constexpr std::chrono::milliseconds blocked_pause { 1 };
+
+    sqlite3* destination;
+    sqlite3_backup* handle;
+    // Whether the last step found the source or destination busy or locked.
+    bool blocked = false;
+};
+
+// Incremental I/O on a single blob through sqlite3_blob_open, so large values can be read and
+// written in chunks without holding the whole value in memory. The size of the blob is fixed; use
+// zeroblob to reserve space before writing.
+class blob_stream
+{
+public:
+    blob_stream(const database& db, const std::string_view table, const std::string_view column, std::int64_t rowid,
+                bool writable = false, const std::string_view schema = "main")
+        : db(db.handle())
+    {
+        if (int error = sqlite3_blob_open(this->db, std::string(schema).c_str(), std::string(table).c_str(),
+                                          std::string(column).c_str(), rowid, writable, &this->blob))
+        {
+            sqlite3_blob_close(this->blob);
+            detail::throw_error(this->db, error);
+        }
+    }
+
+    blob_stream(const blob_stream&) = delete;
+
+    blob_stream(blob_stream&& other) noexcept
+        : db(other.db)
+        , blob(other.blob)
+    {
+        other.blob = nullptr;
+    }
+
+    ~blob_stream()
+    {
+        sqlite3_blob_close(this->blob);
+    }
+
+    blob_stream& operator=(const blob_stream&) = delete;
+
+    blob_stream& operator=(blob_stream&& other) noexcept
+    {
+        sqlite3_blob_close(this->blob);
+        this->db = other.db;
+        this->blob = other.blob;
+        other.blob = nullptr;
+        return *this;
+    }
+
+    int size() const
+    {
+        return sqlite3_blob_bytes(this->blob);
+    }
+
+    void read(void* buffer, int count, int offset) const
+    {
+        if (int error = sqlite3_blob_read(this->blob, buffer, count, offset))
+            detail::throw_error(this->db, error);
+    }
+
+    void write(const void* data, int count, int offset) const
+    {
+        if (int error = sqlite3_blob_write(this->blob, data, count, offset))
+            detail::throw_error(this->db, error);
+    }
+
+    // Reads the blob sequentially in chunks of at most chunk_size bytes, calling
+    // func(const std::byte* data, int size) for each chunk.
+    template <typename F>
+    void read_chunks(int chunk_size, F&& func) const
+    {
+        if (chunk_size <= 0)
+            throw std::invalid_argument("blob chunk size must be positive");
+        int total = this->size();
+        std::vector<std::byte> buffer(std::min(chunk_size, total));
+        for (int offset = 0; offset < total; offset += chunk_size)
+        {
+            int count = std::min(chunk_size, total - offset);
+            this->read(buffer.data(), count, offset);
+            func(static_cast<const std::byte*>(buffer.data()), count);
+        }
+    }
+
+    // Points the stream at the same column of another row, which is much cheaper than opening a
+    // new blob_stream.
+    void reopen(std::int64_t rowid)
+    {
+        if (int error = sqlite3_blob_reopen(this->blob, rowid))
+            detail::throw_error(this->db, error);
+    }
+
+    sqlite3_blob* handle() const
+    {
+        return blob;
+    }
+
+private:
+    sqlite3* db;
+    sqlite3_blob* blob = nullptr;
+};
+
+// A std::streambuf over a blob_stream that buffers at most one chunk, opened either for input or
+// for output. Writes cannot grow the blob past its size.
+class blob_streambuf : public std::streambuf
+{
+public:
+    static constexpr std::size_t default_chunk_size = 64 * 1024;
+
+    blob_streambuf(const blob_stream& blob, std::ios_base::openmode mode, std::size_t chunk_size = default_chunk_size)
+        : blob(blob)
+        , mode(mode)
+        , buffer(chunk_size)
+    {
+        if (this->mode & std::ios_base::out)
+            this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+
+    ~blob_streambuf() override
+    {
+        try
+        {
+            this->flush();
+        }
+        catch (...)
+        {
+        }
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (!(this->mode & std::ios_base::in))
+            return traits_type::eof();
+
+        int count = std::min(static_cast<int>(this->buffer.size()), this->blob.size() - this->position);
+        if (count <= 0)
+            return traits_type::eof();
+
+        this->blob.read(this->buffer.data(), count, this->position);
+        this->position += count;
+        this->setg(this->buffer.data(), this->buffer.data(), this->buffer.data() + count);
+        return traits_type::to_int_type(this->buffer[0]);
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (!(this->mode & std::ios_base::out) || !this->flush())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *this->pptr() = traits_type::to_char_type(c);
+            this->pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        return this->flush() ? 0 : -1;
+    }
+
+    pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+        off_type current = this->position;
+        if (this->mode & std::ios_base::in)
+            current -= this->egptr() - this->gptr();
+        else
+            current += this->pptr() - this->pbase();
+
+        if (dir == std::ios_base::cur)
+            offset += current;
+        else if (dir == std::ios_base::end)
+            offset += this->blob.size();
+        return this->seekpos(offset, this->mode);
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode) override
+    {
+        if (position < 0 || position > this->blob.size() || !this->flush())
+            return pos_type(off_type(-1));
+
+        this->position = static_cast<int>(position);
+        this->setg(nullptr, nullptr, nullptr);
+        return position;
+    }
+
+private:
+    bool flush()
+    {
+        if (!(this->mode & std::ios_base::out))
+            return true;
+
+        int count = static_cast<int>(this->pptr() - this->pbase());
+        if (count == 0)
+            return true;
+
+        // Writes what fits before the end of the blob and fails if anything is left over.
+        int fits = std::min(count, this->blob.size() - this->position);
+        if (fits > 0)
+            this->blob.write(this->pbase(), fits, this->position);
+        this->position += std::max(fits, 0);
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+        return fits == count;
+    }
+
+    const blob_stream& blob;
+    std::ios_base::openmode mode;
+    std::vector<char> buffer;
+    int position = 0;
+};
+
+class blob_istream : public std::istream
+{
+public:
+    explicit blob_istream(const blob_stream& blob, std::size_t chunk_size = blob_streambuf::default_chunk_size)
+        : std::istream(nullptr)
+        , buffer(blob, std::ios_base::in, chunk_size)
+    {
+        this->rdbuf(&this->buffer);
+    }
+
+private:
+    blob_streambuf buffer;
+};
+
+class blob_ostream : public std::ostream
+{
+public:
+    explicit blob_ostream(const blob_stream& blob, std::size_t chunk_size = blob_streambuf::default_chunk_size)
+        : std::ostream(nullptr)
+        , buffer(blob, std::ios_base::out, chunk_size)
+    {
+        this->rdbuf(&this->buffer);
+    }
+
+private:
+    blob_streambuf buffer;
+};
+
+// One writer and N reader connections to the same database file, for sharing a database between
+// threads. Every connection is opened with openflags::nomutex and has its own statement cache, so a
+// connection must only be used through the lease that checked it out. Readers are handed out from
+// a lock-free queue; the writer is handed out to one thread at a time, in the order they asked.
+class connection_pool
+{
+public:
+    class lease
+    {
+    public:
+        lease(const lease&) = delete;
+
+        lease(lease&& other) noexcept
+            : pool(other.pool)
+            , db(other.db)
+        {
+            other.db = nullptr;
+        }
+
+        ~lease()
+        {
+            if (this->db)
+                this->pool->release(this->db);
+        }
+
+        lease& operator=(const lease&) = delete;
+
+        database& operator*() const noexcept
+        {
+            return *this->db;
+        }
+
+        database* operator->() const noexcept
+        {
+            return this->db;
+        }
+
+        bool is_writer() const noexcept
+        {
+            return this->db == &this->pool->writer_db;
+        }
+
+    private:
+        friend class connection_pool;
+
+        lease(connection_pool* pool, database* db) noexcept
+            : pool(pool)
+            , db(db)
+        {}
+
+        connection_pool* pool;
+        database* db;
+    };
+
+    // A statement together with the lease of the connection it was prepared on.
+    class pooled_statement
+    {
+    public:
+        statement& operator*() noexcept
+        {
+            return this->stmt;
+        }
+
+        statement* operator->() noexcept
+        {
+            return &this->stmt;
+        }
+
+        database& connection() const noexcept
+        {
+            return *this->conn;
+        }
+
+    private:
+        friend class connection_pool;
+
+        pooled_statement(lease&& conn, statement&& stmt) noexcept
+            : conn(std::move(conn))
+            , stmt(std::move(stmt))
+        {}
+
+        lease conn;
+        statement stmt;
+    };
+
+    connection_pool(const std::string_view filename, std::size_t readers = default_reader_count())
+        : connection_pool(filename, database_options(), readers)
+    {}
+
+    // Opens every connection with options. The journal mode is always WAL and the open flags are
+    // chosen by the pool; the remaining settings apply to the writer and the readers alike.
+    connection_pool(const std::string_view filename, database_options options, std::size_t readers = default_reader_count())
+        : writer_db(filename, openflags::readwrite | openflags::create | openflags::nomutex, options.vfs_name())
+        , idle(readers)
+        , available(0)
+    {
+        if (readers == 0)
+            throw std::invalid_argument("connection pool needs at least one reader");
+        options.journal.reset();
+        this->writer_db.configure(options);
+        if (!detail::iequals(this->writer_db.pragma("journal_mode", "wal"), "wal"))
+            throw std::invalid_argument("connection pool requires a database that supports WAL mode");
+
+        this->reader_dbs.reserve(readers);
+        for (std::size_t i = 0; i < readers; i++)
+        {
+            auto& reader = this->reader_dbs.emplace_back(filename, openflags::readonly | openflags::nomutex, options.vfs_name());
+            reader.configure(options);
+            this->idle.try_push(&reader);
+        }
+        this->available.release(readers);
+    }
+
+    connection_pool(const connection_pool&) = delete;
+    connection_pool& operator=(const connection_pool&) = delete;
+
+    // Checks out a reader connection, waiting until one is available.
+    lease reader()
+    {
+        this->available.acquire();
+        return lease(this, this->pop_reader());
+    }
+
+    std::optional<lease> try_reader()
+    {
+        if (!this->available.try_acquire())
+            return {};
+        return lease(this, this->pop_reader());
+    }
+
+    // Checks out the writer connection, waiting for the threads that asked for it first.
+    lease writer()
+    {
+        auto ticket = this->next_ticket.fetch_add(1, std::memory_order_relaxed);
+        for (auto serving = this->now_serving.load(std::memory_order_acquire); serving != ticket;
+             serving = this->now_serving.load(std::memory_order_acquire))
+            this->now_serving.wait(serving, std::memory_order_acquire);
+        return lease(this, &this->writer_db);
+    }
+
+    // Prepares the statement on a reader if sqlite3_stmt_readonly says it does not write, and on
+    // the writer otherwise. Each SQL text is classified once, on the writer, so afterwards writes
+    // never wait for a reader; a thread holding the writer lease can't prepare new SQL here.
+    // Multi-statement transactions should check out the writer directly.
+    pooled_statement prepare(const std::string_view sql)
+    {
+        auto readonly = this->classification(sql);
+        if (!readonly)
+        {
+            auto conn = this->writer();
+            auto stmt = conn->prepare(sql);
+            readonly = sqlite3_stmt_readonly(stmt.handle()) != 0;
+            this->classify(sql, *readonly);
+            if (!*readonly)
+                return pooled_statement(std::move(conn), std::move(stmt));
+        }
+
+        auto conn = *readonly ? this->reader() : this->writer();
+        auto stmt = conn->prepare_cached(sql);
+        return pooled_statement(std::move(conn), std::move(stmt));
+    }
+
+    template <typename... Args>
+    pooled_statement execute(const std::string_view sql, Args&&... args)
+    {
+        auto stmt = this->prepare(sql);
+        stmt->bind_multiple(std::forward<Args>(args)...);
+        return stmt;
+    }
+
+    std::size_t reader_count() const noexcept
+    {
+        return this->reader_dbs.size();
+    }
+
+    static std::size_t default_reader_count() noexcept
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+private:
+    // The number of SQL texts whose classification is remembered before starting over.
+    static constexpr std::size_t classified_capacity = 1024;
+
+    std::optional<bool> classification(const std::string_view sql)
+    {
+        std::lock_guard<std::mutex> lock(this->classified_mutex);
+        if (auto it = this->readonly_sql.find(sql); it != this->readonly_sql.end())
+            return it->second;
+        return {};
+    }
+
+    void classify(const std::string_view sql, bool readonly)
+    {
+        std::lock_guard<std::mutex> lock(this->classified_mutex);
+        if (this->readonly_sql.contains(sql))
+            return;
+        if (this->readonly_sql.size() >= classified_capacity)
+        {
+            this->readonly_sql.clear();
+            this->classified_sql.clear();
+        }
+        this->readonly_sql.emplace(this->classified_sql.emplace_back(sql), readonly);
+    }
+
+    database* pop_reader()
+    {
+        database* db;
+        while (!this->idle.try_pop(db))
+            std::this_thread::yield();
+        return db;
+    }
+
+    void release(database* db) noexcept
+    {
+        if (db == &this->writer_db)
+        {
+            this->now_serving.fetch_add(1, std::memory_order_release);
+            this->now_serving.notify_all();
+        }
+        else
+        {
+            this->idle.try_push(db);
+            this->available.release();
+        }
+    }
+
+    database writer_db;
+    std::vector<database> reader_dbs;
+    detail::mpmc_queue<database*> idle;
+    std::counting_semaphore<> available;
+    std::atomic<std::size_t> next_ticket = 0;
+    std::atomic<std::size_t> now_serving = 0;
+    std::mutex classified_mutex;
+    // Owns the SQL texts the views in readonly_sql point into.
+    std::deque<std::string> classified_sql;
+    std::unordered_map<std::string_view, bool> readonly_sql;
+};
+
+namespace detail
+{
+// Arguments captured for deferred binding are stored by value, with string-like arguments copied
+// into a std::string so they outlive the caller's buffer.
+template <typename T>
+using owned_arg_t = std::conditional_t<std::is_convertible_v<T, std::string_view> && !std::is_same_v<std::decay_t<T>, std::string>,
+                                       std::string, std::decay_t<T>>;
+}  // namespace detail
+
+class async_database;
+
+// The awaitable returned by async_database. The job is queued on the connection's worker thread
+// when the awaitable is co_awaited, and the awaiting coroutine is resumed through the database's
+// resumer once it finishes.
+template <typename T>
+class async_result
+{
+public:
+    async_result(async_database* owner, std::function<T(database&)> job)
+        : owner(owner)
+        , job(std::move(job))
+    {}
+
+    constexpr bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    T await_resume()
+    {
+        if (this->error)
+            std::rethrow_exception(this->error);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(std::get<1>(this->value));
+    }
+
+private:
+    async_database* owner;
+    std::function<T(database&)> job;
+    std::variant<std::monostate, std::conditional_t<std::is_void_v<T>, std::monostate, T>> value;
+    std::exception_ptr error;
+};
+
+// Rows of a query fetched from the worker thread in batches. next() yields an empty batch once the
+// query is done. The statement is finalized on the worker thread.
+template <typename... Ts>
+class row_batches
+{
+    static_assert((detail::owning_column<Ts> && ...), "rows outlive the statement, so columns must not be views");
+
+public:
+    using batch = std::vector<std::tuple<Ts...>>;
+
+    row_batches(async_database* owner, std::size_t batch_size, std::function<statement(database&)> open)
+        : owner(owner)
+        , st(std::make_shared<state>(state { statement(), std::move(open), batch_size, false }))
+    {}
+
+    row_batches(const row_batches&) = delete;
+    row_batches(row_batches&&) noexcept = default;
+    row_batches& operator=(const row_batches&) = delete;
+
+    ~row_batches();
+
+    async_result<batch> next()
+    {
+        return async_result<batch>(this->owner, [st = this->st](database& db) {
+            batch rows;
+            if (st->done)
+                return rows;
+            if (!st->stmt.handle())
+                st->stmt = st->open(db);
+
+            rows.reserve(st->batch_size);
+            while (rows.size() < st->batch_size)
+            {
+                if (!st->stmt.step())
+                {
+                    st->done = true;
+                    st->stmt = statement();
+                    break;
+                }
+                rows.push_back(st->stmt.template get_all<Ts...>());
+            }
+            return rows;
+        });
+    }
+
+private:
+    struct state
+    {
+        statement stmt;
+        std::function<statement(database&)> open;
+        std::size_t batch_size;
+        bool done;
+    };
+
+    async_database* owner;
+    std::shared_ptr<state> st;
+};
+
+// A connection owned by a dedicated worker thread, with C++20 coroutine awaitables for executing
+// statements on it. Results are decoded with loader<T> on the worker thread and handed back as a
+// whole (or in batches for async_rows) so the caller is resumed once per batch rather than once
+// per row. By default the caller is resumed on the worker thread; an event loop should pass a
+// resumer that posts the handle back to the loop. Results must be awaited before the
+// async_database is destroyed.
+class async_database
+{
+public:
+    using resumer = std::function<void(std::coroutine_handle<>)>;
+
+    async_database(const std::string_view filename, openflags flags = openflags::readwrite | openflags::create,
+                   resumer resume = {})
+        : db(filename, flags)
+        , resume(std::move(resume))
+        , worker([this]() { this->run(); })
+    {}
+
+    async_database(const async_database&) = delete;
+    async_database& operator=(const async_database&) = delete;
+
+    ~async_database()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wakeup.notify_one();
+        this->worker.join();
+    }
+
+    // Runs func(database&) on the worker thread.
+    template <typename F>
+    async_result<std::invoke_result_t<F, database&>> async_run(F&& func)
+    {
+        return async_result<std::invoke_result_t<F, database&>>(this, std::forward<F>(func));
+    }
+
+    // Executes the statement to completion and yields the number of rows it changed.
+    template <typename... Args>
+    async_result<std::int64_t> async_execute(const std::string_view sql, Args&&... args)
+    {
+        return this->async_run([sql = std::string(sql), ... args = detail::owned_arg_t<Args>(std::forward<Args>(args))](database& db) {
+            statement stmt = db.execute_cached(sql, args...);
+            while (stmt.step())
+                ;
+            return static_cast<std::int64_t>(sqlite3_changes64(db.handle()));
+        });
+    }
+
+    // Executes the query and yields all of its rows.
+    template <typename... Ts, typename... Args>
+    async_result<std::vector<std::tuple<Ts...>>> async_query(const std::string_view sql, Args&&... args)
+    {
+        static_assert((detail::owning_column<Ts> && ...), "rows outlive the statement, so columns must not be views");
+
+        return this->async_run([sql = std::string(sql), ... args = detail::owned_arg_t<Args>(std::forward<Args>(args))](database& db) {
+            std::vector<std::tuple<Ts...>> rows;
+            statement stmt = db.execute_cached(sql, args...);
+            while (stmt.step())
+                rows.push_back(stmt.get_all<Ts...>());
+            return rows;
+        });
+    }
+
+    // Returns a generator of row batches of at most batch_size rows each.
+    template <typename... Ts, typename... Args>
+    row_batches<Ts...> async_rows(std::size_t batch_size, const std::string_view sql, Args&&... args)
+    {
+        return row_batches<Ts...>(this, batch_size,
+                                  [sql = std::string(sql), ... args = detail::owned_arg_t<Args>(std::forward<Args>(args))](database& db) {
+                                      return db.execute_cached(sql, args...);
+                                  });
+    }
+
+    // Queues a job on the worker thread.
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->jobs.push_back(std::move(job));
+        }
+        this->wakeup.notify_one();
+    }
+
+    void resume_caller(std::coroutine_handle<> handle)
+    {
+        if (this->resume)
+            this->resume(handle);
+        else
+            handle.resume();
+    }
+
+private:
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->wakeup.wait(lock, [this]() { return this->stopping || !this->jobs.empty(); });
+                if (this->jobs.empty())
+                    return;
+                job = std::move(this->jobs.front());
+                this->jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    template <typename T>
+    friend class async_result;
+
+    database db;
+    resumer resume;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+    std::thread worker;
+};
+
+template <typename T>
+void async_result<T>::await_suspend(std::coroutine_handle<> handle)
+{
+    this->owner->post([this, handle]() {
+        try
+        {
+            if constexpr (std::is_void_v<T>)
+                this->job(this->owner->db);
+            else
+                this->value.template emplace<1>(this->job(this->owner->db));
+        }
+        catch (...)
+        {
+            this->error = std::current_exception();
+        }
+        this->owner->resume_caller(handle);
+    });
+}
+
+template <typename... Ts>
+row_batches<Ts...>::~row_batches()
+{
+    if (this->st)
+        this->owner->post([st = std::move(this->st)]() mutable { st.reset(); });
+}
+
+struct group_commit_options
+{
+    // The most jobs committed in one transaction.
+    std::size_t max_batch_size = 256;
+    // How long the first job of a batch may wait for more jobs to arrive.
+    std::chrono::microseconds max_latency = std::chrono::milliseconds(2);
+};
+
+// Collects small independent write jobs from many threads and runs them in batches on a worker
+// thread, one transaction per batch, so that the whole batch shares one commit. Every job runs in
+// its own nested savepoint: a job that throws is rolled back and its future gets the exception,
+// while the rest of the batch still commits. Futures are fulfilled after the commit.
+class group_commit_writer
+{
+public:
+    using job = std::function<void(database&)>;
+
+    explicit group_commit_writer(database&& db, group_commit_options options = {})
+        : db(std::move(db))
+        , options(options)
+        , worker([this]() { this->run(); })
+    {}
+
+    explicit group_commit_writer(const std::string_view filename, group_commit_options options = {})
+        : group_commit_writer(database(filename), options)
+    {}
+
+    group_commit_writer(const group_commit_writer&) = delete;
+    group_commit_writer& operator=(const group_commit_writer&) = delete;
+
+    // Commits the jobs that are still queued before returning.
+    ~group_commit_writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wakeup.notify_one();
+        this->worker.join();
+    }
+
+    std::future<void> submit(job work)
+    {
+        std::future<void> result;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto& p = this->queue.emplace_back(pending { std::move(work), {}, std::chrono::steady_clock::now() });
+            result = p.done.get_future();
+        }
+        this->wakeup.notify_one();
+        return result;
+    }
+
+    template <typename... Args>
+    std::future<void> execute(const std::string_view sql, Args&&... args)
+    {
+        return this->submit([sql = std::string(sql), ... args = detail::owned_arg_t<Args>(std::forward<Args>(args))](database& db) {
+            statement stmt = db.execute_cached(sql, args...);
+            while (stmt.step())
+                ;
+        });
+    }
+
+private:
+    struct pending
+    {
+        job work;
+        std::promise<void> done;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void run()
+    {
+        std::vector<pending> batch;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->wakeup.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+                if (this->queue.empty())
+                    return;
+
+                auto deadline = this->queue.front().queued + this->options.max_latency;
+                this->wakeup.wait_until(lock, deadline, [this]() {
+                    return this->stopping || this->queue.size() >= this->options.max_batch_size;
+                });
+
+                auto count = std::min(this->queue.size(), this->options.max_batch_size);
+                std::move(this->queue.begin(), this->queue.begin() + count, std::back_inserter(batch));
+                this->queue.erase(this->queue.begin(), this->queue.begin() + count);
+            }
+
+            this->commit(batch);
+            batch.clear();
+        }
+    }
+
+    void commit(std::vector<pending>& batch)
+    {
+        std::vector<pending*> succeeded;
+        try
+        {
+            this->db.atomic(transaction_mode::immediate, [&]() {
+                for (auto& p : batch)
+                {
+                    try
+                    {
+                        this->db.atomic([&]() { p.work(this->db); });
+                        succeeded.push_back(&p);
+                    }
+                    catch (...)
+                    {
+                        p.done.set_exception(std::current_exception());
+                    }
+                }
+            });
+        }
+        catch (...)
+        {
+            for (auto p : succeeded)
+                p->done.set_exception(std::current_exception());
+            return;
+        }
+
+        for (auto p : succeeded)
+            p->done.set_value();
+    }
+
+    database db;
+    group_commit_options options;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<pending> queue;
+    bool stopping = false;
+    std::thread worker;
+};
+
+struct checkpoint_options
+{
+    // Checkpoint once this many WAL frames have not been copied back into the database yet.
+    int passive_frames = 1000;
+    // Escalate to a RESTART checkpoint, which waits for readers so the next writer can start
+    // the WAL over, once this many frames are pending.
+    int restart_frames = 8000;
+    // Escalate to a TRUNCATE checkpoint, which also truncates the WAL file.
+    int truncate_frames = 32000;
+    // A checkpoint is run only after no transaction has committed for this long...
+    std::chrono::milliseconds idle_time = std::chrono::milliseconds(20);
+    // ...unless checkpointing has already been postponed this long.
+    std::chrono::milliseconds max_delay = std::chrono::milliseconds(1000);
+    // How long RESTART and TRUNCATE checkpoints wait for readers and writers.
+    std::chrono::milliseconds busy_timeout = std::chrono::milliseconds(100);
+};
+
+struct checkpoint_stats
+{
+    std::uint64_t checkpoints = 0;
+    // Checkpoints that could not copy every frame, because of readers or a concurrent writer.
+    std::uint64_t incomplete = 0;
+    std::uint64_t frames_checkpointed = 0;
+    std::chrono::nanoseconds total_time {};
+    std::chrono::nanoseconds max_time {};
+    // Frames in the WAL at the last commit.
+    int wal_frames = 0;
+};
+
+// Takes WAL checkpoints off the commit path. Attaching turns the connection's autocheckpoint off
+// and installs an on_wal_commit listener that only records the size of the WAL; a background
+// thread checkpoints through its own connection once the WAL has
+// grown and writers have gone idle, escalating from PASSIVE to RESTART and TRUNCATE as the WAL
+// keeps growing. Detaching restores the connection's previous autocheckpoint.
+class checkpoint_scheduler
+{
+public:
+    checkpoint_scheduler(database& db, checkpoint_options options = {})
+        : target(&db)
+        , options(options)
+        , background(background_connection(db.handle()))
+    {
+        this->attach();
+    }
+
+    // Attaches to the pool's writer connection.
+    checkpoint_scheduler(connection_pool& pool, checkpoint_options options = {})
+        : pool(&pool)
+        , target(&*pool.writer())
+        , options(options)
+        , background(background_connection(this->target->handle()))
+    {
+        auto writer = pool.writer();
+        this->attach();
+    }
+
+    checkpoint_scheduler(const checkpoint_scheduler&) = delete;
+    checkpoint_scheduler& operator=(const checkpoint_scheduler&) = delete;
+
+    ~checkpoint_scheduler()
+    {
+        {
+            auto writer = this->pool ? std::optional<connection_pool::lease>(this->pool->writer()) : std::nullopt;
+            this->target->remove_hook(this->hook);
+            this->target->set_wal_autocheckpoint(this->autocheckpoint);
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wakeup.notify_one();
+        this->worker.join();
+    }
+
+    checkpoint_stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->counters;
+    }
+
+private:
+    static database background_connection(sqlite3* db)
+    {
+        const char* filename = sqlite3_db_filename(db, "main");
+        if (!filename || !*filename)
+            throw std::invalid_argument("checkpoint_scheduler requires a database file");
+        database result(filename, openflags::readwrite | openflags::nomutex);
+        // Reading the journal mode also opens the WAL, without which checkpoints do nothing.
+        if (!detail::iequals(result.pragma("journal_mode"), "wal"))
+            throw std::invalid_argument("checkpoint_scheduler requires a database in WAL mode");
+        return result;
+    }
+
+    void attach()
+    {
+        this->autocheckpoint = this->target->wal_autocheckpoint();
+        this->hook = this->target->on_wal_commit([this](std::string_view, int frames) { this->committed(frames); });
+        this->target->set_wal_autocheckpoint(0);
+        this->worker = std::thread([this]() { this->run(); });
+    }
+
+    void committed(int frames)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto now = std::chrono::steady_clock::now();
+            // The WAL starts over from the beginning once it has been checkpointed completely.
+            if (frames < this->backfilled)
+                this->backfilled = 0;
+            if (frames - this->backfilled >= this->options.passive_frames && this->pending_since == decltype(now)())
+                this->pending_since = now;
+            this->counters.wal_frames = frames;
+            this->last_commit = now;
+        }
+        this->wakeup.notify_one();
+    }
+
+    int pending() const noexcept
+    {
+        return this->counters.wal_frames - this->backfilled;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        for (;;)
+        {
+            this->wakeup.wait(lock, [this]() { return this->stopping || this->pending() >= this->options.passive_frames; });
+            if (this->stopping)
+                return;
+
+            // Wait for writers to go quiet, but not indefinitely.
+            auto deadline = this->pending_since + this->options.max_delay;
+            for (;;)
+            {
+                auto idle_at = this->last_commit + this->options.idle_time;
+                auto now = std::chrono::steady_clock::now();
+                if (this->stopping || now >= idle_at || now >= deadline)
+                    break;
+                this->wakeup.wait_until(lock, std::min(idle_at, deadline));
+            }
+            if (this->stopping)
+                return;
+
+            int frames = this->pending();
+            int mode = frames >= this->options.truncate_frames  ? SQLITE_CHECKPOINT_TRUNCATE
+                       : frames >= this->options.restart_frames ? SQLITE_CHECKPOINT_RESTART
+                                                                : SQLITE_CHECKPOINT_PASSIVE;
+            lock.unlock();
+            int log = 0, checkpointed = 0;
+            auto start = std::chrono::steady_clock::now();
+            sqlite3_busy_timeout(this->background.handle(),
+                                 mode == SQLITE_CHECKPOINT_PASSIVE ? 0 : static_cast<int>(this->options.busy_timeout.count()));
+            int result = sqlite3_wal_checkpoint_v2(this->background.handle(), nullptr, mode, &log, &checkpointed);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            lock.lock();
+
+            this->counters.checkpoints++;
+            this->counters.total_time += elapsed;
+            this->counters.max_time = std::max<std::chrono::nanoseconds>(this->counters.max_time, elapsed);
+            if (result == SQLITE_OK && log >= 0)
+            {
+                // A successful TRUNCATE empties the WAL and reports zero for both counts.
+                bool truncated = mode == SQLITE_CHECKPOINT_TRUNCATE;
+                this->counters.frames_checkpointed += truncated ? frames : std::max(0, checkpointed - this->backfilled);
+                this->backfilled = checkpointed;
+                if (truncated)
+                    this->counters.wal_frames = 0;
+                if (checkpointed < log)
+                    this->counters.incomplete++;
+            }
+            else
+                this->counters.incomplete++;
+            this->pending_since = {};
+
+            // Don't retry a checkpoint that made no difference until the next commit or idle time.
+            if (this->pending() >= this->options.passive_frames)
+            {
+                this->pending_since = std::chrono::steady_clock::now();
+                auto commits = this->last_commit;
+                this->wakeup.wait_for(lock, this->options.idle_time,
+                                      [&]() { return this->stopping || this->last_commit != commits; });
+            }
+        }
+    }
+
+    connection_pool* pool = nullptr;
+    database* target;
+    checkpoint_options options;
+    database background;
+    int autocheckpoint = 0;
+    database::hook_id hook = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    checkpoint_stats counters;
+    int backfilled = 0;
+    std::chrono::steady_clock::time_point last_commit;
+    std::chrono::steady_clock::time_point pending_since;
+    bool stopping = false;
+    std::thread worker;
+};
+
+namespace detail
+{
+template <typename T>
+struct is_blob : std::false_type
+{};
+
+template <typename T>
+struct is_blob<blob<T>> : std::true_type
+{};
+
+// Appends a bound value to a query_cache key, tagged with its storage class so that values of
+// different types never produce the same bytes.
+template <typename T>
+void append_key(std::string& key, const T& value)
+{
+    auto append_bytes = [&](char tag, const void* data, std::size_t size) {
+        key += tag;
+        std::uint64_t length = size;
+        key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        key.append(static_cast<const char*>(data), size);
+    };
+    if constexpr (is_optional<T>::value)
+    {
+        if (value)
+            append_key(key, *value);
+        else
+            key += 'n';
+    }
+    else if constexpr (std::is_same_v<T, std::nullptr_t>)
+        key += 'n';
+    else if constexpr (std::is_integral_v<T>)
+    {
+        auto integer = static_cast<std::int64_t>(value);
+        key += 'i';
+        key.append(reinterpret_cast<const char*>(&integer), sizeof(integer));
+    }
+    else if constexpr (std::is_floating_point_v<T>)
+    {
+        auto real = static_cast<double>(value);
+        key += 'f';
+        key.append(reinterpret_cast<const char*>(&real), sizeof(real));
+    }
+    else if constexpr (std::is_convertible_v<const T&, std::string_view>)
+    {
+        std::string_view text(value);
+        append_bytes('s', text.data(), text.size());
+    }
+    else if constexpr (is_blob<T>::value)
+    {
+        using element = std::remove_const_t<std::remove_pointer_t<decltype(value.data)>>;
+        if constexpr (std::is_void_v<element>)
+            append_bytes('b', value.data, value.size);
+        else
+            append_bytes('b', value.data, value.size * sizeof(element));
+    }
+    else
+        append_bytes('b', std::ranges::data(value), std::ranges::size(value) * sizeof(std::ranges::range_value_t<T>));
+}
+
+// Collects the names of the tables a statement reads, through an authorizer installed while it
+// is prepared, which defers to the database's own authorizer and is then replaced by it again.
+// SQLite does not always report the schema of a read, so tables are identified by name alone.
+// Returns false if the statement writes, or reads a table whose changes are not reported by
+// sqlite3_update_hook: a WITHOUT ROWID or virtual table.
+inline bool read_tables(const database& source, const std::string_view sql, std::vector<std::string>& tables)
+{
+    struct collecting
+    {
+        std::vector<std::string>& names;
+        hook_dispatcher* hooks;
+    } context { tables, source.hooks.get() };
+
+    auto collect = [](void* context, int action, const char* table, const char* column, const char* schema,
+                      const char* trigger) noexcept {
+        auto& state = *static_cast<collecting*>(context);
+        if (state.hooks && state.hooks->authorize)
+        {
+            int decision = SQLITE_DENY;
+            try
+            {
+                decision = state.hooks->authorize(action, table, column, schema, trigger);
+            }
+            catch (...)
+            {
+            }
+            if (decision != SQLITE_OK)
+                return decision;
+        }
+        if (action == SQLITE_READ && table)
+        {
+            if (std::find(state.names.begin(), state.names.end(), table) == state.names.end())
+                state.names.emplace_back(table);
+        }
+        return SQLITE_OK;
+    };
+    sqlite3* db = source.handle();
+    sqlite3_set_authorizer(db, collect, &context);
+    sqlite3_stmt* stmt = nullptr;
+    int error = sqlite3_prepare_v2(db, sql.data(), static_cast<int>(sql.size()), &stmt, nullptr);
+    if (context.hooks)
+        context.hooks->install_authorizer();
+    else
+        sqlite3_set_authorizer(db, nullptr, nullptr);
+    bool readonly = stmt && sqlite3_stmt_readonly(stmt);
+    sqlite3_finalize(stmt);
+    if (error)
+        throw_error(db, error);
+    if (!readonly)
+        return false;
+
+    sqlite3_stmt* check = nullptr;
+    error = sqlite3_prepare_v2(db, "select 1 from pragma_table_list where name = ?1 and (type = 'virtual' or wr)", -1,
+                               &check, nullptr);
+    if (error)
+        throw_error(db, error);
+    bool supported = true;
+    for (const auto& name : tables)
+    {
+        sqlite3_bind_text(check, 1, name.c_str(), static_cast<int>(name.size()), SQLITE_STATIC);
+        supported = supported && sqlite3_step(check) == SQLITE_DONE;
+        sqlite3_reset(check);
+    }
+    sqlite3_finalize(check);
+    return supported;
+}
+}  // namespace detail
+
+struct query_cache_options
+{
+    // The number of independently locked partitions; rounded up to a power of two.
+    std::size_t shards = 16;
+    std::size_t max_entries_per_shard = 1024;
+};
+
+// Caches the materialized results of read-only queries, keyed by their database file, SQL and
+// bound values. Entries are invalidated per table: attach the cache to every connection that
+// writes to the database and it bumps a generation counter for each table name those connections
+// change, both when the transaction commits and at the end of the committing statement, once the
+// commit is visible to readers. A lookup only hits if none of the tables the query read has
+// changed since.
+//
+// Each shard publishes an immutable map through an atomic shared_ptr, so lookups never take a
+// lock and scale across cores; inserts copy the shard's map. Queries that call non-deterministic
+// functions such as random() should not be cached. The cache must be destroyed, or detached,
+// before the databases it is attached to.
+class query_cache
+{
+public:
+    explicit query_cache(query_cache_options options = {})
+        : shards(std::bit_ceil(std::max<std::size_t>(options.shards, 1)))
+        , max_entries(std::max<std::size_t>(options.max_entries_per_shard, 1))
+    {
+        for (auto& s : this->shards)
+            s.entries.store(std::make_shared<const entry_map>());
+    }
+
+    query_cache(const query_cache&) = delete;
+    query_cache& operator=(const query_cache&) = delete;
+
+    ~query_cache()
+    {
+        while (!this->attachments.empty())
+            this->detach(*this->attachments.front()->db);
+    }
+
+    // Invalidates entries when db changes a table. Attach every connection that writes.
+    void attach(database& db)
+    {
+        auto a = std::make_unique<attachment>();
+        a->db = &db;
+        auto raw = a.get();
+        a->hooks[0] = db.on_update([raw](int, std::string_view, std::string_view table, std::int64_t) {
+            if (std::find(raw->pending.begin(), raw->pending.end(), table) == raw->pending.end())
+                raw->pending.emplace_back(table);
+        });
+        a->hooks[1] = db.on_commit([this, raw]() {
+            // A commit that failed with SQLITE_BUSY is retried with the same changes.
+            for (auto& table : raw->pending)
+            {
+                if (std::find(raw->committed.begin(), raw->committed.end(), table) == raw->committed.end())
+                    raw->committed.push_back(std::move(table));
+            }
+            raw->pending.clear();
+            this->bump(raw->committed);
+            return false;
+        });
+        a->hooks[2] = db.on_rollback([raw]() {
+            raw->pending.clear();
+            raw->committed.clear();
+        });
+        // The commit hook runs before the commit is visible: readers on other connections may
+        // start in between and cache the old rows under the new generation.
+        auto handle = db.handle();
+        a->hooks[3] = db.on_trace(SQLITE_TRACE_PROFILE, [this, raw, handle](unsigned int, void*, void*) {
+            if (raw->committed.empty() || sqlite3_txn_state(handle, nullptr) == SQLITE_TXN_WRITE)
+                return;
+            this->bump(raw->committed);
+            raw->committed.clear();
+        });
+        std::lock_guard<std::mutex> lock(this->attach_mutex);
+        this->attachments.push_back(std::move(a));
+    }
+
+    void attach(connection_pool& pool)
+    {
+        this->attach(*pool.writer());
+    }
+
+    void detach(database& db)
+    {
+        std::lock_guard<std::mutex> lock(this->attach_mutex);
+        std::erase_if(this->attachments, [&](const std::unique_ptr<attachment>& a) {
+            if (a->db != &db)
+                return false;
+            for (auto id : a->hooks)
+                db.remove_hook(id);
+            return true;
+        });
+    }
+
+    // Returns the rows of the query, running it on db if there is no valid cached result. The
+    // column types must own their data.
+    template <typename... Ts, typename... Args>
+    std::shared_ptr<const std::vector<std::tuple<Ts...>>> rows(const database& db, const std::string_view sql,
+                                                               const Args&... args)
+    {
+        static_assert(!(detail::is_view_column<Ts>::value || ...), "cached rows can't hold views into a statement");
+        return this->lookup<std::vector<std::tuple<Ts...>>>(db, sql, [&](const statement& stmt) {
+            std::vector<std::tuple<Ts...>> result;
+            while (stmt.step())
+                result.push_back(stmt.get_all<Ts...>());
+            return result;
+        }, args...);
+    }
+
+    // Like rows, but materializes the result as a column_batch.
+    template <typename... Ts, typename... Args>
+    std::shared_ptr<const column_batch<Ts...>> columns(const database& db, const std::string_view sql, const Args&... args)
+    {
+        return this->lookup<column_batch<Ts...>>(db, sql, [&](const statement& stmt) {
+            column_batch<Ts...> batch;
+            while (stmt.fetch_columns(batch, 1024) == 1024)
+                ;
+            return batch;
+        }, args...);
+    }
+
+    // Invalidates every entry that read a table of that name, in any schema.
+    void invalidate(const std::string_view table)
+    {
+        this->bump({ std::string(table) });
+    }
+
+    void clear()
+    {
+        for (auto& s : this->shards)
+        {
+            std::lock_guard<std::mutex> lock(s.write);
+            s.entries.store(std::make_shared<const entry_map>());
+        }
+    }
+
+    cache_stats stats() const
+    {
+        std::size_t size = 0;
+        for (const auto& s : this->shards)
+            size += s.entries.load()->size();
+        return { this->hits.load(std::memory_order_relaxed), this->misses.load(std::memory_order_relaxed), size,
+                 this->shards.size() * this->max_entries };
+    }
+
+private:
+    using generation = std::atomic<std::uint64_t>;
+
+    // The number of SQL texts whose tables are remembered before starting over.
+    static constexpr std::size_t max_queries = 4096;
+
+    struct entry
+    {
+        std::shared_ptr<const void> value;
+        std::vector<std::pair<const generation*, std::uint64_t>> reads;
+
+        bool valid() const noexcept
+        {
+            return std::all_of(this->reads.begin(), this->reads.end(),
+                               [](const auto& read) { return read.first->load(std::memory_order_acquire) == read.second; });
+        }
+    };
+
+    using entry_map = std::unordered_map<std::string, std::shared_ptr<const entry>>;
+
+    struct shard
+    {
+        std::atomic<std::shared_ptr<const entry_map>> entries;
+        std::mutex write;
+    };
+
+    // The tables read by a query, found once per SQL text.
+    struct query_info
+    {
+        bool cacheable;
+        std::vector<const generation*> tables;
+    };
+
+    struct attachment
+    {
+        database* db;
+        std::array<database::hook_id, 4> hooks;
+        std::vector<std::string> pending;
+        std::vector<std::string> committed;
+    };
+
+    template <typename Result, typename Run, typename... Args>
+    std::shared_ptr<const Result> lookup(const database& db, const std::string_view sql, Run&& run, const Args&... args)
+    {
+        std::string key(typeid(Result).name());
+        key += '\0';
+        // Connections to the same file share entries; in-memory databases are told apart by
+        // connection.
+        if (auto file = sqlite3_db_filename(db.handle(), "main"); file && *file)
+            key += file;
+        else
+            key += std::to_string(reinterpret_cast<std::uintptr_t>(db.handle()));
+        key += '\0';
+        key += sql;
+        (detail::append_key(key, args), ...);
+
+        auto& s = this->shards[std::hash<std::string> {}(key) & (this->shards.size() - 1)];
+        auto snapshot = s.entries.load(std::memory_order_acquire);
+        if (auto it = snapshot->find(key); it != snapshot->end() && it->second->valid())
+        {
+            this->hits.fetch_add(1, std::memory_order_relaxed);
+            return std::static_pointer_cast<const Result>(it->second->value);
+        }
+        this->misses.fetch_add(1, std::memory_order_relaxed);
+
+        auto info = this->info(db, sql);
+        // Read the generations before running the query, so a concurrent commit leaves the entry
+        // stale rather than valid with old rows.
+        auto e = std::make_shared<entry>();
+        for (auto table : info.tables)
+            e->reads.emplace_back(table, table->load(std::memory_order_acquire));
+
+        statement stmt = db.prepare_cached(sql);
+        stmt.bind_multiple(args...);
+        auto result = std::make_shared<const Result>(run(stmt));
+        if (!info.cacheable)
+            return result;
+        e->value = result;
+
+        std::lock_guard<std::mutex> lock(s.write);
+        auto updated = std::make_shared<entry_map>();
+        auto current = s.entries.load(std::memory_order_acquire);
+        updated->reserve(current->size() + 1);
+        for (const auto& [k, v] : *current)
+        {
+            if (v->valid() && updated->size() + 1 < this->max_entries)
+                updated->emplace(k, v);
+        }
+        (*updated)[std::move(key)] = std::move(e);
+        s.entries.store(std::move(updated), std::memory_order_release);
+        return result;
+    }
+
+    // Returned by value, since queries is cleared when it fills up.
+    query_info info(const database& db, const std::string_view sql)
+    {
+        std::string key(sql);
+        {
+            std::lock_guard<std::mutex> lock(this->tables_mutex);
+            if (auto it = this->queries.find(key); it != this->queries.end())
+                return it->second;
+        }
+
+        // Prepared without holding tables_mutex: the commit hooks take it while the connection's
+        // own mutex is held.
+        std::vector<std::string> names;
+        query_info info { detail::read_tables(db, sql, names), {} };
+        std::lock_guard<std::mutex> lock(this->tables_mutex);
+        for (auto& name : names)
+            info.tables.push_back(&this->table_generation(name));
+        if (this->queries.size() >= max_queries)
+            this->queries.clear();
+        return this->queries.try_emplace(std::move(key), std::move(info)).first->second;
+    }
+
+    // Requires tables_mutex.
+    generation& table_generation(const std::string& name)
+    {
+        auto [it, inserted] = this->table_index.try_emplace(name, this->generations.size());
+        if (inserted)
+            this->generations.emplace_back(0);
+        return this->generations[it->second];
+    }
+
+    void bump(const std::vector<std::string>& tables)
+    {
+        if (tables.empty())
+            return;
+        std::lock_guard<std::mutex> lock(this->tables_mutex);
+        for (const auto& name : tables)
+            this->table_generation(name).fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    std::vector<shard> shards;
+    std::size_t max_entries;
+    std::atomic<std::size_t> hits = 0;
+    std::atomic<std::size_t> misses = 0;
+
+    std::mutex tables_mutex;
+    std::unordered_map<std::string, query_info> queries;
+    std::unordered_map<std::string, std::size_t> table_index;
+    // A deque, so the counters entries point to never move.
+    std::deque<generation> generations;
+
+    std::mutex attach_mutex;
+    std::vector<std::unique_ptr<attachment>> attachments;
+};
+
+struct parallel_scan_options
+{
+    // The number of rowid ranges to split the table into. 0 means four per reader, so a thread
+    // that finishes a sparse range early steals another instead of idling.
+    std::size_t partitions = 0;
+    // The table whose rowids the statement's two parameters bound. If empty, the statement must
+    // read exactly one table, which is used.
+    std::string table;
+};
+
+namespace detail
+{
+// Hands out partition indices to a fixed set of workers. Each worker takes from the front of its
+// own queue and, once that is empty, from the back of the others'.
+class partition_queues
+{
+public:
+    partition_queues(std::size_t partitions, std::size_t workers)
+        : queues(workers)
+    {
+        // Contiguous blocks, so each worker starts on neighbouring rowids.
+        for (std::size_t i = 0; i < partitions; i++)
+            this->queues[i * workers / partitions].items.push_back(i);
+    }
+
+    std::optional<std::size_t> next(std::size_t worker)
+    {
+        {
+            auto& own = this->queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.items.empty())
+            {
+                auto item = own.items.front();
+                own.items.pop_front();
+                return item;
+            }
+        }
+        for (std::size_t i = 1; i < this->queues.size(); i++)
+        {
+            auto& victim = this->queues[(worker + i) % this->queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.items.empty())
+            {
+                auto item = victim.items.back();
+                victim.items.pop_back();
+                return item;
+            }
+        }
+        return {};
+    }
+
+private:
+    struct queue
+    {
+        std::mutex mutex;
+        std::deque<std::size_t> items;
+    };
+
+    std::vector<queue> queues;
+};
+}  // namespace detail
+
+// Runs a query over a table in parallel on the pool's readers. The table's rowids, from MIN to
+// MAX, are split into equal-width ranges; sql must take the first and last rowid of a range as
+// its parameters ?1 and ?2, as in "select ... from t where rowid between ?1 and ?2". For each
+// range, scan(statement&) steps the bound statement and returns a partial result, and the
+// partial results are combined in rowid order with reduce(R, R) -> R. An empty table is scanned
+// once with an empty range, so scan returns its identity.
+//
+// Each reader runs its ranges in its own read transaction, so commits made during the scan may
+// be seen by some ranges and not others.
+template <typename F, typename Reduce>
+auto parallel_scan(connection_pool& pool, const std::string_view sql, const parallel_scan_options& options, F&& scan,
+                   Reduce&& reduce) -> std::invoke_result_t<F&, statement&>
+{
+    using result_type = std::invoke_result_t<F&, statement&>;
+
+    std::optional<std::int64_t> first, last;
+    {
+        auto reader = pool.reader();
+        auto table = options.table;
+        if (table.empty())
+        {
+            std::vector<std::string> tables;
+            detail::read_tables(*reader, sql, tables);
+            if (tables.size() != 1)
+                throw std::invalid_argument("parallel_scan needs the table to partition");
+            table = tables.front();
+        }
+        auto bounds = reader->prepare("select min(rowid), max(rowid) from " + detail::quote_identifier(table));
+        bounds.step();
+        first = bounds.get<0, std::optional<std::int64_t>>();
+        last = bounds.get<1, std::optional<std::int64_t>>();
+    }
+    if (!first)
+    {
+        auto reader = pool.reader();
+        auto stmt = reader->prepare_cached(sql);
+        stmt.bind_multiple(std::int64_t(1), std::int64_t(0));
+        return scan(stmt);
+    }
+
+    auto span = static_cast<std::uint64_t>(*last) - static_cast<std::uint64_t>(*first);
+    std::size_t partitions = options.partitions ? options.partitions : 4 * pool.reader_count();
+    partitions = static_cast<std::size_t>(std::min<std::uint64_t>(partitions, span + 1));
+    auto width = span / partitions + 1;
+    auto range = [&](std::size_t i) {
+        auto begin = static_cast<std::uint64_t>(*first) + i * width;
+        auto end = std::min(begin + (width - 1), static_cast<std::uint64_t>(*last));
+        return std::pair(static_cast<std::int64_t>(begin), static_cast<std::int64_t>(end));
+    };
+    // Rounding width up may leave nothing for the last partitions.
+    partitions = static_cast<std::size_t>(span / width + 1);
+
+    std::size_t workers = std::min(partitions, pool.reader_count());
+    detail::partition_queues queues(partitions, workers);
+    std::vector<std::optional<result_type>> results(partitions);
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&](std::size_t worker) {
+        try
+        {
+            auto reader = pool.reader();
+            auto stmt = reader->prepare_cached(sql);
+            while (!failed.load(std::memory_order_relaxed))
+            {
+                auto partition = queues.next(worker);
+                if (!partition)
+                    break;
+                auto [begin, end] = range(*partition);
+                stmt.reset();
+                stmt.bind_multiple(begin, end);
+                results[*partition].emplace(scan(stmt));
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (std::size_t i = 1; i < workers; i++)
+        threads.emplace_back(work, i);
+    work(0);
+    for (auto& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    result_type total = std::move(*results.front());
+    for (std::size_t i = 1; i < partitions; i++)
+        total = reduce(std::move(total), std::move(*results[i]));
+    return total;
+}
+
+template <typename F, typename Reduce>
+auto parallel_scan(connection_pool& pool, const std::string_view sql, std::size_t partitions, F&& scan, Reduce&& reduce)
+    -> std::invoke_result_t<F&, statement&>
+{
+    parallel_scan_options options;
+    options.partitions = partitions;
+    return parallel_scan(pool, sql, options, std::forward<F>(scan), std::forward<Reduce>(reduce));
+}
+
+// A VFS layered over another one, by default the process's default VFS. Opened files are
+// vfs::file objects, whose virtual functions forward to the file opened by the underlying VFS
+// unless a derived class overrides them; they return SQLite result codes, as the sqlite3_io_methods
+// they implement do. A VFS for another kind of storage overrides open, remove, access and
+// full_pathname, and returns files that override every operation. A vfs is registered with
+// install() and selected with database_options::vfs, and must outlive every connection using it.
+class vfs
+{
+public:
+    class file
+    {
+    public:
+        // A file that is not backed by the underlying VFS.
+        file() noexcept = default;
+
+        // Opens name with the underlying VFS, throwing if it fails.
+        file(sqlite3_vfs* base, const char* name, int flags, int* out_flags)
+            : storage(std::make_unique<std::byte[]>(base->szOsFile))
+        {
+            auto opened = reinterpret_cast<sqlite3_file*>(this->storage.get());
+            int error = base->xOpen(base, name, opened, flags, out_flags);
+            if (error)
+            {
+                // A failed xOpen may still set pMethods, and then wants xClose; the destructor
+                // does not run for a constructor that throws.
+                if (opened->pMethods)
+                    opened->pMethods->xClose(opened);
+                throw sqlite::error(error, sqlite3_errstr(error));
+            }
+            if (opened->pMethods)
+                this->base = opened;
+        }
+
+        file(const file&) = delete;
+        file& operator=(const file&) = delete;
+
+        virtual ~file()
+        {
+            if (this->base)
+                this->base->pMethods->xClose(this->base);
+        }
+
+        virtual int read(void* data, int size, sqlite3_int64 offset)
+        {
+            return this->base ? this->base->pMethods->xRead(this->base, data, size, offset) : SQLITE_IOERR_READ;
+        }
+
+        virtual int write(const void* data, int size, sqlite3_int64 offset)
+        {
+            return this->base ? this->base->pMethods->xWrite(this->base, data, size, offset) : SQLITE_IOERR_WRITE;
+        }
+
+        virtual int truncate(sqlite3_int64 size)
+        {
+            return this->base ? this->base->pMethods->xTruncate(this->base, size) : SQLITE_IOERR_TRUNCATE;
+        }
+
+        virtual int sync(int flags)
+        {
+            return this->base ? this->base->pMethods->xSync(this->base, flags) : SQLITE_OK;
+        }
+
+        virtual int file_size(sqlite3_int64& size)
+        {
+            return this->base ? this->base->pMethods->xFileSize(this->base, &size) : SQLITE_IOERR_FSTAT;
+        }
+
+        virtual int lock(int level)
+        {
+            return this->base ? this->base->pMethods->xLock(this->base, level) : SQLITE_OK;
+        }
+
+        virtual int unlock(int level)
+        {
+            return this->base ? this->base->pMethods->xUnlock(this->base, level) : SQLITE_OK;
+        }
+
+        virtual int check_reserved_lock(int& reserved)
+        {
+            if (this->base)
+                return this->base->pMethods->xCheckReservedLock(this->base, &reserved);
+            reserved = 0;
+            return SQLITE_OK;
+        }
+
+        virtual int file_control(int op, void* arg)
+        {
+            return this->base ? this->base->pMethods->xFileControl(this->base, op, arg) : SQLITE_NOTFOUND;
+        }
+
+        virtual int sector_size()
+        {
+            return this->base ? this->base->pMethods->xSectorSize(this->base) : 4096;
+        }
+
+        virtual int device_characteristics()
+        {
+            return this->base ? this->base->pMethods->xDeviceCharacteristics(this->base) : 0;
+        }
+
+        // The sqlite3_io_methods version the file supports: 2 adds shared memory, which WAL mode
+        // needs unless locking_mode is exclusive, and 3 adds memory-mapped reads.
+        virtual int io_version()
+        {
+            return this->base ? this->base->pMethods->iVersion : 1;
+        }
+
+        virtual int shm_map(int region, int size, bool extend, void volatile** memory)
+        {
+            return this->base->pMethods->xShmMap(this->base, region, size, extend, memory);
+        }
+
+        virtual int shm_lock(int offset, int count, int flags)
+        {
+            return this->base->pMethods->xShmLock(this->base, offset, count, flags);
+        }
+
+        virtual void shm_barrier()
+        {
+            this->base->pMethods->xShmBarrier(this->base);
+        }
+
+        virtual int shm_unmap(bool remove)
+        {
+            return this->base->pMethods->xShmUnmap(this->base, remove);
+        }
+
+        virtual int fetch(sqlite3_int64 offset, int size, void** data)
+        {
+            return this->base->pMethods->xFetch(this->base, offset, size, data);
+        }
+
+        virtual int unfetch(sqlite3_int64 offset, void* data)
+        {
+            return this->base->pMethods->xUnfetch(this->base, offset, data);
+        }
+
+    protected:
+        // The file opened by the underlying VFS, or null.
+        sqlite3_file* base = nullptr;
+
+    private:
+        std::unique_ptr<std::byte[]> storage;
+    };
+
+    // Throws if there is no VFS called base, or no default VFS when base is null.
+    explicit vfs(std::string name, const char* base = nullptr)
+        : base(sqlite3_vfs_find(base))
+        , registered_name(std::move(name))
+    {
+        if (!this->base)
+            throw std::invalid_argument("no such VFS");
+        this->info.iVersion = 2;
+        this->info.szOsFile = sizeof(handle);
+        this->info.mxPathname = this->base->mxPathname;
+        this->info.zName = this->registered_name.c_str();
+        this->info.pAppData = this;
+        this->info.xOpen = &vfs::open_file;
+        this->info.xDelete = &vfs::remove_file;
+        this->info.xAccess = &vfs::access_file;
+        this->info.xFullPathname = &vfs::full_pathname_of;
+        this->info.xDlOpen = [](sqlite3_vfs* v, const char* name) { return underlying(v)->xDlOpen(underlying(v), name); };
+        this->info.xDlError = [](sqlite3_vfs* v, int size, char* message) {
+            underlying(v)->xDlError(underlying(v), size, message);
+        };
+        this->info.xDlSym = [](sqlite3_vfs* v, void* library, const char* symbol) {
+            return underlying(v)->xDlSym(underlying(v), library, symbol);
+        };
+        this->info.xDlClose = [](sqlite3_vfs* v, void* library) { underlying(v)->xDlClose(underlying(v), library); };
+        this->info.xRandomness = [](sqlite3_vfs* v, int size, char* out) {
+            return underlying(v)->xRandomness(underlying(v), size, out);
+        };
+        this->info.xSleep = [](sqlite3_vfs* v, int microseconds) {
+            return underlying(v)->xSleep(underlying(v), microseconds);
+        };
+        this->info.xCurrentTime = [](sqlite3_vfs* v, double* now) { return underlying(v)->xCurrentTime(underlying(v), now); };
+        this->info.xGetLastError = [](sqlite3_vfs* v, int size, char* message) {
+            return underlying(v)->xGetLastError ? underlying(v)->xGetLastError(underlying(v), size, message) : 0;
+        };
+        this->info.xCurrentTimeInt64 = [](sqlite3_vfs* v, sqlite3_int64* now) {
+            auto b = underlying(v);
+            if (b->iVersion >= 2 && b->xCurrentTimeInt64)
+                return b->xCurrentTimeInt64(b, now);
+            double days = 0;
+            int error = b->xCurrentTime(b, &days);
+            *now = static_cast<sqlite3_int64>(days * 86400000.0);
+            return error;
+        };
+    }
+
+    vfs(const vfs&) = delete;
+    vfs& operator=(const vfs&) = delete;
+
+    virtual ~vfs()
+    {
+        sqlite3_vfs_unregister(&this->info);
+    }
+
+    // Registers the VFS under its name, and as the process's default VFS if make_default is set.
+    void install(bool make_default = false)
+    {
+        if (int error = sqlite3_vfs_register(&this->info, make_default))
+            throw sqlite::error(error, sqlite3_errstr(error));
+    }
+
+    const std::string& name() const noexcept
+    {
+        return this->registered_name;
+    }
+
+protected:
+    // Opens a file; name is null for temporary files. Throwing an sqlite::error fails the open
+    // with its code, and any other exception with SQLITE_CANTOPEN.
+    virtual std::unique_ptr<file> open(const char* name, int flags, int* out_flags)
+    {
+        return std::make_unique<file>(this->base, name, flags, out_flags);
+    }
+
+    virtual int remove(const char* name, bool sync_directory)
+    {
+        return this->base->xDelete(this->base, name, sync_directory);
+    }
+
+    virtual int access(const char* name, int flags, int& result)
+    {
+        return this->base->xAccess(this->base, name, flags, &result);
+    }
+
+    virtual int full_pathname(const char* name, int size, char* out)
+    {
+        return this->base->xFullPathname(this->base, name, size, out);
+    }
+
+    sqlite3_vfs* base;
+
+private:
+    struct handle
+    {
+        sqlite3_file header;
+        file* impl;
+    };
+
+    static vfs& self(sqlite3_vfs* v) noexcept
+    {
+        return *static_cast<vfs*>(v->pAppData);
+    }
+
+    static sqlite3_vfs* underlying(sqlite3_vfs* v) noexcept
+    {
+        return self(v).base;
+    }
+
+    static file& impl(sqlite3_file* f) noexcept
+    {
+        return *reinterpret_cast<handle*>(f)->impl;
+    }
+
+    template <typename F>
+    static int guard(F&& operation, int failure) noexcept
+    {
+        try
+        {
+            return operation();
+        }
+        catch (...)
+        {
+            return failure;
+        }
+    }
+
+    static int open_file(sqlite3_vfs* v, const char* name, sqlite3_file* out, int flags, int* out_flags) noexcept
+    {
+        auto h = reinterpret_cast<handle*>(out);
+        h->header.pMethods = nullptr;
+        try
+        {
+            auto opened = self(v).open(name, flags, out_flags);
+            int version = std::clamp(opened->io_version(), 1, 3);
+            h->impl = opened.release();
+            h->header.pMethods = &methods()[version - 1];
+            return SQLITE_OK;
+        }
+        catch (const sqlite::error& e)
+        {
+            return e.extended_code();
+        }
+        catch (...)
+        {
+            return SQLITE_CANTOPEN;
+        }
+    }
+
+    static int remove_file(sqlite3_vfs* v, const char* name, int sync_directory) noexcept
+    {
+        return guard([&]() { return self(v).remove(name, sync_directory); }, SQLITE_IOERR_DELETE);
+    }
+
+    static int access_file(sqlite3_vfs* v, const char* name, int flags, int* result) noexcept
+    {
+        return guard([&]() { return self(v).access(name, flags, *result); }, SQLITE_IOERR_ACCESS);
+    }
+
+    static int full_pathname_of(sqlite3_vfs* v, const char* name, int size, char* out) noexcept
+    {
+        return guard([&]() { return self(v).full_pathname(name, size, out); }, SQLITE_CANTOPEN);
+    }
+
+    // One table per sqlite3_io_methods version, since SQLite decides from iVersion whether a
+    // file supports shared memory and memory mapping.
+    static const std::array<sqlite3_io_methods, 3>& methods() noexcept
+    {
+        static const std::array<sqlite3_io_methods, 3> tables = []() {
+            sqlite3_io_methods m {};
+            m.xClose = [](sqlite3_file* f) {
+                delete &impl(f);
+                f->pMethods = nullptr;
+                return SQLITE_OK;
+            };
+            m.xRead = [](sqlite3_file* f, void* data, int size, sqlite3_int64 offset) {
+                return guard([&]() { return impl(f).read(data, size, offset); }, SQLITE_IOERR_READ);
+            };
+            m.xWrite = [](sqlite3_file* f, const void* data, int size, sqlite3_int64 offset) {
+                return guard([&]() { return impl(f).write(data, size, offset); }, SQLITE_IOERR_WRITE);
+            };
+            m.xTruncate = [](sqlite3_file* f, sqlite3_int64 size) {
+                return guard([&]() { return impl(f).truncate(size); }, SQLITE_IOERR_TRUNCATE);
+            };
+            m.xSync = [](sqlite3_file* f, int flags) {
+                return guard([&]() { return impl(f).sync(flags); }, SQLITE_IOERR_FSYNC);
+            };
+            m.xFileSize = [](sqlite3_file* f, sqlite3_int64* size) {
+                return guard([&]() { return impl(f).file_size(*size); }, SQLITE_IOERR_FSTAT);
+            };
+            m.xLock = [](sqlite3_file* f, int level) {
+                return guard([&]() { return impl(f).lock(level); }, SQLITE_IOERR_LOCK);
+            };
+            m.xUnlock = [](sqlite3_file* f, int level) {
+                return guard([&]() { return impl(f).unlock(level); }, SQLITE_IOERR_UNLOCK);
+            };
+            m.xCheckReservedLock = [](sqlite3_file* f, int* reserved) {
+                return guard([&]() { return impl(f).check_reserved_lock(*reserved); }, SQLITE_IOERR_CHECKRESERVEDLOCK);
+            };
+            m.xFileControl = [](sqlite3_file* f, int op, void* arg) {
+                return guard([&]() { return impl(f).file_control(op, arg); }, SQLITE_ERROR);
+            };
+            m.xSectorSize = [](sqlite3_file* f) { return guard([&]() { return impl(f).sector_size(); }, 4096); };
+            m.xDeviceCharacteristics = [](sqlite3_file* f) {
+                return guard([&]() { return impl(f).device_characteristics(); }, 0);
+            };
+            m.xShmMap = [](sqlite3_file* f, int region, int size, int extend, void volatile** memory) {
+                return guard([&]() { return impl(f).shm_map(region, size, extend, memory); }, SQLITE_IOERR_SHMMAP);
+            };
+            m.xShmLock = [](sqlite3_file* f, int offset, int count, int flags) {
+                return guard([&]() { return impl(f).shm_lock(offset, count, flags); }, SQLITE_IOERR_SHMLOCK);
+            };
+            m.xShmBarrier = [](sqlite3_file* f) {
+                guard(
+                    [&]() {
+                        impl(f).shm_barrier();
+                        return 0;
+                    },
+                    0);
+            };
+            m.xShmUnmap = [](sqlite3_file* f, int remove) {
+                return guard([&]() { return impl(f).shm_unmap(remove); }, SQLITE_IOERR_SHMMAP);
+            };
+            m.xFetch = [](sqlite3_file* f, sqlite3_int64 offset, int size, void** data) {
+                *data = nullptr;
+                return guard([&]() { return impl(f).fetch(offset, size, data); }, SQLITE_IOERR_MMAP);
+            };
+            m.xUnfetch = [](sqlite3_file* f, sqlite3_int64 offset, void* data) {
+                return guard([&]() { return impl(f).unfetch(offset, data); }, SQLITE_IOERR_MMAP);
+            };
+            std::array<sqlite3_io_methods, 3> result { m, m, m };
+            for (int i = 0; i < 3; i++)
+                result[i].iVersion = i + 1;
+            return result;
+        }();
+        return tables;
+    }
+
+    std::string registered_name;
+    sqlite3_vfs info {};
+};
+
+// I/O counters of the files opened through a counting_vfs.
+struct io_stats
+{
+    std::uint64_t reads = 0;
+    std::uint64_t writes = 0;
+    std::uint64_t syncs = 0;
+    std::uint64_t truncates = 0;
+    std::uint64_t bytes_read = 0;
+    std::uint64_t bytes_written = 0;
+    std::chrono::nanoseconds read_time {};
+    std::chrono::nanoseconds write_time {};
+    std::chrono::nanoseconds sync_time {};
+    // The slowest single read, write or sync.
+    std::chrono::nanoseconds max_latency {};
+
+    std::uint64_t operations() const noexcept
+    {
+        return this->reads + this->writes + this->syncs + this->truncates;
+    }
+
+    io_stats& operator+=(const io_stats& other) noexcept
+    {
+        this->reads += other.reads;
+        this->writes += other.writes;
+        this->syncs += other.syncs;
+        this->truncates += other.truncates;
+        this->bytes_read += other.bytes_read;
+        this->bytes_written += other.bytes_written;
+        this->read_time += other.read_time;
+        this->write_time += other.write_time;
+        this->sync_time += other.sync_time;
+        this->max_latency = std::max(this->max_latency, other.max_latency);
+        return *this;
+    }
+};
+
+// Passes every operation through to the underlying VFS, counting operations, bytes and time per
+// file path. Shared memory and memory-mapped reads are not counted.
+class counting_vfs : public vfs
+{
+public:
+    explicit counting_vfs(std::string name = "counting", const char* base = nullptr)
+        : vfs(std::move(name), base)
+    {}
+
+    // The counters of every file opened so far, by path. Files opened again, by this or another
+    // connection, add to the same counters.
+    std::vector<std::pair<std::string, io_stats>> stats() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::vector<std::pair<std::string, io_stats>> result;
+        result.reserve(this->files.size());
+        for (const auto& [path, c] : this->files)
+            result.emplace_back(path, c->snapshot());
+        return result;
+    }
+
+    io_stats total() const
+    {
+        io_stats sum;
+        for (const auto& [path, s] : this->stats())
+            sum += s;
+        return sum;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->files.clear();
+    }
+
+protected:
+    std::unique_ptr<file> open(const char* name, int flags, int* out_flags) override
+    {
+        std::shared_ptr<counters> c;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto& slot = this->files[name ? name : ""];
+            if (!slot)
+                slot = std::make_shared<counters>();
+            c = slot;
+        }
+        return std::make_unique<counting_file>(this->base, name, flags, out_flags, std::move(c));
+    }
+
+private:
+    struct counters
+    {
+        std::atomic<std::uint64_t> reads = 0;
+        std::atomic<std::uint64_t> writes = 0;
+        std::atomic<std::uint64_t> syncs = 0;
+        std::atomic<std::uint64_t> truncates = 0;
+        std::atomic<std::uint64_t> bytes_read = 0;
+        std::atomic<std::uint64_t> bytes_written = 0;
+        std::atomic<std::int64_t> read_time = 0;
+        std::atomic<std::int64_t> write_time = 0;
+        std::atomic<std::int64_t> sync_time = 0;
+        std::atomic<std::int64_t> max_latency = 0;
+
+        void timed(std::atomic<std::int64_t>& total, std::chrono::steady_clock::time_point start) noexcept
+        {
+            auto elapsed = (std::chrono::steady_clock::now() - start).count();
+            total.fetch_add(elapsed, std::memory_order_relaxed);
+            auto max = this->max_latency.load(std::memory_order_relaxed);
+            while (elapsed > max && !this->max_latency.compare_exchange_weak(max, elapsed, std::memory_order_relaxed))
+                ;
+        }
+
+        io_stats snapshot() const noexcept
+        {
+            using std::chrono::nanoseconds;
+            return { this->reads.load(), this->writes.load(), this->syncs.load(), this->truncates.load(),
+                     this->bytes_read.load(), this->bytes_written.load(), nanoseconds(this->read_time.load()),
+                     nanoseconds(this->write_time.load()), nanoseconds(this->sync_time.load()),
+                     nanoseconds(this->max_latency.load()) };
+        }
+    };
+
+    class counting_file : public file
+    {
+    public:
+        counting_file(sqlite3_vfs* base, const char* name, int flags, int* out_flags, std::shared_ptr<counters> c)
+            : file(base, name, flags, out_flags)
+            , c(std::move(c))
+        {}
+
+        int read(void* data, int size, sqlite3_int64 offset) override
+        {
+            auto start = std::chrono::steady_clock::now();
+            int result = file::read(data, size, offset);
+            this->c->timed(this->c->read_time, start);
+            this->c->reads.fetch_add(1, std::memory_order_relaxed);
+            this->c->bytes_read.fetch_add(size, std::memory_order_relaxed);
+            return result;
+        }
+
+        int write(const void* data, int size, sqlite3_int64 offset) override
+        {
+            auto start = std::chrono::steady_clock::now();
+            int result = file::write(data, size, offset);
+            this->c->timed(this->c->write_time, start);
+            this->c->writes.fetch_add(1, std::memory_order_relaxed);
+            this->c->bytes_written.fetch_add(size, std::memory_order_relaxed);
+            return result;
+        }
+
+        int sync(int flags) override
+        {
+            auto start = std::chrono::steady_clock::now();
+            int result = file::sync(flags);
+            this->c->timed(this->c->sync_time, start);
+            this->c->syncs.fetch_add(1, std::memory_order_relaxed);
+            return result;
+        }
+
+        int truncate(sqlite3_int64 size) override
+        {
+            this->c->truncates.fetch_add(1, std::memory_order_relaxed);
+            return file::truncate(size);
+        }
+
+    private:
+        std::shared_ptr<counters> c;
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<counters>> files;
+};
+
+struct readahead_options
+{
+    // How much to read at once after a run of sequential reads.
+    std::size_t window = 1 << 20;
+    // The number of consecutive reads, each starting where the last ended, that start read-ahead.
+    int sequential_reads = 2;
+};
+
+// Turns sequential page reads of database files, such as a table scan, into large reads of
+// options.window bytes, for storage where each request has a high latency. The buffer is
+// dropped on every write and lock change, so it never outlives the transaction that read it.
+// Memory-mapped reads bypass it, so use it with mmap_size 0.
+class readahead_vfs : public vfs
+{
+public:
+    explicit readahead_vfs(std::string name = "readahead", readahead_options options = {}, const char* base = nullptr)
+        : vfs(std::move(name), base)
+        , options(options)
+    {}
+
+    // Reads served from a read-ahead buffer, and reads of a whole window.
+    std::uint64_t buffered_reads() const noexcept
+    {
+        return this->hits.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t windows_read() const noexcept
+    {
+        return this->fills.load(std::memory_order_relaxed);
+    }
+
+protected:
+    std::unique_ptr<file> open(const char* name, int flags, int* out_flags) override
+    {
+        if (!(flags & SQLITE_OPEN_MAIN_DB))
+            return vfs::open(name, flags, out_flags);
+        return std::make_unique<readahead_file>(*this, name, flags, out_flags);
+    }
+
+private:
+    class readahead_file : public file
+    {
+    public:
+        readahead_file(readahead_vfs& owner, const char* name, int flags, int* out_flags)
+            : file(owner.base, name, flags, out_flags)
+            , owner(owner)
+        {}
+
+        int read(void* data, int size, sqlite3_int64 offset) override
+        {
+            if (this->buffered(offset, size))
+                return this->copy(data, size, offset);
+
+            this->run = offset == this->next_offset ? this->run + 1 : 0;
+            this->next_offset = offset + size;
+            if (this->run >= this->owner.options.sequential_reads && this->fill(offset) && this->buffered(offset, size))
+                return this->copy(data, size, offset);
+            return file::read(data, size, offset);
+        }
+
+        int write(const void* data, int size, sqlite3_int64 offset) override
+        {
+            this->drop();
+            return file::write(data, size, offset);
+        }
+
+        int truncate(sqlite3_int64 size) override
+        {
+            this->drop();
+            return file::truncate(size);
+        }
+
+        int lock(int level) override
+        {
+            this->drop();
+            return file::lock(level);
+        }
+
+        int unlock(int level) override
+        {
+            this->drop();
+            return file::unlock(level);
+        }
+
+        int shm_lock(int offset, int count, int flags) override
+        {
+            this->drop();
+            return file::shm_lock(offset, count, flags);
+        }
+
+    private:
+        bool buffered(sqlite3_int64 offset, int size) const noexcept
+        {
+            return offset >= this->start && offset + size <= this->start + this->length;
+        }
+
+        int copy(void* data, int size, sqlite3_int64 offset)
+        {
+            std::memcpy(data, this->buffer.data() + (offset - this->start), size);
+            this->next_offset = offset + size;
+            this->owner.hits.fetch_add(1, std::memory_order_relaxed);
+            return SQLITE_OK;
+        }
+
+        bool fill(sqlite3_int64 offset)
+        {
+            sqlite3_int64 size = 0;
+            if (file::file_size(size) != SQLITE_OK || offset >= size)
+                return false;
+            auto length = std::min<sqlite3_int64>(this->owner.options.window, size - offset);
+            this->buffer.resize(this->owner.options.window);
+            this->drop();
+            if (file::read(this->buffer.data(), static_cast<int>(length), offset) != SQLITE_OK)
+                return false;
+            this->start = offset;
+            this->length = length;
+            this->owner.fills.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        void drop() noexcept
+        {
+            this->length = 0;
+        }
+
+        readahead_vfs& owner;
+        std::vector<std::byte> buffer;
+        sqlite3_int64 start = 0;
+        sqlite3_int64 length = 0;
+        sqlite3_int64 next_offset = -1;
+        int run = 0;
+    };
+
+    readahead_options options;
+    std::atomic<std::uint64_t> hits = 0;
+    std::atomic<std::uint64_t> fills = 0;
+};
+
+// Keeps the blocks read from database files in an LRU cache of up to capacity bytes, shared by
+// every connection that opens the same path through this VFS, so those connections stop paying
+// for each other's cache misses. Writes and truncations update the cache's view of the file, so
+// it is only correct if this process, through this VFS, is the only writer of the database.
+class page_cache_vfs : public vfs
+{
+public:
+    explicit page_cache_vfs(std::string name = "page_cache", std::size_t capacity = std::size_t(64) << 20,
+                            const char* base = nullptr)
+        : vfs(std::move(name), base)
+        , capacity(capacity)
+    {}
+
+    // Size and capacity are in bytes.
+    cache_stats stats() const
     {
-        if (sqlite3_open_v2(filename.data(), &this->db, static_cast<int>(flags), nullptr))
-            throw std::invalid_argument("database file not found");
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return { this->hits, this->misses, this->size, this->capacity };
     }
 
-    database(const database&) = delete;
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto& [path, blocks] : this->files)
+            blocks.clear();
+        this->lru.clear();
+        this->size = 0;
+    }
 
-    constexpr database(database&& other) noexcept
-        : db(other.db)
-        , transaction_id(other.transaction_id)
+protected:
+    std::unique_ptr<file> open(const char* name, int flags, int* out_flags) override
     {
-        other.db = nullptr;
-        other.transaction_id = 0;
+        if (!name || !(flags & SQLITE_OPEN_MAIN_DB))
+            return vfs::open(name, flags, out_flags);
+        block_map* blocks = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            blocks = &this->files[name];
+        }
+        return std::make_unique<cached_file>(*this, *blocks, name, flags, out_flags);
     }
 
-    ~database()
+    int remove(const char* name, bool sync_directory) override
     {
-        sqlite3_close_v2(this->db);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (auto it = this->files.find(name); it != this->files.end())
+                this->erase(it->second, 0, std::numeric_limits<sqlite3_int64>::max());
+        }
+        return vfs::remove(name, sync_directory);
     }
 
-    database& operator=(const database&) = delete;
+private:
+    struct block;
+    using block_map = std::map<sqlite3_int64, block>;
 
-    statement prepare(const std::string_view sql) const
+    struct block
     {
-        return statement(this->db, sql);
+        std::vector<std::byte> data;
+        std::list<std::pair<block_map*, sqlite3_int64>>::iterator lru;
+    };
+
+    class cached_file : public file
+    {
+    public:
+        cached_file(page_cache_vfs& owner, block_map& blocks, const char* name, int flags, int* out_flags)
+            : file(owner.base, name, flags, out_flags)
+            , owner(owner)
+            , blocks(blocks)
+        {}
+
+        int read(void* data, int size, sqlite3_int64 offset) override
+        {
+            if (this->owner.lookup(this->blocks, data, size, offset))
+                return SQLITE_OK;
+            int result = file::read(data, size, offset);
+            if (result == SQLITE_OK)
+                this->owner.insert(this->blocks, data, size, offset);
+            return result;
+        }
+
+        int write(const void* data, int size, sqlite3_int64 offset) override
+        {
+            int result = file::write(data, size, offset);
+            this->owner.invalidate(this->blocks, offset, offset + size);
+            return result;
+        }
+
+        int truncate(sqlite3_int64 size) override
+        {
+            int result = file::truncate(size);
+            this->owner.invalidate(this->blocks, size, std::numeric_limits<sqlite3_int64>::max());
+            return result;
+        }
+
+    private:
+        page_cache_vfs& owner;
+        block_map& blocks;
+    };
+
+    bool lookup(block_map& blocks, void* data, int size, sqlite3_int64 offset)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto it = blocks.find(offset);
+        if (it == blocks.end() || it->second.data.size() != static_cast<std::size_t>(size))
+        {
+            this->misses++;
+            return false;
+        }
+        std::memcpy(data, it->second.data.data(), size);
+        this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
+        this->hits++;
+        return true;
     }
 
-    template <typename... Args>
-    statement execute(const std::string_view sql, Args... args) const
+    void insert(block_map& blocks, const void* data, int size, sqlite3_int64 offset)
     {
-        statement stmt = this->prepare(sql);
-        stmt.reset();
-        stmt.bind_multiple(std::forward<Args>(args)...);
-        return stmt;
+        if (static_cast<std::size_t>(size) > this->capacity)
+            return;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->erase(blocks, offset, offset + size);
+        while (this->size + size > this->capacity)
+        {
+            auto [owner, key] = this->lru.back();
+            this->erase_block(*owner, owner->find(key));
+        }
+        auto bytes = static_cast<const std::byte*>(data);
+        auto& b = blocks[offset];
+        b.data.assign(bytes, bytes + size);
+        b.lru = this->lru.emplace(this->lru.begin(), &blocks, offset);
+        this->size += size;
     }
 
-    template <typename F>
-    void atomic(F&& func)
+    void invalidate(block_map& blocks, sqlite3_int64 begin, sqlite3_int64 end)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->erase(blocks, begin, end);
+    }
+
+    // Requires mutex. Erases the blocks overlapping [begin, end).
+    void erase(block_map& blocks, sqlite3_int64 begin, sqlite3_int64 end)
+    {
+        auto it = blocks.lower_bound(begin);
+        while (it != blocks.begin())
+        {
+            auto previous = std::prev(it);
+            if (previous->first + static_cast<sqlite3_int64>(previous->second.data.size()) <= begin)
+                break;
+            it = previous;
+        }
+        while (it != blocks.end() && it->first < end)
+            it = this->erase_block(blocks, it);
+    }
+
+    block_map::iterator erase_block(block_map& blocks, block_map::iterator it)
+    {
+        this->size -= it->second.data.size();
+        this->lru.erase(it->second.lru);
+        return blocks.erase(it);
+    }
+
+    std::size_t capacity;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, block_map> files;
+    std::list<std::pair<block_map*, sqlite3_int64>> lru;
+    std::size_t size = 0;
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+};
+
+// Process-wide settings. SQLite only accepts them before it is initialized, which happens on the
+// first open, or after sqlite3_shutdown(); otherwise they throw an error with code SQLITE_MISUSE.
+// Memory handed over must stay valid until sqlite3_shutdown() returns.
+
+// Replaces SQLite's memory allocator.
+inline void configure_malloc(const sqlite3_mem_methods& methods)
+{
+    if (int error = sqlite3_config(SQLITE_CONFIG_MALLOC, &methods))
+        throw sqlite::error(error, sqlite3_errstr(error));
+}
+
+// Replaces the page cache of every connection opened from now on.
+inline void configure_pcache(const sqlite3_pcache_methods2& methods)
+{
+    if (int error = sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods))
+        throw sqlite::error(error, sqlite3_errstr(error));
+}
+
+// The slot size configure_page_buffer needs for pages of page_size bytes.
+inline int page_buffer_slot_size(int page_size)
+{
+    int header = 0;
+    if (int error = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header))
+        throw sqlite::error(error, sqlite3_errstr(error));
+    return page_size + header;
+}
+
+// Gives the default page cache a fixed buffer of slots to take pages from before it falls back
+// to the allocator. Only used by the default page cache, not one set with configure_pcache.
+inline void configure_page_buffer(std::span<std::byte> buffer, int slot_size)
+{
+    int slots = static_cast<int>(buffer.size() / static_cast<std::size_t>(slot_size));
+    if (int error = sqlite3_config(SQLITE_CONFIG_PAGECACHE, buffer.data(), slot_size, slots))
+        throw sqlite::error(error, sqlite3_errstr(error));
+}
+
+// Bytes currently allocated by SQLite, and the most ever allocated at once.
+inline std::int64_t memory_used() noexcept
+{
+    return sqlite3_memory_used();
+}
+
+inline std::int64_t memory_highwater(bool reset = false) noexcept
+{
+    return sqlite3_memory_highwater(reset);
+}
+
+// Past the soft limit SQLite frees cache memory before allocating more; past the hard limit,
+// allocations fail with SQLITE_NOMEM. 0 removes a limit. Returns the previous limit.
+inline std::int64_t set_soft_heap_limit(std::int64_t bytes) noexcept
+{
+    return sqlite3_soft_heap_limit64(bytes);
+}
+
+inline std::int64_t set_hard_heap_limit(std::int64_t bytes) noexcept
+{
+    return sqlite3_hard_heap_limit64(bytes);
+}
+
+struct page_cache_stats
+{
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::size_t pages = 0;
+    // Bytes held by pages, and the budget they are kept under.
+    std::size_t size = 0;
+    std::size_t capacity = 0;
+};
+
+// A page cache shared by every connection, which keeps the pages of all of them under one
+// budget of capacity bytes instead of the cache_size of each: a connection that needs a page
+// evicts the least recently used unpinned page of any connection. Caches are spread over shards,
+// each with its own lock and LRU list, to keep connections on different threads apart; a shard
+// with nothing to evict takes the memory back from the others. Pinned pages, and the pages of
+// temporary and in-memory databases, are never evicted, so the budget can be exceeded while
+// they alone fill it. install() makes it the page cache of every connection opened afterwards;
+// it must outlive them all, and sqlite3_shutdown().
+class shared_page_cache
+{
+public:
+    explicit shared_page_cache(std::size_t capacity, std::size_t shards = 16)
+        : shards(std::max<std::size_t>(shards, 1))
+        , capacity(capacity)
+    {}
+
+    shared_page_cache(const shared_page_cache&) = delete;
+    shared_page_cache& operator=(const shared_page_cache&) = delete;
+
+    ~shared_page_cache()
+    {
+        for (auto& s : this->shards)
+        {
+            for (auto* c : s.caches)
+                this->destroy_cache(s, c);
+        }
+    }
+
+    void install()
+    {
+        sqlite3_pcache_methods2 methods {};
+        methods.iVersion = 1;
+        methods.pArg = this;
+        methods.xInit = [](void*) { return SQLITE_OK; };
+        methods.xShutdown = [](void*) {};
+        methods.xCreate = &shared_page_cache::create;
+        methods.xCachesize = [](sqlite3_pcache*, int) {};
+        methods.xPagecount = &shared_page_cache::page_count;
+        methods.xFetch = &shared_page_cache::fetch;
+        methods.xUnpin = &shared_page_cache::unpin;
+        methods.xRekey = &shared_page_cache::rekey;
+        methods.xTruncate = &shared_page_cache::truncate;
+        methods.xDestroy = &shared_page_cache::destroy;
+        methods.xShrink = &shared_page_cache::shrink;
+        configure_pcache(methods);
+        installed() = this;
+    }
+
+    page_cache_stats stats() const
+    {
+        page_cache_stats result;
+        result.hits = this->hits.load(std::memory_order_relaxed);
+        result.misses = this->misses.load(std::memory_order_relaxed);
+        result.evictions = this->evictions.load(std::memory_order_relaxed);
+        result.pages = this->pages.load(std::memory_order_relaxed);
+        result.size = this->used.load(std::memory_order_relaxed);
+        result.capacity = this->capacity;
+        return result;
+    }
+
+private:
+    struct cache;
+
+    struct page
+    {
+        sqlite3_pcache_page header;
+        cache* owner;
+        unsigned key;
+        bool pinned;
+        // The shard's LRU list of unpinned pages, most recently used first.
+        page* newer;
+        page* older;
+    };
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::vector<cache*> caches;
+        page* newest = nullptr;
+        page* oldest = nullptr;
+    };
+
+    struct cache
+    {
+        shared_page_cache* owner;
+        shard* home;
+        std::size_t page_size;
+        std::size_t extra_size;
+        bool purgeable;
+        std::unordered_map<unsigned, page*> pages;
+    };
+
+    // Each page is one allocation: the page object, then the page content, then the extra bytes
+    // SQLite keeps alongside it.
+    std::size_t allocation_size(const cache& c) const noexcept
+    {
+        return sizeof(page) + c.page_size + c.extra_size;
+    }
+
+    // SQLite passes pArg only to xInit, so create finds the installed cache through this.
+    static shared_page_cache*& installed() noexcept
+    {
+        static shared_page_cache* current = nullptr;
+        return current;
+    }
+
+    static cache& of(sqlite3_pcache* p) noexcept
+    {
+        return *reinterpret_cast<cache*>(p);
+    }
+
+    static page& of(sqlite3_pcache_page* p) noexcept
+    {
+        return *reinterpret_cast<page*>(p);
+    }
+
+    // The functions below require the lock of the page's shard.
+    static void link(shard& s, page* p) noexcept
+    {
+        p->older = s.newest;
+        p->newer = nullptr;
+        if (s.newest)
+            s.newest->newer = p;
+        s.newest = p;
+        if (!s.oldest)
+            s.oldest = p;
+    }
+
+    static void unlink(shard& s, page* p) noexcept
+    {
+        (p->newer ? p->newer->older : s.newest) = p->older;
+        (p->older ? p->older->newer : s.oldest) = p->newer;
+        p->newer = p->older = nullptr;
+    }
+
+    // Removes p from its cache, returning the bytes it held without freeing them.
+    std::size_t detach(shard& s, page* p) noexcept
+    {
+        if (!p->pinned && p->owner->purgeable)
+            unlink(s, p);
+        p->owner->pages.erase(p->key);
+        this->pages.fetch_sub(1, std::memory_order_relaxed);
+        return this->allocation_size(*p->owner);
+    }
+
+    void free_page(shard& s, page* p) noexcept
+    {
+        auto size = this->detach(s, p);
+        this->used.fetch_sub(size, std::memory_order_relaxed);
+        ::operator delete(p);
+    }
+
+    bool over_budget(std::size_t size) const noexcept
+    {
+        return this->used.load(std::memory_order_relaxed) + size > this->capacity;
+    }
+
+    // Evicts the shard's least recently used pages until size more bytes fit. Keeps the first
+    // evicted page of exactly size bytes in reuse instead of freeing it.
+    void evict(shard& s, std::size_t size, page*& reuse) noexcept
     {
-        std::string transaction_id = std::to_string(this->transaction_id++);
-        std::string begin_sql = "savepoint s" + transaction_id;
-        std::string rollback_sql = "rollback transaction to savepoint s" + transaction_id;
-        std::string commit_sql = "release savepoint s" + transaction_id;
+        while (s.oldest && this->over_budget(reuse ? 0 : size))
+        {
+            page* victim = s.oldest;
+            this->evictions.fetch_add(1, std::memory_order_relaxed);
+            if (!reuse && this->allocation_size(*victim->owner) == size)
+            {
+                this->detach(s, victim);
+                reuse = victim;
+            }
+            else
+                this->free_page(s, victim);
+        }
+    }
 
-        this->execute(begin_sql);
+    static sqlite3_pcache* create(int page_size, int extra_size, int purgeable) noexcept
+    {
+        auto& self = *installed();
         try
         {
-            func();
+            auto& s = self.shards[self.next_shard.fetch_add(1, std::memory_order_relaxed) % self.shards.size()];
+            auto c = new cache { &self, &s, static_cast<std::size_t>(page_size), static_cast<std::size_t>(extra_size), purgeable != 0, {} };
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.caches.push_back(c);
+            return reinterpret_cast<sqlite3_pcache*>(c);
         }
         catch (...)
         {
-            this->execute(rollback_sql);
-            throw;
+            return nullptr;
         }
+    }
+
+    static int page_count(sqlite3_pcache* p) noexcept
+    {
+        auto& c = of(p);
+        std::lock_guard<std::mutex> lock(c.home->mutex);
+        return static_cast<int>(c.pages.size());
+    }
+
+    // create_flag is 0 to only look the page up, 1 to create it if that is easy and 2 to create
+    // it unless memory runs out.
+    static sqlite3_pcache_page* fetch(sqlite3_pcache* p, unsigned key, int create_flag) noexcept
+    {
+        auto& c = of(p);
+        auto& self = *c.owner;
+        auto& s = *c.home;
+        auto size = self.allocation_size(c);
+        page* reuse = nullptr;
+        page* fresh = nullptr;
+        try
+        {
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (auto it = c.pages.find(key); it != c.pages.end())
+                {
+                    page* found = it->second;
+                    if (!found->pinned)
+                    {
+                        if (c.purgeable)
+                            unlink(s, found);
+                        found->pinned = true;
+                    }
+                    self.hits.fetch_add(1, std::memory_order_relaxed);
+                    return &found->header;
+                }
+                self.misses.fetch_add(1, std::memory_order_relaxed);
+                if (!create_flag)
+                    return nullptr;
+                if (c.purgeable)
+                    self.evict(s, size, reuse);
+            }
+
+            if (c.purgeable)
+            {
+                // One shard lock at a time, so shards never wait on each other.
+                for (auto& other : self.shards)
+                {
+                    if (reuse || !self.over_budget(size))
+                        break;
+                    if (&other == &s)
+                        continue;
+                    std::lock_guard<std::mutex> lock(other.mutex);
+                    self.evict(other, size, reuse);
+                }
+                // Asked to create only if that is easy: let SQLite spill dirty pages instead.
+                if (create_flag == 1 && !reuse && self.over_budget(size))
+                    return nullptr;
+            }
+
+            fresh = reuse;
+            if (!fresh)
+            {
+                fresh = static_cast<page*>(::operator new(size));
+                self.used.fetch_add(size, std::memory_order_relaxed);
+            }
+            auto content = reinterpret_cast<std::byte*>(fresh + 1);
+            fresh->header.pBuf = content;
+            fresh->header.pExtra = content + c.page_size;
+            std::memset(fresh->header.pExtra, 0, c.extra_size);
+            fresh->owner = &c;
+            fresh->key = key;
+            fresh->pinned = true;
+            fresh->newer = fresh->older = nullptr;
 
-        this->execute(commit_sql);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            c.pages.emplace(key, fresh);
+            self.pages.fetch_add(1, std::memory_order_relaxed);
+            return &fresh->header;
+        }
+        catch (...)
+        {
+            if (page* lost = fresh ? fresh : reuse)
+            {
+                self.used.fetch_sub(size, std::memory_order_relaxed);
+                ::operator delete(lost);
+            }
+            return nullptr;
+        }
     }
 
-    sqlite3* handle() const
+    static void unpin(sqlite3_pcache* p, sqlite3_pcache_page* pg, int discard) noexcept
     {
-        return db;
+        auto& c = of(p);
+        auto& s = *c.home;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        page* target = &of(pg);
+        // A discarded page is freed while still pinned, so detach knows it is not in the LRU list.
+        if (discard)
+            c.owner->free_page(s, target);
+        else
+        {
+            target->pinned = false;
+            if (c.purgeable)
+                link(s, target);
+        }
+    }
+
+    static void rekey(sqlite3_pcache* p, sqlite3_pcache_page* pg, unsigned old_key, unsigned new_key) noexcept
+    {
+        auto& c = of(p);
+        auto& s = *c.home;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (auto it = c.pages.find(new_key); it != c.pages.end())
+            c.owner->free_page(s, it->second);
+        auto node = c.pages.extract(old_key);
+        node.key() = new_key;
+        of(pg).key = new_key;
+        c.pages.insert(std::move(node));
+    }
+
+    static void truncate(sqlite3_pcache* p, unsigned limit) noexcept
+    {
+        auto& c = of(p);
+        auto& s = *c.home;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::vector<page*> doomed;
+        for (auto [key, pg] : c.pages)
+        {
+            if (key >= limit)
+                doomed.push_back(pg);
+        }
+        // Truncating implicitly unpins the pages.
+        for (auto* pg : doomed)
+            c.owner->free_page(s, pg);
+    }
+
+    static void shrink(sqlite3_pcache* p) noexcept
+    {
+        auto& c = of(p);
+        auto& s = *c.home;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::vector<page*> unpinned;
+        for (auto [key, pg] : c.pages)
+        {
+            if (!pg->pinned && c.purgeable)
+                unpinned.push_back(pg);
+        }
+        for (auto* pg : unpinned)
+            c.owner->free_page(s, pg);
+    }
+
+    static void destroy(sqlite3_pcache* p) noexcept
+    {
+        auto& c = of(p);
+        auto& s = *c.home;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::erase(s.caches, &c);
+        c.owner->destroy_cache(s, &c);
+    }
+
+    // Requires the shard's lock, unless it is being destroyed.
+    void destroy_cache(shard& s, cache* c) noexcept
+    {
+        while (!c->pages.empty())
+            this->free_page(s, c->pages.begin()->second);
+        delete c;
+    }
+
+    std::vector<shard> shards;
+    std::size_t capacity;
+    std::atomic<std::size_t> next_shard = 0;
+    std::atomic<std::size_t> used = 0;
+    std::atomic<std::size_t> pages = 0;
+    std::atomic<std::uint64_t> hits = 0;
+    std::atomic<std::uint64_t> misses = 0;
+    std::atomic<std::uint64_t> evictions = 0;
+};
+
+struct arena_options
+{
+    // The arena is reserved up front and carved into slabs of one size class each.
+    std::size_t size = std::size_t(64) << 20;
+    // Serves allocations larger than the largest size class, or any allocation once the arena
+    // is full, from the system allocator. Without it the arena is a hard memory budget: such
+    // allocations fail and SQLite reports SQLITE_NOMEM.
+    bool fallback = true;
+};
+
+struct arena_stats
+{
+    // Bytes of the arena carved into slabs so far, out of its size.
+    std::size_t reserved = 0;
+    std::size_t size = 0;
+    // Blocks handed out by the arena and by the fallback allocator.
+    std::size_t blocks = 0;
+    std::size_t fallback_blocks = 0;
+    std::size_t fallback_bytes = 0;
+};
+
+// A memory allocator for SQLite with free lists for power-of-two size classes from 16 bytes to
+// 64 KiB, over slabs carved from one arena. Freed blocks are kept for the next allocation of
+// their class, so the small, short-lived allocations SQLite makes for every statement and row
+// are recycled without going through malloc, and the arena bounds SQLite's memory when
+// fallback is off. Blocks made from the arena carry no header: a block's class is that of its
+// slab. install() replaces SQLite's allocator; the arena must outlive sqlite3_shutdown().
+class arena_allocator
+{
+public:
+    static constexpr std::size_t slab_size = 64 * 1024;
+    static constexpr std::size_t min_block = 16;
+    static constexpr std::size_t class_count = 13;
+
+    explicit arena_allocator(arena_options options = {})
+        : options(options)
+        , slab_total(options.size / slab_size)
+        , arena(static_cast<std::byte*>(::operator new(std::max<std::size_t>(this->slab_total, 1) * slab_size,
+                                                       std::align_val_t(slab_size))))
+        , slab_classes(std::make_unique<std::uint8_t[]>(std::max<std::size_t>(this->slab_total, 1)))
+    {}
+
+    arena_allocator(const arena_allocator&) = delete;
+    arena_allocator& operator=(const arena_allocator&) = delete;
+
+    ~arena_allocator()
+    {
+        ::operator delete(this->arena, std::align_val_t(slab_size));
+    }
+
+    void install()
+    {
+        sqlite3_mem_methods methods {};
+        methods.pAppData = this;
+        methods.xMalloc = [](int size) { return self().allocate(static_cast<std::size_t>(size)); };
+        methods.xFree = [](void* p) { self().deallocate(p); };
+        methods.xRealloc = [](void* p, int size) { return self().reallocate(p, static_cast<std::size_t>(size)); };
+        methods.xSize = [](void* p) { return static_cast<int>(self().block_size(p)); };
+        methods.xRoundup = [](int size) { return static_cast<int>(round_up(static_cast<std::size_t>(size))); };
+        methods.xInit = [](void*) { return SQLITE_OK; };
+        methods.xShutdown = [](void*) {};
+        configure_malloc(methods);
+        current() = this;
+    }
+
+    arena_stats stats() const
+    {
+        arena_stats result;
+        result.reserved = std::min(this->next_slab.load(std::memory_order_relaxed), this->slab_total) * slab_size;
+        result.size = this->slab_total * slab_size;
+        result.blocks = this->blocks.load(std::memory_order_relaxed);
+        result.fallback_blocks = this->fallback_blocks.load(std::memory_order_relaxed);
+        result.fallback_bytes = this->fallback_bytes.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    void* allocate(std::size_t size) noexcept
+    {
+        if (size <= slab_size)
+        {
+            auto index = class_of(size);
+            auto& c = this->classes[index];
+            std::lock_guard<std::mutex> lock(c.mutex);
+            if (!c.free && !this->refill(index))
+                return this->allocate_fallback(size);
+            void* block = c.free;
+            c.free = c.free->next;
+            this->blocks.fetch_add(1, std::memory_order_relaxed);
+            return block;
+        }
+        return this->allocate_fallback(size);
+    }
+
+    void deallocate(void* p) noexcept
+    {
+        if (!p)
+            return;
+        if (!this->in_arena(p))
+        {
+            auto header = static_cast<std::byte*>(p) - fallback_header;
+            this->fallback_blocks.fetch_sub(1, std::memory_order_relaxed);
+            this->fallback_bytes.fetch_sub(*reinterpret_cast<std::size_t*>(header), std::memory_order_relaxed);
+            std::free(header);
+            return;
+        }
+        auto& c = this->classes[this->slab_classes[this->slab_of(p)]];
+        std::lock_guard<std::mutex> lock(c.mutex);
+        auto block = static_cast<free_block*>(p);
+        block->next = c.free;
+        c.free = block;
+        this->blocks.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void* reallocate(void* p, std::size_t size) noexcept
+    {
+        auto current = this->block_size(p);
+        if (size <= current && (!this->in_arena(p) || size > current / 2))
+            return p;
+        void* moved = this->allocate(size);
+        if (moved)
+        {
+            std::memcpy(moved, p, std::min(current, size));
+            this->deallocate(p);
+        }
+        return moved;
+    }
+
+    std::size_t block_size(void* p) const noexcept
+    {
+        if (!this->in_arena(p))
+            return *reinterpret_cast<std::size_t*>(static_cast<std::byte*>(p) - fallback_header);
+        return min_block << this->slab_classes[this->slab_of(p)];
     }
 
 private:
-    sqlite3* db;
-    int transaction_id = 0;
+    static constexpr std::size_t fallback_header = 16;
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    struct size_class
+    {
+        std::mutex mutex;
+        free_block* free = nullptr;
+    };
+
+    static arena_allocator*& current() noexcept
+    {
+        static arena_allocator* installed = nullptr;
+        return installed;
+    }
+
+    // SQLite passes pAppData only to xInit, so the callbacks find the installed arena here.
+    static arena_allocator& self() noexcept
+    {
+        return *current();
+    }
+
+    static std::size_t class_of(std::size_t size) noexcept
+    {
+        return std::bit_width((std::max(size, min_block) - 1) / min_block);
+    }
+
+    static std::size_t round_up(std::size_t size) noexcept
+    {
+        if (size <= slab_size)
+            return min_block << class_of(size);
+        return (size + 7) & ~std::size_t(7);
+    }
+
+    bool in_arena(const void* p) const noexcept
+    {
+        auto address = static_cast<const std::byte*>(p);
+        return address >= this->arena && address < this->arena + this->slab_total * slab_size;
+    }
+
+    std::size_t slab_of(const void* p) const noexcept
+    {
+        return static_cast<std::size_t>(static_cast<const std::byte*>(p) - this->arena) / slab_size;
+    }
+
+    // Requires the class's lock. Splits a fresh slab into blocks of the class.
+    bool refill(std::size_t index) noexcept
+    {
+        auto slab = this->next_slab.fetch_add(1, std::memory_order_relaxed);
+        if (slab >= this->slab_total)
+            return false;
+        this->slab_classes[slab] = static_cast<std::uint8_t>(index);
+        auto block = min_block << index;
+        auto start = this->arena + slab * slab_size;
+        auto& c = this->classes[index];
+        for (std::size_t offset = slab_size; offset >= block; offset -= block)
+        {
+            auto b = reinterpret_cast<free_block*>(start + offset - block);
+            b->next = c.free;
+            c.free = b;
+        }
+        return true;
+    }
+
+    void* allocate_fallback(std::size_t size) noexcept
+    {
+        if (!this->options.fallback)
+            return nullptr;
+        size = round_up(size);
+        auto header = static_cast<std::byte*>(std::malloc(size + fallback_header));
+        if (!header)
+            return nullptr;
+        *reinterpret_cast<std::size_t*>(header) = size;
+        this->fallback_blocks.fetch_add(1, std::memory_order_relaxed);
+        this->fallback_bytes.fetch_add(size, std::memory_order_relaxed);
+        return header + fallback_header;
+    }
+
+    arena_options options;
+    std::size_t slab_total;
+    std::byte* arena;
+    std::unique_ptr<std::uint8_t[]> slab_classes;
+    std::array<size_class, class_count> classes;
+    std::atomic<std::size_t> next_slab = 0;
+    std::atomic<std::size_t> blocks = 0;
+    std::atomic<std::size_t> fallback_blocks = 0;
+    std::atomic<std::size_t> fallback_bytes = 0;
 };
 
 }  // namespace sqlite
+
+template <typename Arena, typename... Ts>
+struct std::tuple_size<sqlite::basic_row_view<Arena, Ts...>> : std::integral_constant<std::size_t, sizeof...(Ts)>
+{};
+
+template <std::size_t I, typename Arena, typename... Ts>
+struct std::tuple_element<I, sqlite::basic_row_view<Arena, Ts...>> : std::tuple_element<I, std::tuple<Ts...>>
+{};